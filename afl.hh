@@ -0,0 +1,481 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_AFL_HH
+#define PROG_FUZZ_AFL_HH
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "capture.hh"
+
+// From AFL
+#include "config.h"
+
+// From AFL
+//
+// Segments are removed by the process that created them, not by
+// children that exit() after a failed exec().
+static pid_t shm_owner;
+static std::vector<int> shm_ids;
+
+// From AFL
+static void remove_shm(void)
+{
+	if (getpid() != shm_owner)
+		return;
+
+	for (int shm_id: shm_ids) {
+		if (shmctl(shm_id, IPC_RMID, NULL) == -1)
+			error(EXIT_FAILURE, errno, "shmctl(IPC_RMID)");
+	}
+}
+
+// A trace map gets allocated once per worker and lives for the whole
+// campaign; it is cleared (not reallocated) before each run. The same
+// goes for the environment we pass to the compiler, which tells its
+// instrumentation which segment to attach to.
+struct trace_map {
+	int shm_id;
+	uint8_t *trace_bits;
+
+	std::string shm_env;
+	std::vector<char *> envp;
+
+	trace_map():
+		shm_id(-1),
+		trace_bits(nullptr)
+	{
+	}
+
+	// From AFL
+	void setup()
+	{
+		shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+		if (shm_id < 0)
+			error(EXIT_FAILURE, errno, "shmget()");
+
+		if (shm_ids.empty()) {
+			shm_owner = getpid();
+			atexit(remove_shm);
+		}
+		shm_ids.push_back(shm_id);
+
+		trace_bits = (uint8_t *) shmat(shm_id, NULL, 0);
+		if (trace_bits == (void *) -1)
+			error(EXIT_FAILURE, errno, "shmat()");
+
+		shm_env = std::string(SHM_ENV_VAR "=") + std::to_string(shm_id);
+		for (char **env = environ; *env; ++env) {
+			if (strncmp(*env, SHM_ENV_VAR "=", strlen(SHM_ENV_VAR "=")))
+				envp.push_back(*env);
+		}
+		envp.push_back(&shm_env[0]);
+		envp.push_back(nullptr);
+	}
+
+	void clear()
+	{
+		memset(trace_bits, 0, MAP_SIZE);
+	}
+};
+
+// From AFL
+//
+// Bits of the trace map we haven't seen yet (0xff = never hit). This
+// is shared between all workers, which clear bits as they find them; it
+// only gets set again by reset_virgin_bits(), when ./main restarts.
+// Everything is atomic, since other workers may be running at the time.
+alignas(64) static uint8_t virgin_bits[MAP_SIZE];
+
+static void reset_virgin_bits(void)
+{
+	for (unsigned int i = 0; i < MAP_SIZE; ++i)
+		__atomic_store_n(&virgin_bits[i], 0xff, __ATOMIC_RELAXED);
+}
+
+// Take a snapshot while other workers may be clearing bits
+static void copy_virgin_bits(uint8_t *out)
+{
+	for (unsigned int i = 0; i < MAP_SIZE; ++i)
+		out[i] = __atomic_load_n(&virgin_bits[i], __ATOMIC_RELAXED);
+}
+
+// Number of trace map entries we've seen at least one bit of
+static unsigned int count_seen_entries(void)
+{
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < MAP_SIZE; ++i)
+		n += __atomic_load_n(&virgin_bits[i], __ATOMIC_RELAXED) != 0xff;
+
+	return n;
+}
+
+// Most of the trace map is zero after a run, so we look at it in 64-byte
+// chunks and skip those that are all zero. The trace map is page-aligned.
+static inline bool trace_chunk_is_zero(const uint8_t *p)
+{
+#if defined(__AVX512F__)
+	__m512i x = _mm512_load_si512((const void *) p);
+	return _mm512_test_epi64_mask(x, x) == 0;
+#elif defined(__AVX2__)
+	__m256i x = _mm256_or_si256(_mm256_load_si256((const __m256i *) p),
+		_mm256_load_si256((const __m256i *) (p + 32)));
+	return _mm256_testz_si256(x, x);
+#elif defined(__SSE2__)
+	__m128i x = _mm_or_si128(
+		_mm_or_si128(_mm_load_si128((const __m128i *) p), _mm_load_si128((const __m128i *) (p + 16))),
+		_mm_or_si128(_mm_load_si128((const __m128i *) (p + 32)), _mm_load_si128((const __m128i *) (p + 48))));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) == 0xffff;
+#else
+	const uint64_t *q = (const uint64_t *) p;
+	return !(q[0] | q[1] | q[2] | q[3] | q[4] | q[5] | q[6] | q[7]);
+#endif
+}
+
+// From AFL (count_class_lookup8)
+//
+// Hit counts go into buckets, so that a loop running one more time
+// doesn't look like new coverage but one running a lot more does
+static inline uint8_t count_class(uint8_t hits)
+{
+	if (hits <= 2)
+		return hits;
+	if (hits == 3)
+		return 4;
+	if (hits <= 7)
+		return 8;
+	if (hits <= 15)
+		return 16;
+	if (hits <= 31)
+		return 32;
+	if (hits <= 127)
+		return 64;
+	return 128;
+}
+
+// From AFL (classify_counts()); do this before has_new_bits()
+static void classify_counts(uint8_t *trace_bits)
+{
+	for (unsigned int i = 0; i < MAP_SIZE; i += 64) {
+		if (trace_chunk_is_zero(trace_bits + i))
+			continue;
+
+		for (unsigned int j = i; j < i + 64; ++j) {
+			if (trace_bits[j])
+				trace_bits[j] = count_class(trace_bits[j]);
+		}
+	}
+}
+
+// How many runs (that made it as far as coverage) hit each trace map
+// entry; shared between all workers like virgin_bits
+static uint32_t edge_hits[MAP_SIZE];
+
+static void reset_edge_hits(void)
+{
+	for (unsigned int i = 0; i < MAP_SIZE; ++i)
+		__atomic_store_n(&edge_hits[i], 0, __ATOMIC_RELAXED);
+}
+
+static void copy_edge_hits(uint32_t *out)
+{
+	for (unsigned int i = 0; i < MAP_SIZE; ++i)
+		out[i] = __atomic_load_n(&edge_hits[i], __ATOMIC_RELAXED);
+}
+
+// Entries hit by more runs than this aren't rare
+static const uint32_t max_rare_hits = 16;
+
+// Count the entries a run hit and return how rare they are: each one
+// that few runs have hit adds 1 / (the number of runs that have), so an
+// entry nobody has seen before is worth 1 and the ones that most runs
+// hit are worth nothing.
+static double record_edge_hits(const uint8_t *trace_bits)
+{
+	double rarity = 0;
+
+	for (unsigned int i = 0; i < MAP_SIZE; i += 64) {
+		if (trace_chunk_is_zero(trace_bits + i))
+			continue;
+
+		for (unsigned int j = i; j < i + 64; ++j) {
+			if (!trace_bits[j])
+				continue;
+
+			uint32_t hits = __atomic_add_fetch(&edge_hits[j], 1, __ATOMIC_RELAXED);
+			if (hits <= max_rare_hits)
+				rarity += 1. / hits;
+		}
+	}
+
+	return rarity;
+}
+
+// Like has_new_bits() in AFL, except that we return the number of
+// trace map entries that had bits we've never seen before. Those bits
+// are cleared from virgin_bits atomically, so when several workers hit
+// the same new entry at the same time only one of them gets the credit.
+static unsigned int has_new_bits(const uint8_t *trace_bits)
+{
+	unsigned int new_bits = 0;
+
+	for (unsigned int i = 0; i < MAP_SIZE; i += 64) {
+		if (trace_chunk_is_zero(trace_bits + i))
+			continue;
+
+		for (unsigned int j = i; j < i + 64; j += 8) {
+			uint64_t current = *(const uint64_t *) (trace_bits + j);
+			if (!current)
+				continue;
+
+			uint64_t virgin = __atomic_load_n((const uint64_t *) (virgin_bits + j), __ATOMIC_RELAXED);
+			if (!(current & virgin))
+				continue;
+
+			for (unsigned int k = j; k < j + 8; ++k) {
+				uint8_t bits = trace_bits[k];
+				if (bits && (__atomic_fetch_and(&virgin_bits[k], (uint8_t) ~bits, __ATOMIC_RELAXED) & bits))
+					++new_bits;
+			}
+		}
+	}
+
+	return new_bits;
+}
+
+// Called in a freshly fork()ed child: run the compiler in the given
+// scratch directory, reporting coverage into the given trace map.
+static void exec_target(const char *file, char *const argv[], const trace_map &trace, const char *dir)
+{
+	if (chdir(dir) == -1)
+		error(EXIT_FAILURE, errno, "%s: chdir()", dir);
+
+	if (execvpe(file, argv, trace.envp.data()) == -1)
+		error(EXIT_FAILURE, errno, "execvpe()");
+}
+
+// Wait for a child to exit and return its waitpid() status
+static int wait_child(pid_t child)
+{
+	int status;
+	while (true) {
+		pid_t kid = waitpid(child, &status, 0);
+		if (kid == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			error(EXIT_FAILURE, errno, "waitpid()");
+		}
+
+		if (kid != child)
+			error(EXIT_FAILURE, 0, "kid != child");
+
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			break;
+	}
+
+	return status;
+}
+
+static uint64_t monotonic_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Returns false if fd didn't become readable within timeout_ms. With a
+// capture, the compiler's output gets read as it comes in, and we give
+// up early if it prints too much (see capture.hh).
+static bool wait_readable(int fd, unsigned int timeout_ms, stderr_capture *capture = nullptr)
+{
+	struct pollfd pfd[2];
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	if (capture) {
+		pfd[1].fd = capture->read_fd;
+		pfd[1].events = POLLIN;
+	}
+
+	uint64_t deadline = monotonic_ms() + timeout_ms;
+
+	while (true) {
+		uint64_t t = monotonic_ms();
+		int ret = poll(pfd, capture ? 2 : 1, t < deadline ? deadline - t : 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			error(EXIT_FAILURE, errno, "poll()");
+		}
+
+		// Once fd is readable the compiler is done, so this gets
+		// everything it printed
+		if (capture && !capture->drain())
+			return false;
+
+		if (ret == 0)
+			return false;
+		if (pfd[0].revents)
+			return true;
+	}
+}
+
+// Like wait_child(), but SIGKILL the child if it's still running after
+// timeout_ms (or, with a capture, once it has printed too much). A
+// pidfd becomes readable when the process exits.
+static int wait_child(pid_t child, unsigned int timeout_ms, bool &timed_out, stderr_capture *capture = nullptr)
+{
+	int pidfd = syscall(SYS_pidfd_open, child, 0);
+	if (pidfd == -1)
+		error(EXIT_FAILURE, errno, "pidfd_open()");
+
+	timed_out = !wait_readable(pidfd, timeout_ms, capture);
+	if (timed_out)
+		kill(child, SIGKILL);
+
+	close(pidfd);
+	return wait_child(child);
+}
+
+// Write a whole buffer (typically a rendered program) to a pipe or file
+static void write_all(int fd, const std::string &buf)
+{
+	const char *p = buf.data();
+	size_t len = buf.size();
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			error(EXIT_FAILURE, errno, "write()");
+		}
+
+		p += n;
+		len -= n;
+	}
+}
+
+// Persistent fork server (see init_forkserver() and run_target() in
+// afl-fuzz.c). The instrumented compiler is exec()ed once; it stops in
+// the AFL instrumentation and fork()s a fresh copy of itself every time
+// we ask it to, which saves us dynamic linking and global initialisation
+// for every single test case.
+//
+// The trace map must have been set up before calling start(), since the
+// target only attaches to it once.
+struct forkserver {
+	pid_t pid;
+	int ctl_fd;
+	int st_fd;
+
+	// the target's current child and whether we had to kill the last one
+	pid_t child;
+	uint32_t prev_timed_out;
+
+	forkserver():
+		pid(-1),
+		ctl_fd(-1),
+		st_fd(-1),
+		child(-1),
+		prev_timed_out(0)
+	{
+	}
+
+	// stdin_fd must refer to a regular file: the forked children all
+	// share the same file description, so the caller rewrites it and
+	// lseek()s back to the start before each run.
+	void start(const char *file, char *const argv[], const trace_map &trace, const char *dir, int stdin_fd, int stdout_fd, int stderr_fd)
+	{
+		int st_pipe[2];
+		if (pipe2(st_pipe, O_CLOEXEC) == -1)
+			error(EXIT_FAILURE, errno, "pipe2()");
+
+		int ctl_pipe[2];
+		if (pipe2(ctl_pipe, O_CLOEXEC) == -1)
+			error(EXIT_FAILURE, errno, "pipe2()");
+
+		pid = fork();
+		if (pid == -1)
+			error(EXIT_FAILURE, errno, "fork()");
+
+		if (pid == 0) {
+			dup2(stdin_fd, STDIN_FILENO);
+			dup2(stdout_fd, STDOUT_FILENO);
+			dup2(stderr_fd, STDERR_FILENO);
+
+			if (dup2(ctl_pipe[0], FORKSRV_FD) == -1)
+				error(EXIT_FAILURE, errno, "dup2()");
+			if (dup2(st_pipe[1], FORKSRV_FD + 1) == -1)
+				error(EXIT_FAILURE, errno, "dup2()");
+
+			exec_target(file, argv, trace, dir);
+		}
+
+		close(ctl_pipe[0]);
+		close(st_pipe[1]);
+
+		ctl_fd = ctl_pipe[1];
+		st_fd = st_pipe[0];
+
+		// The fork server says hello when it's ready to go
+		uint32_t status;
+		if (read(st_fd, &status, 4) != 4)
+			error(EXIT_FAILURE, 0, "fork server handshake failed (is the compiler instrumented?)");
+	}
+
+	// Start running the target once; the caller is free to do other
+	// work until it calls wait().
+	void start_run()
+	{
+		if (write(ctl_fd, &prev_timed_out, 4) != 4)
+			error(EXIT_FAILURE, errno, "fork server: write()");
+
+		if (read(st_fd, &child, 4) != 4)
+			error(EXIT_FAILURE, errno, "fork server: read()");
+		if (child <= 0)
+			error(EXIT_FAILURE, 0, "fork server is misbehaving");
+	}
+
+	// Wait for the run started by start_run() and return its waitpid()
+	// status; the child gets SIGKILLed if it takes longer than timeout_ms
+	// or prints too much (the fork server still reports its status).
+	int wait(unsigned int timeout_ms, bool &timed_out, stderr_capture *capture = nullptr)
+	{
+		timed_out = !wait_readable(st_fd, timeout_ms, capture);
+		if (timed_out)
+			kill(child, SIGKILL);
+		prev_timed_out = timed_out;
+
+		int status;
+		if (read(st_fd, &status, 4) != 4)
+			error(EXIT_FAILURE, errno, "fork server: read()");
+
+		return status;
+	}
+};
+
+#endif
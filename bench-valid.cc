@@ -0,0 +1,57 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+// Benchmarks for ./main-valid: cloning, printing and transforming
+// programs of increasing size.
+
+#define PROG_FUZZ_BENCH
+#include "main-valid.cc"
+
+#include "bench.hh"
+
+// Programs get grown by this many random transformations
+static const unsigned int bench_program_sizes[] = { 25, 250, 2500 };
+
+int main(int argc, char *argv[])
+{
+	use_own_free_lists();
+
+	if (transformations.size() != sizeof(transformation_names) / sizeof(*transformation_names))
+		error(EXIT_FAILURE, 0, "transformation_names doesn't match transformations");
+
+	print_bench_header();
+
+	for (unsigned int nr_transformations: bench_program_sizes) {
+		// The same programs every time, however many operations the
+		// benchmarks before managed
+		re = rng(nr_transformations);
+
+		// Like the fresh programs in next_candidate()
+		auto p = make_node<program>(std::uniform_int_distribution<int>()(re));
+		for (unsigned int i = 0; i < nr_transformations; ++i)
+			p = transformations[std::uniform_int_distribution<unsigned int>(0, transformations.size() - 1)(re)](p);
+
+		unsigned int nr_exprs = p->nr_exprs();
+
+		bench("program::clone", nr_exprs, [&]() {
+			p->clone();
+		});
+
+		std::string source;
+		bench("program::print", nr_exprs, [&]() {
+			source.clear();
+			p->print(source);
+		});
+
+		bench("program::memory", nr_exprs, [&]() {
+			bench_sink = p->memory();
+		});
+
+		for (unsigned int i = 0; i < transformations.size(); ++i) {
+			bench(transformation_names[i], nr_exprs, [&]() {
+				transformations[i](p);
+			});
+		}
+	}
+
+	return 0;
+}
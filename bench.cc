@@ -0,0 +1,140 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+// Benchmarks for ./main: mutating, copying and printing trees of
+// increasing size, and scanning the trace map after a run.
+
+#define PROG_FUZZ_BENCH
+#include "main.cc"
+
+#include "bench.hh"
+
+// Trees get grown to (at least) this many nodes
+static const unsigned int bench_tree_sizes[] = { 100, 1000, 10000, 100000 };
+
+// Fraction of the trace map a run hits
+static const double bench_trace_densities[] = { .001, .01, .1 };
+
+// A tree the way the fuzzer makes them: start from an empty node and
+// apply random mutations to random leaves. We start over if we run out
+// of leaves before the tree is big enough.
+static testcase bench_tree(unsigned int min_nodes, unsigned int &nr_nodes)
+{
+	while (true) {
+		auto root = make_node<node>();
+		auto leaves = std::make_shared<leaf_vec>(1, root.get());
+		nr_nodes = 1;
+
+		while (!leaves->empty()) {
+			if (nr_nodes >= min_nodes)
+				return testcase(0, root, leaves, 0, std::set<unsigned int>(), 1, 0, 0, 0, 0);
+
+			unsigned int leaf = std::uniform_int_distribution<int>(0, leaves->size() - 1)(re);
+			unsigned int mutation = std::uniform_int_distribution<int>(0, grammar.size() - 1)(re);
+			root = mutate(root, *leaves, leaf, mutation);
+			nr_nodes += grammar[mutation].size();
+		}
+	}
+}
+
+static void bench_trees()
+{
+	for (unsigned int min_nodes: bench_tree_sizes) {
+		// The same trees every time, however many operations the
+		// benchmarks before managed
+		re = rng(min_nodes);
+
+		unsigned int nr_nodes;
+		auto t = bench_tree(min_nodes, nr_nodes);
+
+		// What next_candidate() does, including copying the leaves
+		bench("mutate", nr_nodes, [&]() {
+			leaf_vec leaves(*t.leaves);
+			unsigned int leaf = std::uniform_int_distribution<int>(0, leaves.size() - 1)(re);
+			unsigned int mutation = std::uniform_int_distribution<int>(0, grammar.size() - 1)(re);
+			mutate(t.root, leaves, leaf, mutation);
+		});
+
+		bench("replace", nr_nodes, [&]() {
+			unsigned int leaf = std::uniform_int_distribution<int>(0, t.leaves->size() - 1)(re);
+			replace(t.root, (*t.leaves)[leaf], make_node<node>());
+		});
+
+		leaf_vec leaves;
+		bench("find_leaves", nr_nodes, [&]() {
+			leaves.clear();
+			find_leaves(t.root.get(), leaves);
+		});
+
+		std::string source;
+		bench("print", nr_nodes, [&]() {
+			source.clear();
+			t.root->print(source);
+		});
+
+		bench("size", nr_nodes, [&]() {
+			bench_sink = t.root->size();
+		});
+	}
+}
+
+// A trace map hit in random places, with the hit counts a real run has
+static void bench_trace_map(uint8_t *trace_bits, double density)
+{
+	memset(trace_bits, 0, MAP_SIZE);
+
+	std::geometric_distribution<unsigned int> hits(.3);
+	for (unsigned int i = 0; i < density * MAP_SIZE; ++i)
+		trace_bits[std::uniform_int_distribution<unsigned int>(0, MAP_SIZE - 1)(re)] = 1 + std::min(254u, hits(re));
+}
+
+static void bench_coverage()
+{
+	// Page-aligned like the real (shm) one
+	alignas(4096) static uint8_t trace_bits[MAP_SIZE];
+	alignas(4096) static uint8_t classified_bits[MAP_SIZE];
+
+	for (double density: bench_trace_densities) {
+		re = rng(density * MAP_SIZE);
+		bench_trace_map(trace_bits, density);
+
+		unsigned int nr_entries = 0;
+		for (unsigned int i = 0; i < MAP_SIZE; ++i)
+			nr_entries += trace_bits[i] != 0;
+
+		bench("classify_counts", nr_entries, [&]() {
+			memcpy(classified_bits, trace_bits, MAP_SIZE);
+			classify_counts(classified_bits);
+		});
+
+		// Only the first run finds anything new, like most real runs
+		reset_virgin_bits();
+		bench("has_new_bits", nr_entries, [&]() {
+			has_new_bits(classified_bits);
+		});
+
+		reset_edge_hits();
+		bench("record_edge_hits", nr_entries, [&]() {
+			record_edge_hits(classified_bits);
+		});
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	use_own_free_lists();
+
+	re = rng(1);
+
+	load_builtin_grammar();
+	mutation_scheduler = scheduler(grammar.size());
+
+	print_bench_header();
+
+	bench("scheduler::pick", grammar.size(), [&]() {
+		bench_sink = mutation_scheduler.pick(re);
+	});
+
+	bench_trees();
+	bench_coverage();
+	return 0;
+}
@@ -0,0 +1,90 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_BENCH_HH
+#define PROG_FUZZ_BENCH_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <new>
+
+#include "pool.hh"
+#include "stats.hh"
+
+// Micro-benchmarks for the fuzzers' own hot paths (mutating, printing,
+// scanning the trace map), without running a compiler, so that we can
+// see what the fuzzer costs on top of cc1plus and catch regressions.
+// See bench.cc and bench-valid.cc; make-bench.sh builds both.
+//
+// Every benchmark reports time, allocations and allocated bytes per
+// operation. Allocations count both the heap (operator new, which we
+// replace here) and the node pools (see pool.hh).
+
+// How long each benchmark runs for (in microseconds)
+static const uint64_t min_bench_us = 200000;
+
+static thread_local uint64_t nr_heap_allocs;
+static thread_local uint64_t heap_alloc_bytes;
+
+// Not inlined, or gcc sees the malloc() and free() in the middle and
+// complains that they don't match new and delete
+__attribute__((noinline)) void *operator new(size_t size)
+{
+	++nr_heap_allocs;
+	heap_alloc_bytes += size;
+
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+// For results we don't otherwise look at, so they don't get optimised out
+static volatile unsigned int bench_sink;
+
+static void print_bench_header()
+{
+	printf("%-44s %8s %12s %12s %12s\n", "benchmark", "size", "ns/op", "allocs/op", "bytes/op");
+}
+
+// Run op over and over for at least min_bench_us (after one warm-up
+// run) and print the per-operation averages. size is whatever says
+// how big the input was (nodes, expressions, trace map entries hit).
+template<typename F>
+static void bench(const char *name, unsigned int size, F op)
+{
+	op();
+
+	uint64_t nr_ops = 0;
+	uint64_t allocs = nr_heap_allocs + nr_node_allocs;
+	uint64_t bytes = heap_alloc_bytes + node_alloc_bytes;
+	uint64_t start = now_us();
+	uint64_t elapsed;
+
+	// Check the time every so often only; it's not free either
+	do {
+		for (unsigned int i = 0; i < 16; ++i)
+			op();
+		nr_ops += 16;
+		elapsed = now_us() - start;
+	} while (elapsed < min_bench_us);
+
+	allocs = nr_heap_allocs + nr_node_allocs - allocs;
+	bytes = heap_alloc_bytes + node_alloc_bytes - bytes;
+
+	printf("%-44s %8u %12.0f %12.1f %12.0f\n", name, size,
+		1000. * elapsed / nr_ops, (double) allocs / nr_ops, (double) bytes / nr_ops);
+}
+
+#endif
@@ -0,0 +1,263 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_BUGS_HH
+#define PROG_FUZZ_BUGS_HH
+
+#include <ctype.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "afl.hh"
+
+// Bugs we've found so far.
+//
+// Finding a bug doesn't stop the campaign: the worker that found it
+// writes out a reproducer, shrinks it (see reduce() in main.cc and
+// main-valid.cc) using its own compiler while the other workers keep
+// fuzzing, and then goes back to fuzzing itself.
+//
+// ICEs are put into buckets by where the compiler fell over, so each one
+// only gets reported once however many test cases hit it. Buckets we
+// already know about (reported upstream, or just not interesting) are
+// listed in a file that gets loaded at startup; see known-ices.txt.
+
+// How long we spend shrinking a single reproducer (in seconds)
+static const unsigned int max_reduce_seconds = 300;
+
+// The compiler exits with this after printing an ICE, including when it
+// crashes (ICE_EXIT_CODE in gcc/system.h); there's no point looking at
+// its output for any other exit code
+static const int ice_exit_code = 4;
+
+// How many backtrace frames go into a bucket
+static const unsigned int nr_bucket_frames = 3;
+
+// An ICE, reduced to the parts that don't depend on the test case
+struct ice_bucket {
+	// Whatever comes after "internal compiler error: ", usually
+	// "in X, at file:line", with anything quoted from the program
+	// replaced by '...'
+	std::string message;
+
+	// X, if the message says which function failed
+	std::string function;
+
+	// Innermost backtrace frames, without addresses or arguments
+	std::vector<std::string> frames;
+
+	// Not part of the bucket, only for matching known ICEs: every frame
+	// of the backtrace, and whatever the compiler printed before the ICE
+	std::vector<std::string> backtrace;
+	std::string preceding;
+
+	bool empty() const
+	{
+		return message.empty();
+	}
+
+	// The whole bucket on one line, as it goes into the known ICEs file
+	std::string key() const
+	{
+		std::string k = message;
+		for (const auto &frame: frames)
+			k += " | " + frame;
+		return k;
+	}
+};
+
+// GCC quotes things like ‘this’ (or 'this', depending on the locale)
+static bool match_quote(const char *p, const char *&inside, const char *&close)
+{
+	if (!strncmp(p, "\xe2\x80\x98", 3)) {
+		inside = p + 3;
+		close = "\xe2\x80\x99";
+		return true;
+	}
+
+	if (*p == '\'') {
+		inside = p + 1;
+		close = "'";
+		return true;
+	}
+
+	return false;
+}
+
+static std::string normalize_ice_message(const char *start, const char *end)
+{
+	std::string message;
+
+	const char *p = start;
+	while (p < end) {
+		const char *inside;
+		const char *close;
+		if (match_quote(p, inside, close)) {
+			const char *q = strstr(inside, close);
+			if (q && q < end) {
+				message += "'...'";
+				p = q + strlen(close);
+				continue;
+			}
+		}
+
+		message += *p++;
+	}
+
+	return message;
+}
+
+// Pick the ICE (if any) out of the compiler's output
+static ice_bucket parse_ice(const char *buffer)
+{
+	ice_bucket b;
+
+	const char *start = strstr(buffer, ice_marker);
+	if (!start)
+		return b;
+
+	start += strlen(ice_marker);
+	const char *end = strchrnul(start, '\n');
+	b.message = normalize_ice_message(start, end);
+
+	size_t at = b.message.rfind(", at ");
+	if (at != std::string::npos) {
+		size_t in = b.message.rfind("in ", at);
+		if (in != std::string::npos && (in == 0 || b.message[in - 1] == ' '))
+			b.function = b.message.substr(in + 3, at - in - 3);
+	}
+
+	const char *line_start = start - strlen(ice_marker);
+	while (line_start > buffer && line_start[-1] != '\n')
+		--line_start;
+	b.preceding = std::string(buffer, line_start);
+
+	// Frames look like "0x8a1b2c xref_basetypes(tree_node*, tree_node*)"
+	// with the source location on the next line
+	for (const char *line = end; *line; ) {
+		++line;
+		const char *eol = strchrnul(line, '\n');
+
+		if (!strncmp(line, "0x", 2)) {
+			const char *name = strchr(line, ' ');
+			if (name && name < eol) {
+				++name;
+				const char *name_end = name;
+				while (name_end < eol && *name_end != '(')
+					++name_end;
+				b.backtrace.push_back(std::string(name, name_end));
+				if (b.frames.size() < nr_bucket_frames)
+					b.frames.push_back(b.backtrace.back());
+			}
+		}
+
+		line = eol;
+	}
+
+	return b;
+}
+
+// ICEs we don't want to hear about. An entry matches a bucket's key, its
+// message, or the function it names; a "frame: " entry matches an ICE
+// with that function anywhere in its backtrace, and an "after: " entry
+// one that comes after a diagnostic with that in it. Only written before
+// the workers start, so lookups don't need a lock.
+static std::unordered_set<std::string> known_ices;
+static std::unordered_set<std::string> known_frames;
+static std::vector<std::string> known_preceding;
+
+static const char known_frame_prefix[] = "frame: ";
+static const char known_preceding_prefix[] = "after: ";
+
+// Returns false if there is no such file
+static bool load_known_ices(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return false;
+		error(EXIT_FAILURE, errno, "%s: fopen()", filename);
+	}
+
+	char *line = nullptr;
+	size_t size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &size, f)) != -1) {
+		while (len > 0 && isspace((unsigned char) line[len - 1]))
+			line[--len] = '\0';
+
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		if (!strncmp(line, known_frame_prefix, strlen(known_frame_prefix)))
+			known_frames.insert(std::string(line + strlen(known_frame_prefix), len - strlen(known_frame_prefix)));
+		else if (!strncmp(line, known_preceding_prefix, strlen(known_preceding_prefix)))
+			known_preceding.push_back(std::string(line + strlen(known_preceding_prefix), len - strlen(known_preceding_prefix)));
+		else
+			known_ices.insert(std::string(line, len));
+	}
+
+	free(line);
+	fclose(f);
+	return true;
+}
+
+static bool is_known_ice(const ice_bucket &b)
+{
+	if (known_ices.count(b.key())
+		|| known_ices.count(b.message)
+		|| (!b.function.empty() && known_ices.count(b.function)))
+		return true;
+
+	for (const auto &frame: b.backtrace) {
+		if (known_frames.count(frame))
+			return true;
+	}
+
+	for (const auto &diagnostic: known_preceding) {
+		if (b.preceding.find(diagnostic) != std::string::npos)
+			return true;
+	}
+
+	return false;
+}
+
+// Returns true the first time we see a given signature, so that the
+// same bug only gets reported (and reduced) once
+static bool first_report(const std::string &signature)
+{
+	static std::mutex mutex;
+	static std::unordered_set<std::string> signatures;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return signatures.insert(signature).second;
+}
+
+// Bugs are numbered in the order we find them (for the file names)
+static unsigned int next_bug_id()
+{
+	static std::atomic<unsigned int> nr_bugs;
+	return nr_bugs++;
+}
+
+static void write_reproducer(const char *filename, const std::string &source)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		error(EXIT_FAILURE, errno, "%s: open()", filename);
+
+	write_all(fd, source);
+	close(fd);
+}
+
+#endif
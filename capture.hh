@@ -0,0 +1,178 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_CAPTURE_HH
+#define PROG_FUZZ_CAPTURE_HH
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// The compiler's diagnostics.
+//
+// They go to a pipe that we read from while we wait for the compiler
+// (see wait_readable() in afl.hh), so nothing touches the disk. Only
+// the first half of the buffer's worth and the latest half stay in
+// memory however much it prints; once a line saying "internal compiler
+// error: " goes past, that line and as much as fits after it (the
+// backtrace) stay instead of the latest. With a limit set, a compiler
+// that prints more than that without an ICE gets killed.
+
+static const char ice_marker[] = "internal compiler error: ";
+
+static const size_t stderr_buffer_size = 10 * 4096;
+
+// We'd rather not leave the compiler waiting on the pipe while we're
+// busy with something else
+static const int stderr_pipe_size = 1 << 20;
+
+struct stderr_capture {
+	int read_fd;
+	int write_fd;
+
+	// 0 for no limit
+	size_t limit;
+
+	char buffer[stderr_buffer_size + 1];
+	size_t len;
+
+	// everything it printed, including what we threw away
+	size_t total;
+
+	// where the ICE line starts in buffer, if there is one
+	bool ice;
+	size_t ice_line;
+
+	// went over the limit (without an ICE)
+	bool too_much;
+
+	stderr_capture():
+		read_fd(-1),
+		write_fd(-1),
+		limit(0),
+		len(0),
+		total(0),
+		ice(false),
+		ice_line(0),
+		too_much(false)
+	{
+		buffer[0] = '\0';
+	}
+
+	stderr_capture(const stderr_capture &) = delete;
+
+	void setup(size_t limit)
+	{
+		this->limit = limit;
+
+		int pipefd[2];
+		if (pipe2(pipefd, O_CLOEXEC) == -1)
+			error(EXIT_FAILURE, errno, "pipe2()");
+
+		// Only our end; the compiler blocks if it gets ahead of us
+		if (fcntl(pipefd[0], F_SETFL, O_NONBLOCK) == -1)
+			error(EXIT_FAILURE, errno, "fcntl()");
+
+		// Not fatal; we just get woken up more often
+		fcntl(pipefd[0], F_SETPIPE_SZ, stderr_pipe_size);
+
+		read_fd = pipefd[0];
+		write_fd = pipefd[1];
+	}
+
+	// Before each run; also throws away anything left over from the
+	// last one
+	void reset()
+	{
+		drain();
+
+		len = 0;
+		total = 0;
+		ice = false;
+		ice_line = 0;
+		too_much = false;
+		buffer[0] = '\0';
+	}
+
+	void append(const char *p, size_t n)
+	{
+		const size_t head = stderr_buffer_size / 2;
+		const size_t marker_len = sizeof(ice_marker) - 1;
+
+		total += n;
+
+		while (n) {
+			// Make room by throwing away the oldest bytes after
+			// the first half, but not the ICE
+			if (len == stderr_buffer_size) {
+				size_t drop = std::min(n, len - head);
+				if (ice)
+					drop = std::min(drop, ice_line > head ? ice_line - head : 0);
+				if (!drop)
+					break;
+
+				memmove(buffer + head, buffer + head + drop, len - head - drop);
+				len -= drop;
+				if (ice)
+					ice_line -= drop;
+			}
+
+			// Where a marker ending in the new bytes could start
+			size_t from = len > marker_len - 1 ? len - (marker_len - 1) : 0;
+
+			size_t k = std::min(n, stderr_buffer_size - len);
+			memcpy(buffer + len, p, k);
+			len += k;
+			p += k;
+			n -= k;
+
+			if (!ice) {
+				const char *m = (const char *) memmem(buffer + from, len - from, ice_marker, marker_len);
+				if (m) {
+					const char *line = m;
+					while (line > buffer && line[-1] != '\n')
+						--line;
+
+					ice = true;
+					ice_line = line - buffer;
+				}
+			}
+		}
+
+		buffer[len] = '\0';
+
+		too_much = limit && total > limit && !ice;
+	}
+
+	// Read whatever there is without blocking; returns false once the
+	// compiler has printed more than we're willing to wait for
+	bool drain()
+	{
+		char chunk[4096];
+		while (true) {
+			ssize_t n = read(read_fd, chunk, sizeof(chunk));
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					break;
+				error(EXIT_FAILURE, errno, "read()");
+			}
+
+			// Can't happen while we have the other end open
+			if (n == 0)
+				break;
+
+			append(chunk, n);
+		}
+
+		return !too_much;
+	}
+};
+
+#endif
@@ -0,0 +1,222 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_CORPUS_HH
+#define PROG_FUZZ_CORPUS_HH
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "afl.hh"
+
+// Corpus checkpoints.
+//
+// Every so often the queue/pool (test cases, their metadata and the
+// coverage we've seen so far) gets saved to a single binary file, which
+// can be given to --corpus to pick up where we left off after a crash
+// or a reboot. Everything is fixed-width and native-endian, so loading
+// is just a walk over the mmap()ed file; it's not meant to be portable
+// between machines.
+
+static const uint32_t corpus_version = 4;
+
+struct corpus_writer {
+	std::string buf;
+
+	// Without a header, for building parts of a file separately
+	corpus_writer()
+	{
+	}
+
+	corpus_writer(uint32_t magic)
+	{
+		put(magic);
+		put(corpus_version);
+	}
+
+	void put(const void *p, size_t len)
+	{
+		buf.append((const char *) p, len);
+	}
+
+	template<typename T>
+	void put(T x)
+	{
+		static_assert(std::is_arithmetic<T>::value, "only numbers");
+		put(&x, sizeof(x));
+	}
+
+	void put_string(const std::string &s)
+	{
+		put<uint32_t>(s.size());
+		buf += s;
+	}
+
+	// Leave room for a number we don't know yet; see put_at()
+	template<typename T>
+	size_t reserve()
+	{
+		size_t offset = buf.size();
+		put<T>(0);
+		return offset;
+	}
+
+	template<typename T>
+	void put_at(size_t offset, T x)
+	{
+		static_assert(std::is_arithmetic<T>::value, "only numbers");
+		memcpy(&buf[offset], &x, sizeof(x));
+	}
+
+	// Write a new file and rename it so we never leave a partial one
+	void save(const char *filename)
+	{
+		char tmp_filename[PATH_MAX];
+		if (snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename) >= (int) sizeof(tmp_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", filename);
+
+		int fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd == -1)
+			error(EXIT_FAILURE, errno, "%s: open()", tmp_filename);
+
+		write_all(fd, buf);
+
+		if (fsync(fd) == -1)
+			error(EXIT_FAILURE, errno, "%s: fsync()", tmp_filename);
+		close(fd);
+
+		if (rename(tmp_filename, filename) == -1)
+			error(EXIT_FAILURE, errno, "%s: rename()", filename);
+	}
+};
+
+struct corpus_reader {
+	const char *filename;
+
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
+
+	corpus_reader():
+		filename(nullptr),
+		data(nullptr),
+		size(0),
+		pos(0)
+	{
+	}
+
+	~corpus_reader()
+	{
+		if (data)
+			munmap((void *) data, size);
+	}
+
+	// Returns false if there is no such file (yet)
+	bool open(const char *filename, uint32_t magic)
+	{
+		this->filename = filename;
+
+		int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			if (errno == ENOENT)
+				return false;
+			error(EXIT_FAILURE, errno, "%s: open()", filename);
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) == -1)
+			error(EXIT_FAILURE, errno, "%s: fstat()", filename);
+
+		size = st.st_size;
+		if (size == 0)
+			error(EXIT_FAILURE, 0, "%s: empty corpus", filename);
+
+		void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			error(EXIT_FAILURE, errno, "%s: mmap()", filename);
+		close(fd);
+
+		data = (const uint8_t *) map;
+
+		if (get<uint32_t>() != magic)
+			error(EXIT_FAILURE, 0, "%s: not a corpus for this fuzzer", filename);
+		if (get<uint32_t>() != corpus_version)
+			error(EXIT_FAILURE, 0, "%s: unsupported corpus version", filename);
+
+		return true;
+	}
+
+	void get(void *p, size_t len)
+	{
+		if (len > size - pos)
+			error(EXIT_FAILURE, 0, "%s: truncated corpus", filename);
+
+		memcpy(p, data + pos, len);
+		pos += len;
+	}
+
+	template<typename T>
+	T get()
+	{
+		static_assert(std::is_arithmetic<T>::value, "only numbers");
+
+		T x;
+		get(&x, sizeof(x));
+		return x;
+	}
+
+	// Something that was saved earlier in the file, by its index
+	template<typename T>
+	T get_ref(const std::vector<T> &saved)
+	{
+		uint32_t i = get<uint32_t>();
+		if (i >= saved.size())
+			error(EXIT_FAILURE, 0, "%s: corrupt corpus", filename);
+
+		return saved[i];
+	}
+
+	std::string get_string()
+	{
+		uint32_t len = get<uint32_t>();
+		if (len > size - pos)
+			error(EXIT_FAILURE, 0, "%s: truncated corpus", filename);
+
+		std::string s((const char *) data + pos, len);
+		pos += len;
+		return s;
+	}
+};
+
+// How often the corpus gets saved (in seconds)
+static const unsigned int checkpoint_interval = 60;
+
+// Body of the checkpoint thread: save every checkpoint_interval seconds
+// until stop gets set, and once more at the end.
+static void run_checkpoints(const std::atomic<bool> &stop, void (*checkpoint)())
+{
+	unsigned int seconds = 0;
+	while (!stop) {
+		sleep(1);
+		if (++seconds % checkpoint_interval == 0)
+			checkpoint();
+	}
+
+	checkpoint();
+}
+
+#endif
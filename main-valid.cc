@@ -1,7 +1,6 @@
 // Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -9,29 +8,53 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <error.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
 #include <set>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 // From AFL
 #include "config.h"
 
+#include "afl.hh"
+#include "bugs.hh"
+#include "corpus.hh"
+#include "pool.hh"
+#include "replay.hh"
+#include "rng.hh"
+#include "scheduler.hh"
+#include "seen.hh"
+#include "stats.hh"
+#include "sync.hh"
+
 // Parameters
 
 static const unsigned int pool_size = 250;
 static const unsigned int nr_initial_transformations = 250;
 static const unsigned int nr_transformations_multiplier = 25;
 
+// Programs that get to parts of the compiler few others do are worth
+// keeping even without new coverage; see record_edge_hits()
+static const double min_rarity = 1;
+
 // parameter to the geometric distribution we use to pick expressions to mutate
 static const double find_p = .25;
 
@@ -78,6 +101,190 @@ struct visitor {
 	virtual void visit(function_ptr fn, function_ptr &) {}
 };
 
+// Per-program index of the nodes that transformations look for, so that
+// we don't have to walk (and sort) the whole program every time we want
+// to pick one. It is kept up to date by program::replace() & co.
+
+enum index_kind {
+	INDEX_INT_LITERAL,
+	INDEX_BLOCK,
+	NR_INDEX_KINDS,
+};
+
+struct index_entry {
+	// Raw pointers are fine: the program owns everything it indexes
+	expression *expr;
+	unsigned int generation;
+
+	// Index into program::fn_names, or no_fn for top-level declarations
+	unsigned int fn;
+	bool unreachable;
+
+	static const unsigned int no_fn = -1;
+
+	index_entry(expression *expr, unsigned int generation, unsigned int fn, bool unreachable):
+		expr(expr),
+		generation(generation),
+		fn(fn),
+		unreachable(unreachable)
+	{
+	}
+
+	bool operator<(const index_entry &other) const
+	{
+		return generation < other.generation;
+	}
+};
+
+// The index is as persistent as the programs: each kind is a list of
+// chunks of entries, and a clone shares the lists (and the chunks) with
+// the original. Whatever a program changes gets copied first, unless it
+// is the only one using it: the list (a pointer per chunk) and the one
+// chunk the entry is in.
+static const size_t index_chunk_size = 64;
+
+struct index_chunk {
+	// Sorted by generation in ascending order, and everything in it
+	// comes after everything in the chunks before it
+	std::vector<index_entry> entries;
+};
+
+typedef std::shared_ptr<index_chunk> index_chunk_ptr;
+typedef std::vector<index_chunk_ptr> index_list;
+
+struct node_index {
+	std::shared_ptr<index_list> lists[NR_INDEX_KINDS];
+
+	const index_list &entries(index_kind kind) const
+	{
+		static const index_list empty;
+		return lists[kind] ? *lists[kind] : empty;
+	}
+
+	// Returns nullptr if it isn't there
+	const index_entry *find(index_kind kind, expression *expr, unsigned int generation) const
+	{
+		size_t chunk_i;
+		size_t entry_i;
+		if (!locate(kind, expr, generation, chunk_i, entry_i))
+			return nullptr;
+
+		return &(*lists[kind])[chunk_i]->entries[entry_i];
+	}
+
+	void add(index_kind kind, const index_entry &entry)
+	{
+		index_list &list = own_list(kind);
+		if (list.empty())
+			list.push_back(std::make_shared<index_chunk>());
+
+		// The last chunk that doesn't start after it; almost always
+		// the last one, since new nodes have the newest generation
+		auto it = std::upper_bound(list.begin(), list.end(), entry.generation, [](unsigned int generation, const index_chunk_ptr &c) {
+			return !c->entries.empty() && generation < c->entries.front().generation;
+		});
+		size_t chunk_i = it == list.begin() ? 0 : it - list.begin() - 1;
+
+		auto &v = own_chunk(list, chunk_i).entries;
+		v.insert(std::upper_bound(v.begin(), v.end(), entry), entry);
+
+		if (v.size() > index_chunk_size) {
+			auto second = std::make_shared<index_chunk>();
+			second->entries.reserve(index_chunk_size + 1);
+			second->entries.assign(v.begin() + v.size() / 2, v.end());
+			v.erase(v.begin() + v.size() / 2, v.end());
+			list.insert(list.begin() + chunk_i + 1, second);
+		}
+	}
+
+	void remove(index_kind kind, expression *expr, unsigned int generation)
+	{
+		size_t chunk_i;
+		size_t entry_i;
+		if (!locate(kind, expr, generation, chunk_i, entry_i))
+			return;
+
+		index_list &list = own_list(kind);
+		auto &v = own_chunk(list, chunk_i).entries;
+		v.erase(v.begin() + entry_i);
+		if (v.empty())
+			list.erase(list.begin() + chunk_i);
+	}
+
+	// A node got copied (with the same generation) by path copying
+	void rename(index_kind kind, expression *old_expr, expression *new_expr, unsigned int generation)
+	{
+		size_t chunk_i;
+		size_t entry_i;
+		if (!locate(kind, old_expr, generation, chunk_i, entry_i))
+			return;
+
+		own_chunk(own_list(kind), chunk_i).entries[entry_i].expr = new_expr;
+	}
+
+	// Roughly what the index holds, counting shared chunks in full
+	size_t memory() const
+	{
+		size_t n = 0;
+		for (const auto &list: lists) {
+			if (!list)
+				continue;
+
+			n += list->capacity() * sizeof(index_chunk_ptr);
+			for (const auto &c: *list)
+				n += sizeof(index_chunk) + 2 * sizeof(long) + c->entries.capacity() * sizeof(index_entry);
+		}
+
+		return n;
+	}
+
+private:
+	bool locate(index_kind kind, expression *expr, unsigned int generation, size_t &chunk_i, size_t &entry_i) const
+	{
+		const index_list &list = entries(kind);
+
+		// Entries with the same generation may span several chunks
+		auto it = std::lower_bound(list.begin(), list.end(), generation, [](const index_chunk_ptr &c, unsigned int generation) {
+			return c->entries.back().generation < generation;
+		});
+		for (; it != list.end() && (*it)->entries.front().generation <= generation; ++it) {
+			const auto &v = (*it)->entries;
+			auto range = std::equal_range(v.begin(), v.end(), index_entry(expr, generation, 0, false));
+			for (auto e = range.first; e != range.second; ++e) {
+				if (e->expr == expr) {
+					chunk_i = it - list.begin();
+					entry_i = e - v.begin();
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+
+	index_list &own_list(index_kind kind)
+	{
+		auto &list = lists[kind];
+		if (!list)
+			list = std::make_shared<index_list>();
+		else if (list.use_count() > 1)
+			list = std::make_shared<index_list>(*list);
+		return *list;
+	}
+
+	index_chunk &own_chunk(index_list &list, size_t i)
+	{
+		auto &c = list[i];
+		if (c.use_count() > 1) {
+			auto copy = std::make_shared<index_chunk>();
+			copy->entries.reserve(index_chunk_size + 1);
+			copy->entries = c->entries;
+			c = copy;
+		}
+		return *c;
+	}
+};
+
 struct type {
 	std::string name;
 
@@ -90,9 +297,9 @@ struct type {
 	{
 	}
 
-	void print(FILE *f)
+	void print(std::string &out)
 	{
-		fprintf(f, "%s", name.c_str());
+		out += name;
 	}
 };
 
@@ -100,10 +307,62 @@ static type_ptr void_type = std::make_shared<type>("void");
 static type_ptr voidp_type = std::make_shared<type>("void *");
 static type_ptr int_type = std::make_shared<type>("int");
 
-struct expression {
+// What kind of node an expression (or statement) is. It's what we check
+// instead of dynamic_cast (see expr_cast()), and it identifies the node
+// in corpus checkpoints.
+enum expr_tag {
+	TAG_UNREACHABLE_EXPRESSION,
+	TAG_VARIABLE_EXPRESSION,
+	TAG_INT_LITERAL_EXPRESSION,
+	TAG_CAST_EXPRESSION,
+	TAG_CALL_EXPRESSION,
+	TAG_PREOP_EXPRESSION,
+	TAG_BINOP_EXPRESSION,
+	TAG_TERNOP_EXPRESSION,
+	TAG_UNREACHABLE_STATEMENT,
+	TAG_DECLARATION_STATEMENT,
+	TAG_RETURN_STATEMENT,
+	TAG_BLOCK_STATEMENT,
+	TAG_IF_STATEMENT,
+	TAG_ASM_CONSTRAINT_EXPRESSION,
+	TAG_ASM_STATEMENT,
+	TAG_STATEMENT_EXPRESSION,
+	TAG_EXPRESSION_STATEMENT,
+	TAG_TRANSFORMED_EXPRESSION,
+};
+
+// Corpus checkpoints
+
+// Programs share most of their subtrees, so every expression gets saved
+// only once (after its children) and is referred to by its position in
+// the list of saved expressions.
+typedef std::unordered_map<const expression *, uint32_t> expr_ids;
+static const uint32_t no_expr = -1;
+
+static void save_type(corpus_writer &out, const type_ptr &t)
+{
+	out.put_string(t->name);
+}
+
+static type_ptr load_type(corpus_reader &in)
+{
+	std::string name = in.get_string();
+	for (const auto &t: { void_type, voidp_type, int_type }) {
+		if (t->name == name)
+			return t;
+	}
+
+	return std::make_shared<type>(name);
+}
+
+struct expression: std::enable_shared_from_this<expression> {
+	// static_tag of the derived class
+	const expr_tag tag;
+
 	unsigned int generation;
 
-	expression(unsigned int generation):
+	expression(expr_tag tag, unsigned int generation):
+		tag(tag),
 		generation(generation)
 	{
 	}
@@ -112,29 +371,100 @@ struct expression {
 	{
 	}
 
-	virtual expr_ptr clone(expr_ptr &this_ptr) = 0;
+	// Path copying: return a copy of this subtree where a has been
+	// replaced by b, sharing everything that isn't on the path down to
+	// a. Returns nullptr if a isn't in this subtree at all.
+	virtual expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
+	{
+		return this_ptr == a ? b : nullptr;
+	}
 
 	virtual void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
 	{
 		v.visit(fn, this_ptr);
 	}
 
-	virtual void print(FILE *f, unsigned int indent) = 0;
+	virtual void print(std::string &out, unsigned int indent) = 0;
+
+	// Save this node, given that its children have been saved already
+	// (see save_expr())
+	virtual void save(corpus_writer &out, expr_ids &ids) = 0;
+
+	void save_header(corpus_writer &out)
+	{
+		out.put<uint8_t>(tag);
+		out.put<uint32_t>(generation);
+	}
 };
 
+// Like dynamic_cast and std::dynamic_pointer_cast, but only for the
+// exact class (nothing derives from the node classes) and without RTTI
+template<typename T>
+static T *expr_cast(expression *e)
+{
+	return e->tag == T::static_tag ? static_cast<T *>(e) : nullptr;
+}
+
+template<typename T>
+static std::shared_ptr<T> expr_pointer_cast(const expr_ptr &e)
+{
+	return e->tag == T::static_tag ? std::static_pointer_cast<T>(e) : nullptr;
+}
+
+static uint32_t save_expr(corpus_writer &out, expr_ids &ids, const expr_ptr &e)
+{
+	if (!e)
+		return no_expr;
+
+	auto it = ids.find(e.get());
+	if (it != ids.end())
+		return it->second;
+
+	e->save(out, ids);
+
+	uint32_t id = ids.size();
+	ids[e.get()] = id;
+	return id;
+}
+
+static std::vector<uint32_t> save_exprs(corpus_writer &out, expr_ids &ids, const std::vector<expr_ptr> &v)
+{
+	std::vector<uint32_t> result;
+	for (const auto &e: v)
+		result.push_back(save_expr(out, ids, e));
+
+	return result;
+}
+
+static void put_ids(corpus_writer &out, const std::vector<uint32_t> &v)
+{
+	out.put<uint32_t>(v.size());
+	for (uint32_t id: v)
+		out.put<uint32_t>(id);
+}
+
 // Helper to maintain reachability information when traversing AST
 struct unreachable_expression: expression {
+	static const expr_tag static_tag = TAG_UNREACHABLE_EXPRESSION;
+
 	expr_ptr expr;
 
 	unreachable_expression(unsigned int generation, expr_ptr expr):
-		expression(generation),
+		expression(static_tag, generation),
 		expr(expr)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<unreachable_expression>(generation, expr->clone(expr));
+		if (this_ptr == a)
+			return b;
+
+		auto new_expr = expr->replace(expr, a, b, index);
+		if (!new_expr)
+			return nullptr;
+
+		return make_node<unreachable_expression>(generation, new_expr);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -145,67 +475,140 @@ struct unreachable_expression: expression {
 		v.leave_unreachable();
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t expr_id = save_expr(out, ids, expr);
+
+		save_header(out);
+		out.put<uint32_t>(expr_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		expr->print(f, indent);
+		expr->print(out, indent);
 	}
 };
 
 struct variable_expression: expression {
+	static const expr_tag static_tag = TAG_VARIABLE_EXPRESSION;
+
 	// TODO: should we have a separate class variable as well?
 	std::string name;
 
 	variable_expression(unsigned int generation, std::string name):
-		expression(generation),
+		expression(static_tag, generation),
 		name(name)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	void save(corpus_writer &out, expr_ids &ids)
 	{
-		return this_ptr;
+		save_header(out);
+		out.put_string(name);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "%s", name.c_str());
+		out += name;
 	}
 };
 
 struct int_literal_expression: expression {
+	static const expr_tag static_tag = TAG_INT_LITERAL_EXPRESSION;
+
 	int value;
 
 	int_literal_expression(unsigned int generation, int value):
-		expression(generation),
+		expression(static_tag, generation),
 		value(value)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		save_header(out);
+		out.put<int32_t>(value);
+	}
+
+	void print(std::string &out, unsigned int indent)
+	{
+		out += std::to_string(value);
+	}
+};
+
+// What a transformation put in place of an integer literal; it prints
+// just like the expression it wraps, but remembers the literal's value
+// so that reduce() can undo the transformation again
+struct transformed_expression: expression {
+	static const expr_tag static_tag = TAG_TRANSFORMED_EXPRESSION;
+
+	int value;
+	expr_ptr expr;
+
+	transformed_expression(unsigned int generation, int value, expr_ptr expr):
+		expression(static_tag, generation),
+		value(value),
+		expr(expr)
+	{
+	}
+
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
+	{
+		if (this_ptr == a)
+			return b;
+
+		auto new_expr = expr->replace(expr, a, b, index);
+		if (!new_expr)
+			return nullptr;
+
+		return make_node<transformed_expression>(generation, value, new_expr);
+	}
+
+	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
+	{
+		v.visit(fn, this_ptr);
+
+		expr->visit(fn, expr, v);
+	}
+
+	void save(corpus_writer &out, expr_ids &ids)
 	{
-		return this_ptr;
+		uint32_t expr_id = save_expr(out, ids, expr);
+
+		save_header(out);
+		out.put<int32_t>(value);
+		out.put<uint32_t>(expr_id);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "%d", value);
+		expr->print(out, indent);
 	}
 };
 
 struct cast_expression: expression {
+	static const expr_tag static_tag = TAG_CAST_EXPRESSION;
+
 	type_ptr type;
 	expr_ptr expr;
 
 	cast_expression(unsigned int generation, type_ptr type, expr_ptr expr):
-		expression(generation),
+		expression(static_tag, generation),
 		type(type),
 		expr(expr)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<cast_expression>(generation, type, expr->clone(expr));
+		if (this_ptr == a)
+			return b;
+
+		auto new_expr = expr->replace(expr, a, b, index);
+		if (!new_expr)
+			return nullptr;
+
+		return make_node<cast_expression>(generation, type, new_expr);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -215,41 +618,62 @@ struct cast_expression: expression {
 		expr->visit(fn, expr, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t expr_id = save_expr(out, ids, expr);
+
+		save_header(out);
+		save_type(out, type);
+		out.put<uint32_t>(expr_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "(");
-		type->print(f);
-		fprintf(f, ") (");
-		expr->print(f, indent);
-		fprintf(f, ")");
+		out += "(";
+		type->print(out);
+		out += ") (";
+		expr->print(out, indent);
+		out += ")";
 	}
 };
 
 struct call_expression: expression {
+	static const expr_tag static_tag = TAG_CALL_EXPRESSION;
+
 	expr_ptr fn_expr;
 	std::vector<expr_ptr> arg_exprs;
 
 	call_expression(unsigned int generation, expr_ptr fn_expr, std::initializer_list<expr_ptr> arg_exprs = {}):
-		expression(generation),
+		expression(static_tag, generation),
 		fn_expr(fn_expr),
 		arg_exprs(arg_exprs)
 	{
 	}
 
 	call_expression(unsigned int generation, expr_ptr fn_expr, std::vector<expr_ptr> arg_exprs):
-		expression(generation),
+		expression(static_tag, generation),
 		fn_expr(fn_expr),
 		arg_exprs(arg_exprs)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		std::vector<expr_ptr> new_arg_exprs;
-		for (auto &arg_expr: arg_exprs)
-			new_arg_exprs.push_back(arg_expr->clone(arg_expr));
+		if (this_ptr == a)
+			return b;
+
+		if (auto new_fn_expr = fn_expr->replace(fn_expr, a, b, index))
+			return make_node<call_expression>(generation, new_fn_expr, arg_exprs);
+
+		for (unsigned int i = 0; i < arg_exprs.size(); ++i) {
+			if (auto new_arg_expr = arg_exprs[i]->replace(arg_exprs[i], a, b, index)) {
+				std::vector<expr_ptr> new_arg_exprs = arg_exprs;
+				new_arg_exprs[i] = new_arg_expr;
+				return make_node<call_expression>(generation, fn_expr, new_arg_exprs);
+			}
+		}
 
-		return std::make_shared<call_expression>(generation, fn_expr->clone(fn_expr), new_arg_exprs);
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -261,36 +685,55 @@ struct call_expression: expression {
 			arg_expr->visit(fn, arg_expr, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t fn_expr_id = save_expr(out, ids, fn_expr);
+		auto arg_expr_ids = save_exprs(out, ids, arg_exprs);
+
+		save_header(out);
+		out.put<uint32_t>(fn_expr_id);
+		put_ids(out, arg_expr_ids);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fn_expr->print(f, indent);
-		fprintf(f, "(");
+		fn_expr->print(out, indent);
+		out += "(";
 
 		for (unsigned int i = 0; i < arg_exprs.size(); ++i) {
 			if (i > 0)
-				fprintf(f, ", ");
+				out += ", ";
 
-			arg_exprs[i]->print(f, indent);
+			arg_exprs[i]->print(out, indent);
 		}
 
-		fprintf(f, ")");
+		out += ")";
 	}
 };
 
 struct preop_expression: expression {
+	static const expr_tag static_tag = TAG_PREOP_EXPRESSION;
+
 	std::string op;
 	expr_ptr arg;
 
 	preop_expression(unsigned int generation, std::string op, expr_ptr arg):
-		expression(generation),
+		expression(static_tag, generation),
 		op(op),
 		arg(arg)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<preop_expression>(generation, op, arg->clone(arg));
+		if (this_ptr == a)
+			return b;
+
+		auto new_arg = arg->replace(arg, a, b, index);
+		if (!new_arg)
+			return nullptr;
+
+		return make_node<preop_expression>(generation, op, new_arg);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -300,30 +743,51 @@ struct preop_expression: expression {
 		arg->visit(fn, arg, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
 	{
-		fprintf(f, "%s(", op.c_str());
-		arg->print(f, indent);
-		fprintf(f, ")");
+		uint32_t arg_id = save_expr(out, ids, arg);
+
+		save_header(out);
+		out.put_string(op);
+		out.put<uint32_t>(arg_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
+	{
+		out += op;
+		out += "(";
+		arg->print(out, indent);
+		out += ")";
 	}
 };
 
 struct binop_expression: expression {
+	static const expr_tag static_tag = TAG_BINOP_EXPRESSION;
+
 	std::string op;
 	expr_ptr lhs;
 	expr_ptr rhs;
 
 	binop_expression(unsigned int generation, std::string op, expr_ptr lhs, expr_ptr rhs):
-		expression(generation),
+		expression(static_tag, generation),
 		op(op),
 		lhs(lhs),
 		rhs(rhs)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<binop_expression>(generation, op, lhs->clone(lhs), rhs->clone(rhs));
+		if (this_ptr == a)
+			return b;
+
+		if (auto new_lhs = lhs->replace(lhs, a, b, index))
+			return make_node<binop_expression>(generation, op, new_lhs, rhs);
+
+		if (auto new_rhs = rhs->replace(rhs, a, b, index))
+			return make_node<binop_expression>(generation, op, lhs, new_rhs);
+
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -334,17 +798,32 @@ struct binop_expression: expression {
 		rhs->visit(fn, rhs, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
 	{
-		fprintf(f, "(");
-		lhs->print(f, indent);
-		fprintf(f, ") %s (", op.c_str());
-		rhs->print(f, indent);
-		fprintf(f, ")");
+		uint32_t lhs_id = save_expr(out, ids, lhs);
+		uint32_t rhs_id = save_expr(out, ids, rhs);
+
+		save_header(out);
+		out.put_string(op);
+		out.put<uint32_t>(lhs_id);
+		out.put<uint32_t>(rhs_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
+	{
+		out += "(";
+		lhs->print(out, indent);
+		out += ") ";
+		out += op;
+		out += " (";
+		rhs->print(out, indent);
+		out += ")";
 	}
 };
 
 struct ternop_expression: expression {
+	static const expr_tag static_tag = TAG_TERNOP_EXPRESSION;
+
 	std::string op1;
 	std::string op2;
 	expr_ptr arg1;
@@ -352,7 +831,7 @@ struct ternop_expression: expression {
 	expr_ptr arg3;
 
 	ternop_expression(unsigned int generation, std::string op1, std::string op2, expr_ptr arg1, expr_ptr arg2, expr_ptr arg3):
-		expression(generation),
+		expression(static_tag, generation),
 		op1(op1),
 		op2(op2),
 		arg1(arg1),
@@ -361,9 +840,21 @@ struct ternop_expression: expression {
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<ternop_expression>(generation, op1, op2, arg1->clone(arg1), arg2->clone(arg2), arg3->clone(arg3));
+		if (this_ptr == a)
+			return b;
+
+		if (auto new_arg1 = arg1->replace(arg1, a, b, index))
+			return make_node<ternop_expression>(generation, op1, op2, new_arg1, arg2, arg3);
+
+		if (auto new_arg2 = arg2->replace(arg2, a, b, index))
+			return make_node<ternop_expression>(generation, op1, op2, arg1, new_arg2, arg3);
+
+		if (auto new_arg3 = arg3->replace(arg3, a, b, index))
+			return make_node<ternop_expression>(generation, op1, op2, arg1, arg2, new_arg3);
+
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -375,30 +866,57 @@ struct ternop_expression: expression {
 		arg3->visit(fn, arg3, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t arg1_id = save_expr(out, ids, arg1);
+		uint32_t arg2_id = save_expr(out, ids, arg2);
+		uint32_t arg3_id = save_expr(out, ids, arg3);
+
+		save_header(out);
+		out.put_string(op1);
+		out.put_string(op2);
+		out.put<uint32_t>(arg1_id);
+		out.put<uint32_t>(arg2_id);
+		out.put<uint32_t>(arg3_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "(");
-		arg1->print(f, indent);
-		fprintf(f, ") %s (", op1.c_str());
-		arg2->print(f, indent);
-		fprintf(f, ") %s (", op2.c_str());
-		arg3->print(f, indent);
-		fprintf(f, ")");
+		out += "(";
+		arg1->print(out, indent);
+		out += ") ";
+		out += op1;
+		out += " (";
+		arg2->print(out, indent);
+		out += ") ";
+		out += op2;
+		out += " (";
+		arg3->print(out, indent);
+		out += ")";
 	}
 };
 
 struct unreachable_statement: expression {
+	static const expr_tag static_tag = TAG_UNREACHABLE_STATEMENT;
+
 	expr_ptr stmt;
 
 	unreachable_statement(unsigned int generation, expr_ptr stmt):
-		expression(generation),
+		expression(static_tag, generation),
 		stmt(stmt)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<unreachable_statement>(generation, stmt->clone(stmt));
+		if (this_ptr == a)
+			return b;
+
+		auto new_stmt = stmt->replace(stmt, a, b, index);
+		if (!new_stmt)
+			return nullptr;
+
+		return make_node<unreachable_statement>(generation, new_stmt);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -409,30 +927,49 @@ struct unreachable_statement: expression {
 		v.leave_unreachable();
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t stmt_id = save_expr(out, ids, stmt);
+
+		save_header(out);
+		out.put<uint32_t>(stmt_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		stmt->print(f, indent);
+		stmt->print(out, indent);
 	}
 };
 
 typedef expression statement;
 
 struct declaration_statement: statement {
+	static const expr_tag static_tag = TAG_DECLARATION_STATEMENT;
+
 	type_ptr var_type;
 	expr_ptr var_expr;
 	expr_ptr value_expr;
 
 	declaration_statement(unsigned int generation, type_ptr var_type, expr_ptr var_expr, expr_ptr value_expr):
-		expression(generation),
+		expression(static_tag, generation),
 		var_type(var_type),
 		var_expr(var_expr),
 		value_expr(value_expr)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<declaration_statement>(generation, var_type, var_expr->clone(var_expr), value_expr->clone(value_expr));
+		if (this_ptr == a)
+			return b;
+
+		if (auto new_var_expr = var_expr->replace(var_expr, a, b, index))
+			return make_node<declaration_statement>(generation, var_type, new_var_expr, value_expr);
+
+		if (auto new_value_expr = value_expr->replace(value_expr, a, b, index))
+			return make_node<declaration_statement>(generation, var_type, var_expr, new_value_expr);
+
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -444,30 +981,50 @@ struct declaration_statement: statement {
 		value_expr->visit(fn, value_expr, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t var_expr_id = save_expr(out, ids, var_expr);
+		uint32_t value_expr_id = save_expr(out, ids, value_expr);
+
+		save_header(out);
+		save_type(out, var_type);
+		out.put<uint32_t>(var_expr_id);
+		out.put<uint32_t>(value_expr_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "%*s", 2 * indent, "");
-		var_type->print(f);
-		fprintf(f, " ");
-		var_expr->print(f, indent);
-		fprintf(f, " = ");
-		value_expr->print(f, indent);
-		fprintf(f, ";\n");
+		out.append(2 * indent, ' ');
+		var_type->print(out);
+		out += " ";
+		var_expr->print(out, indent);
+		out += " = ";
+		value_expr->print(out, indent);
+		out += ";\n";
 	}
 };
 
 struct return_statement: statement {
+	static const expr_tag static_tag = TAG_RETURN_STATEMENT;
+
 	expr_ptr ret_expr;
 
 	return_statement(unsigned int generation, expr_ptr ret_expr):
-		expression(generation),
+		expression(static_tag, generation),
 		ret_expr(ret_expr)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<return_statement>(generation, ret_expr->clone(ret_expr));
+		if (this_ptr == a)
+			return b;
+
+		auto new_ret_expr = ret_expr->replace(ret_expr, a, b, index);
+		if (!new_ret_expr)
+			return nullptr;
+
+		return make_node<return_statement>(generation, new_ret_expr);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -477,35 +1034,63 @@ struct return_statement: statement {
 		ret_expr->visit(fn, ret_expr, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t ret_expr_id = save_expr(out, ids, ret_expr);
+
+		save_header(out);
+		out.put<uint32_t>(ret_expr_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "%*sreturn ", 2 * indent, "");
-		ret_expr->print(f, indent);
-		fprintf(f, ";\n");
+		out.append(2 * indent, ' ');
+		out += "return ";
+		ret_expr->print(out, indent);
+		out += ";\n";
 	}
 };
 
 struct block_statement: statement {
+	static const expr_tag static_tag = TAG_BLOCK_STATEMENT;
+
 	std::vector<expr_ptr> statements;
 
 	explicit block_statement(unsigned int generation):
-		expression(generation)
+		expression(static_tag, generation)
 	{
 	}
 
 	explicit block_statement(unsigned int generation, std::vector<expr_ptr> &statements):
-		expression(generation),
+		expression(static_tag, generation),
 		statements(statements)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		std::vector<expr_ptr> new_statements;
-		for (auto &stmt: statements)
-			new_statements.push_back(stmt->clone(stmt));
+		if (this_ptr == a)
+			return b;
+
+		for (unsigned int i = 0; i < statements.size(); ++i) {
+			if (auto new_stmt = statements[i]->replace(statements[i], a, b, index)) {
+				std::vector<expr_ptr> new_statements = statements;
+				new_statements[i] = new_stmt;
+				auto new_block = make_node<block_statement>(generation, new_statements);
+				index.rename(INDEX_BLOCK, this, new_block.get(), generation);
+				return new_block;
+			}
+		}
+
+		return nullptr;
+	}
 
-		return std::make_shared<block_statement>(generation, new_statements);
+	// Return a copy of this block with stmt inserted before position i
+	std::shared_ptr<block_statement> insert(unsigned int i, expr_ptr stmt)
+	{
+		std::vector<expr_ptr> new_statements = statements;
+		new_statements.insert(new_statements.begin() + i, stmt);
+		return make_node<block_statement>(generation, new_statements);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -516,31 +1101,57 @@ struct block_statement: statement {
 			stmt->visit(fn, stmt, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		auto statement_ids = save_exprs(out, ids, statements);
+
+		save_header(out);
+		put_ids(out, statement_ids);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "{\n");
+		out += "{\n";
 		for (const auto &stmt: statements)
-			stmt->print(f, indent + 1);
-		fprintf(f, "%*s}\n", 2 * (indent - 1), "");
+			stmt->print(out, indent + 1);
+		// (blocks inside statement expressions get printed at indent 0)
+		out.append(indent ? 2 * (indent - 1) : 2, ' ');
+		out += "}\n";
 	}
 };
 
 struct if_statement: statement {
+	static const expr_tag static_tag = TAG_IF_STATEMENT;
+
 	expr_ptr cond_expr;
 	expr_ptr true_stmt;
 	expr_ptr false_stmt;
 
 	if_statement(unsigned int generation, expr_ptr cond_expr, expr_ptr true_stmt, expr_ptr false_stmt):
-		expression(generation),
+		expression(static_tag, generation),
 		cond_expr(cond_expr),
 		true_stmt(true_stmt),
 		false_stmt(false_stmt)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<if_statement>(generation, cond_expr->clone(cond_expr), true_stmt->clone(true_stmt), false_stmt ? false_stmt->clone(false_stmt) : false_stmt);
+		if (this_ptr == a)
+			return b;
+
+		if (auto new_cond_expr = cond_expr->replace(cond_expr, a, b, index))
+			return make_node<if_statement>(generation, new_cond_expr, true_stmt, false_stmt);
+
+		if (auto new_true_stmt = true_stmt->replace(true_stmt, a, b, index))
+			return make_node<if_statement>(generation, cond_expr, new_true_stmt, false_stmt);
+
+		if (false_stmt) {
+			if (auto new_false_stmt = false_stmt->replace(false_stmt, a, b, index))
+				return make_node<if_statement>(generation, cond_expr, true_stmt, new_false_stmt);
+		}
+
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -552,35 +1163,57 @@ struct if_statement: statement {
 		false_stmt->visit(fn, false_stmt, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
 	{
-		fprintf(f, "%*s", 2 * indent, "");
-		fprintf(f, "if (");
-		cond_expr->print(f, indent);
-		fprintf(f, ") ");
-		true_stmt->print(f, indent + 1);
+		uint32_t cond_expr_id = save_expr(out, ids, cond_expr);
+		uint32_t true_stmt_id = save_expr(out, ids, true_stmt);
+		uint32_t false_stmt_id = save_expr(out, ids, false_stmt);
+
+		save_header(out);
+		out.put<uint32_t>(cond_expr_id);
+		out.put<uint32_t>(true_stmt_id);
+		out.put<uint32_t>(false_stmt_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
+	{
+		out.append(2 * indent, ' ');
+		out += "if (";
+		cond_expr->print(out, indent);
+		out += ") ";
+		true_stmt->print(out, indent + 1);
 
 		if (false_stmt) {
-			fprintf(f, "%*selse ", 2 * indent, "");
-			false_stmt->print(f, indent + 1);
+			out.append(2 * indent, ' ');
+			out += "else ";
+			false_stmt->print(out, indent + 1);
 		}
 	}
 };
 
 struct asm_constraint_expression: expression {
+	static const expr_tag static_tag = TAG_ASM_CONSTRAINT_EXPRESSION;
+
 	std::string constraint;
 	expr_ptr expr;
 
 	asm_constraint_expression(unsigned int generation, std::string constraint, expr_ptr expr):
-		expression(generation),
+		expression(static_tag, generation),
 		constraint(constraint),
 		expr(expr)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<asm_constraint_expression>(generation, constraint, expr->clone(expr));
+		if (this_ptr == a)
+			return b;
+
+		auto new_expr = expr->replace(expr, a, b, index);
+		if (!new_expr)
+			return nullptr;
+
+		return make_node<asm_constraint_expression>(generation, constraint, new_expr);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -590,38 +1223,62 @@ struct asm_constraint_expression: expression {
 		expr->visit(fn, expr, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t expr_id = save_expr(out, ids, expr);
+
+		save_header(out);
+		out.put_string(constraint);
+		out.put<uint32_t>(expr_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "\"%s\" (", constraint.c_str());
-		expr->print(f, indent);
-		fprintf(f, ")");
+		out += "\"";
+		out += constraint;
+		out += "\" (";
+		expr->print(out, indent);
+		out += ")";
 	}
 };
 
 struct asm_statement: statement {
+	static const expr_tag static_tag = TAG_ASM_STATEMENT;
+
 	bool is_volatile;
 	std::vector<expr_ptr> outputs;
 	std::vector<expr_ptr> inputs;
 
 	asm_statement(unsigned int generation, bool is_volatile, std::vector<expr_ptr> outputs, std::vector<expr_ptr> inputs):
-		expression(generation),
+		expression(static_tag, generation),
 		is_volatile(is_volatile),
 		outputs(outputs),
 		inputs(inputs)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		std::vector<expr_ptr> new_outputs;
-		for (auto &output_expr: outputs)
-			new_outputs.push_back(output_expr->clone(output_expr));
+		if (this_ptr == a)
+			return b;
+
+		for (unsigned int i = 0; i < outputs.size(); ++i) {
+			if (auto new_output = outputs[i]->replace(outputs[i], a, b, index)) {
+				std::vector<expr_ptr> new_outputs = outputs;
+				new_outputs[i] = new_output;
+				return make_node<asm_statement>(generation, is_volatile, new_outputs, inputs);
+			}
+		}
 
-		std::vector<expr_ptr> new_inputs;
-		for (auto &input_expr: inputs)
-			new_inputs.push_back(input_expr->clone(input_expr));
+		for (unsigned int i = 0; i < inputs.size(); ++i) {
+			if (auto new_input = inputs[i]->replace(inputs[i], a, b, index)) {
+				std::vector<expr_ptr> new_inputs = inputs;
+				new_inputs[i] = new_input;
+				return make_node<asm_statement>(generation, is_volatile, outputs, new_inputs);
+			}
+		}
 
-		return std::make_shared<asm_statement>(generation, is_volatile, new_outputs, new_inputs);
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -629,51 +1286,73 @@ struct asm_statement: statement {
 		v.visit(fn, this_ptr);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		auto output_ids = save_exprs(out, ids, outputs);
+		auto input_ids = save_exprs(out, ids, inputs);
+
+		save_header(out);
+		out.put<uint8_t>(is_volatile);
+		put_ids(out, output_ids);
+		put_ids(out, input_ids);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "%*s", 2 * indent, "");
-		fprintf(f, "asm %s(\"\"", is_volatile ? "volatile " : "");
+		out.append(2 * indent, ' ');
+		out += is_volatile ? "asm volatile (\"\"" : "asm (\"\"";
 
 		if (outputs.size() || inputs.size()) {
-			fprintf(f, " : ");
+			out += " : ";
 
 			for (unsigned int i = 0; i < outputs.size(); ++i) {
 				if (i > 0)
-					fprintf(f, ", ");
+					out += ", ";
 
-				outputs[i]->print(f, indent);
+				outputs[i]->print(out, indent);
 			}
 		}
 
 		if (inputs.size()) {
-			fprintf(f, " : ");
+			out += " : ";
 
 			for (unsigned int i = 0; i < inputs.size(); ++i) {
 				if (i > 0)
-					fprintf(f, ", ");
+					out += ", ";
 
-				inputs[i]->print(f, indent);
+				inputs[i]->print(out, indent);
 			}
 		}
 
-		fprintf(f, ");\n");
+		out += ");\n";
 	}
 };
 
 struct statement_expression: expression {
+	static const expr_tag static_tag = TAG_STATEMENT_EXPRESSION;
+
 	expr_ptr block_stmt;
 	expr_ptr last_stmt;
 
 	statement_expression(unsigned int generation, expr_ptr block_stmt, expr_ptr last_stmt):
-		expression(generation),
+		expression(static_tag, generation),
 		block_stmt(block_stmt),
 		last_stmt(last_stmt)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<statement_expression>(generation, block_stmt->clone(block_stmt), last_stmt->clone(last_stmt));
+		if (this_ptr == a)
+			return b;
+
+		if (auto new_block_stmt = block_stmt->replace(block_stmt, a, b, index))
+			return make_node<statement_expression>(generation, new_block_stmt, last_stmt);
+
+		if (auto new_last_stmt = last_stmt->replace(last_stmt, a, b, index))
+			return make_node<statement_expression>(generation, block_stmt, new_last_stmt);
+
+		return nullptr;
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_ptr, visitor &v)
@@ -684,27 +1363,46 @@ struct statement_expression: expression {
 		last_stmt->visit(fn, last_stmt, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t block_stmt_id = save_expr(out, ids, block_stmt);
+		uint32_t last_stmt_id = save_expr(out, ids, last_stmt);
+
+		save_header(out);
+		out.put<uint32_t>(block_stmt_id);
+		out.put<uint32_t>(last_stmt_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "({ ");
-		block_stmt->print(f, 0);
-		last_stmt->print(f, 0);
-		fprintf(f, "})");
+		out += "({ ";
+		block_stmt->print(out, 0);
+		last_stmt->print(out, 0);
+		out += "})";
 	}
 };
 
 struct expression_statement: statement {
+	static const expr_tag static_tag = TAG_EXPRESSION_STATEMENT;
+
 	expr_ptr expr;
 
 	expression_statement(unsigned int generation, expr_ptr expr):
-		expression(generation),
+		expression(static_tag, generation),
 		expr(expr)
 	{
 	}
 
-	expr_ptr clone(expr_ptr &this_ptr)
+	expr_ptr replace(expr_ptr &this_ptr, const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<expression_statement>(generation, expr->clone(expr));
+		if (this_ptr == a)
+			return b;
+
+		auto new_expr = expr->replace(expr, a, b, index);
+		if (!new_expr)
+			return nullptr;
+
+		return make_node<expression_statement>(generation, new_expr);
 	}
 
 	void visit(function_ptr fn, expr_ptr &this_stmt, visitor &v)
@@ -714,16 +1412,146 @@ struct expression_statement: statement {
 		expr->visit(fn, expr, v);
 	}
 
-	void print(FILE *f, unsigned int indent)
+	void save(corpus_writer &out, expr_ids &ids)
+	{
+		uint32_t expr_id = save_expr(out, ids, expr);
+
+		save_header(out);
+		out.put<uint32_t>(expr_id);
+	}
+
+	void print(std::string &out, unsigned int indent)
 	{
-		fprintf(f, "%*s", 2 * indent, "");
-		expr->print(f, indent);
-		fprintf(f, ";\n");
+		out.append(2 * indent, ' ');
+		expr->print(out, indent);
+		out += ";\n";
 	}
 };
 
-struct function {
-	std::string name;
+static expr_ptr load_expr_ref(corpus_reader &in, const std::vector<expr_ptr> &exprs)
+{
+	uint32_t id = in.get<uint32_t>();
+	if (id == no_expr)
+		return nullptr;
+	if (id >= exprs.size())
+		error(EXIT_FAILURE, 0, "%s: corrupt corpus", in.filename);
+
+	return exprs[id];
+}
+
+static std::vector<expr_ptr> load_expr_refs(corpus_reader &in, const std::vector<expr_ptr> &exprs)
+{
+	std::vector<expr_ptr> result;
+
+	uint32_t n = in.get<uint32_t>();
+	for (uint32_t i = 0; i < n; ++i)
+		result.push_back(in.get_ref(exprs));
+
+	return result;
+}
+
+// Load an expression saved by expression::save(); its children are
+// among the ones loaded so far
+static expr_ptr load_expr(corpus_reader &in, const std::vector<expr_ptr> &exprs)
+{
+	expr_tag tag = (expr_tag) in.get<uint8_t>();
+	unsigned int generation = in.get<uint32_t>();
+
+	switch (tag) {
+	case TAG_UNREACHABLE_EXPRESSION: {
+		auto expr = in.get_ref(exprs);
+		return make_node<unreachable_expression>(generation, expr);
+	}
+	case TAG_VARIABLE_EXPRESSION:
+		return make_node<variable_expression>(generation, in.get_string());
+	case TAG_INT_LITERAL_EXPRESSION:
+		return make_node<int_literal_expression>(generation, in.get<int32_t>());
+	case TAG_CAST_EXPRESSION: {
+		auto type = load_type(in);
+		auto expr = in.get_ref(exprs);
+		return make_node<cast_expression>(generation, type, expr);
+	}
+	case TAG_CALL_EXPRESSION: {
+		auto fn_expr = in.get_ref(exprs);
+		auto arg_exprs = load_expr_refs(in, exprs);
+		return make_node<call_expression>(generation, fn_expr, arg_exprs);
+	}
+	case TAG_PREOP_EXPRESSION: {
+		auto op = in.get_string();
+		auto arg = in.get_ref(exprs);
+		return make_node<preop_expression>(generation, op, arg);
+	}
+	case TAG_BINOP_EXPRESSION: {
+		auto op = in.get_string();
+		auto lhs = in.get_ref(exprs);
+		auto rhs = in.get_ref(exprs);
+		return make_node<binop_expression>(generation, op, lhs, rhs);
+	}
+	case TAG_TERNOP_EXPRESSION: {
+		auto op1 = in.get_string();
+		auto op2 = in.get_string();
+		auto arg1 = in.get_ref(exprs);
+		auto arg2 = in.get_ref(exprs);
+		auto arg3 = in.get_ref(exprs);
+		return make_node<ternop_expression>(generation, op1, op2, arg1, arg2, arg3);
+	}
+	case TAG_UNREACHABLE_STATEMENT: {
+		auto stmt = in.get_ref(exprs);
+		return make_node<unreachable_statement>(generation, stmt);
+	}
+	case TAG_DECLARATION_STATEMENT: {
+		auto var_type = load_type(in);
+		auto var_expr = in.get_ref(exprs);
+		auto value_expr = in.get_ref(exprs);
+		return make_node<declaration_statement>(generation, var_type, var_expr, value_expr);
+	}
+	case TAG_RETURN_STATEMENT: {
+		auto ret_expr = in.get_ref(exprs);
+		return make_node<return_statement>(generation, ret_expr);
+	}
+	case TAG_BLOCK_STATEMENT: {
+		auto statements = load_expr_refs(in, exprs);
+		return make_node<block_statement>(generation, statements);
+	}
+	case TAG_IF_STATEMENT: {
+		auto cond_expr = in.get_ref(exprs);
+		auto true_stmt = in.get_ref(exprs);
+		auto false_stmt = load_expr_ref(in, exprs);
+		return make_node<if_statement>(generation, cond_expr, true_stmt, false_stmt);
+	}
+	case TAG_ASM_CONSTRAINT_EXPRESSION: {
+		auto constraint = in.get_string();
+		auto expr = in.get_ref(exprs);
+		return make_node<asm_constraint_expression>(generation, constraint, expr);
+	}
+	case TAG_ASM_STATEMENT: {
+		bool is_volatile = in.get<uint8_t>();
+		auto outputs = load_expr_refs(in, exprs);
+		auto inputs = load_expr_refs(in, exprs);
+		return make_node<asm_statement>(generation, is_volatile, outputs, inputs);
+	}
+	case TAG_STATEMENT_EXPRESSION: {
+		auto block_stmt = in.get_ref(exprs);
+		auto last_stmt = in.get_ref(exprs);
+		return make_node<statement_expression>(generation, block_stmt, last_stmt);
+	}
+	case TAG_EXPRESSION_STATEMENT: {
+		auto expr = in.get_ref(exprs);
+		return make_node<expression_statement>(generation, expr);
+	}
+	case TAG_TRANSFORMED_EXPRESSION: {
+		int value = in.get<int32_t>();
+		auto expr = in.get_ref(exprs);
+		return make_node<transformed_expression>(generation, value, expr);
+	}
+	}
+
+	error(EXIT_FAILURE, 0, "%s: corrupt corpus", in.filename);
+	return nullptr;
+}
+
+struct function {
+	std::string name;
 
 	type_ptr return_type;
 	std::vector<type_ptr> arg_types;
@@ -738,9 +1566,13 @@ struct function {
 	{
 	}
 
-	function_ptr clone()
+	function_ptr replace(const expr_ptr &a, const expr_ptr &b, node_index &index)
 	{
-		return std::make_shared<function>(name, return_type, arg_types, body->clone(body));
+		auto new_body = body->replace(body, a, b, index);
+		if (!new_body)
+			return nullptr;
+
+		return make_node<function>(name, return_type, arg_types, new_body);
 	}
 
 	void visit(function_ptr fn, function_ptr &this_ptr, visitor &v)
@@ -750,19 +1582,45 @@ struct function {
 		body->visit(this_ptr, body, v);
 	}
 
-	void print(FILE *f)
+	void save(corpus_writer &out, corpus_writer &exprs_out, expr_ids &ids)
+	{
+		out.put_string(name);
+		save_type(out, return_type);
+		out.put<uint32_t>(arg_types.size());
+		for (const auto &t: arg_types)
+			save_type(out, t);
+		out.put<uint32_t>(save_expr(exprs_out, ids, body));
+	}
+
+	static function_ptr load(corpus_reader &in, const std::vector<expr_ptr> &exprs)
+	{
+		auto name = in.get_string();
+		auto return_type = load_type(in);
+
+		std::vector<type_ptr> arg_types;
+		uint32_t nr_arg_types = in.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_arg_types; ++i)
+			arg_types.push_back(load_type(in));
+
+		auto body = in.get_ref(exprs);
+		return make_node<function>(name, return_type, arg_types, body);
+	}
+
+	void print(std::string &out)
 	{
-		return_type->print(f);
-		fprintf(f, " %s(", name.c_str());
+		return_type->print(out);
+		out += " ";
+		out += name;
+		out += "(";
 		for (unsigned int i = 0; i < arg_types.size(); ++i) {
 			if (i > 0)
-				fprintf(f, ", ");
+				out += ", ";
 
-			arg_types[i]->print(f);
+			arg_types[i]->print(out);
 		}
-		fprintf(f, ")\n");
-		body->print(f, 1);
-		fprintf(f, "\n");
+		out += ")\n";
+		body->print(out, 1);
+		out += "\n";
 	}
 };
 
@@ -782,6 +1640,92 @@ struct ident_allocator {
 	}
 };
 
+// Calls f(e, unreachable) for every expression in a subtree, in the same
+// order as expression::visit(). The index and memory() walk whole
+// subtrees all the time, so this switches on the tag instead of going
+// through a virtual call (and a visitor's) for every node.
+template<typename F>
+static void for_each_expr(expression *e, F &f, unsigned int unreachable = 0)
+{
+	f(e, unreachable > 0);
+
+	switch (e->tag) {
+	case TAG_UNREACHABLE_EXPRESSION:
+		for_each_expr(static_cast<unreachable_expression *>(e)->expr.get(), f, unreachable + 1);
+		break;
+	case TAG_VARIABLE_EXPRESSION:
+	case TAG_INT_LITERAL_EXPRESSION:
+	case TAG_ASM_CONSTRAINT_EXPRESSION:
+	case TAG_ASM_STATEMENT:
+		break;
+	case TAG_CAST_EXPRESSION:
+		for_each_expr(static_cast<cast_expression *>(e)->expr.get(), f, unreachable);
+		break;
+	case TAG_CALL_EXPRESSION: {
+		auto call = static_cast<call_expression *>(e);
+		for_each_expr(call->fn_expr.get(), f, unreachable);
+		for (auto &arg_expr: call->arg_exprs)
+			for_each_expr(arg_expr.get(), f, unreachable);
+		break;
+	}
+	case TAG_PREOP_EXPRESSION:
+		for_each_expr(static_cast<preop_expression *>(e)->arg.get(), f, unreachable);
+		break;
+	case TAG_BINOP_EXPRESSION: {
+		auto binop = static_cast<binop_expression *>(e);
+		for_each_expr(binop->lhs.get(), f, unreachable);
+		for_each_expr(binop->rhs.get(), f, unreachable);
+		break;
+	}
+	case TAG_TERNOP_EXPRESSION: {
+		auto ternop = static_cast<ternop_expression *>(e);
+		for_each_expr(ternop->arg1.get(), f, unreachable);
+		for_each_expr(ternop->arg2.get(), f, unreachable);
+		for_each_expr(ternop->arg3.get(), f, unreachable);
+		break;
+	}
+	case TAG_UNREACHABLE_STATEMENT:
+		for_each_expr(static_cast<unreachable_statement *>(e)->stmt.get(), f, unreachable + 1);
+		break;
+	case TAG_DECLARATION_STATEMENT: {
+		auto decl = static_cast<declaration_statement *>(e);
+		for_each_expr(decl->var_expr.get(), f, unreachable);
+		for_each_expr(decl->value_expr.get(), f, unreachable);
+		break;
+	}
+	case TAG_RETURN_STATEMENT:
+		for_each_expr(static_cast<return_statement *>(e)->ret_expr.get(), f, unreachable);
+		break;
+	case TAG_BLOCK_STATEMENT:
+		for (auto &stmt: static_cast<block_statement *>(e)->statements)
+			for_each_expr(stmt.get(), f, unreachable);
+		break;
+	case TAG_IF_STATEMENT: {
+		auto if_stmt = static_cast<if_statement *>(e);
+		for_each_expr(if_stmt->cond_expr.get(), f, unreachable);
+		for_each_expr(if_stmt->true_stmt.get(), f, unreachable);
+		for_each_expr(if_stmt->false_stmt.get(), f, unreachable);
+		break;
+	}
+	case TAG_STATEMENT_EXPRESSION: {
+		auto stmt_expr = static_cast<statement_expression *>(e);
+		for_each_expr(stmt_expr->block_stmt.get(), f, unreachable);
+		for_each_expr(stmt_expr->last_stmt.get(), f, unreachable);
+		break;
+	}
+	case TAG_EXPRESSION_STATEMENT:
+		for_each_expr(static_cast<expression_statement *>(e)->expr.get(), f, unreachable);
+		break;
+	case TAG_TRANSFORMED_EXPRESSION:
+		for_each_expr(static_cast<transformed_expression *>(e)->expr.get(), f, unreachable);
+		break;
+	}
+}
+
+// Roughly what an expression costs us, including its shared_ptr
+// control block
+static const size_t expr_bytes = 96;
+
 struct program {
 	unsigned int generation;
 
@@ -795,38 +1739,199 @@ struct program {
 	function_ptr toplevel_fn;
 	expr_ptr toplevel_call_expr;
 
+	// Functions in the order they were created (see index_entry::fn)
+	std::vector<std::string> fn_names;
+	node_index index;
+
 	explicit program(int toplevel_value):
 		generation(0),
 		toplevel_value(toplevel_value)
 	{
-		auto body = std::make_shared<block_statement>(generation);
-		body->statements.push_back(std::make_shared<return_statement>(generation, std::make_shared<int_literal_expression>(generation, toplevel_value)));
-		toplevel_fn = std::make_shared<function>(ids.new_ident(), int_type, std::vector<type_ptr>(), body);
-		toplevel_call_expr = std::make_shared<call_expression>(generation, std::make_shared<variable_expression>(generation, toplevel_fn->name));
+		auto body = make_node<block_statement>(generation);
+		body->statements.push_back(make_node<return_statement>(generation, make_node<int_literal_expression>(generation, toplevel_value)));
+		toplevel_fn = make_node<function>(ids.new_ident(), int_type, std::vector<type_ptr>(), body);
+		toplevel_call_expr = make_node<call_expression>(generation, make_node<variable_expression>(generation, toplevel_fn->name));
+
+		fn_names.push_back(toplevel_fn->name);
+		add_to_index(toplevel_fn->body, 0, false);
 	}
 
-	program(unsigned int generation, int toplevel_value, ident_allocator &ids, std::vector<expr_ptr> toplevel_decls, std::vector<function_ptr> toplevel_fns, function_ptr toplevel_fn, expr_ptr toplevel_call_expr):
-		generation(generation),
-		toplevel_value(toplevel_value),
-		ids(ids),
-		toplevel_decls(toplevel_decls),
-		toplevel_fns(toplevel_fns),
-		toplevel_fn(toplevel_fn),
-		toplevel_call_expr(toplevel_call_expr)
+	// Empty program; only for loading one from a corpus
+	program():
+		generation(0),
+		toplevel_value(0)
 	{
 	}
 
+	program(const program &other) = default;
+
+	// Programs are persistent: a clone shares all declarations and
+	// functions with the original, and transformations use replace()
+	// to copy only what they actually change.
 	program_ptr clone()
 	{
-		std::vector<expr_ptr> new_toplevel_decls;
-		for (auto &stmt_ptr: toplevel_decls)
-			new_toplevel_decls.push_back(stmt_ptr->clone(stmt_ptr));
+		auto new_p = make_node<program>(*this);
+		++new_p->generation;
+		return new_p;
+	}
 
-		std::vector<function_ptr> new_toplevel_fns;
-		for (auto &fn_ptr: toplevel_fns)
-			new_toplevel_fns.push_back(fn_ptr->clone());
+	// Adds everything indexable in a subtree to the index
+	void add_to_index(const expr_ptr &e, unsigned int fn, bool unreachable)
+	{
+		auto add = [this, fn](expression *e, bool unreachable) {
+			if (e->tag == TAG_INT_LITERAL_EXPRESSION)
+				index.add(INDEX_INT_LITERAL, index_entry(e, e->generation, fn, unreachable));
+			else if (e->tag == TAG_BLOCK_STATEMENT)
+				index.add(INDEX_BLOCK, index_entry(e, e->generation, fn, unreachable));
+		};
+		for_each_expr(e.get(), add, unreachable);
+	}
 
-		return std::make_shared<program>(generation + 1, toplevel_value, ids, new_toplevel_decls, new_toplevel_fns, toplevel_fn->clone(), toplevel_call_expr->clone(toplevel_call_expr));
+	// ...and removes it again
+	void remove_from_index(const expr_ptr &e)
+	{
+		auto remove = [this](expression *e, bool) {
+			if (e->tag == TAG_INT_LITERAL_EXPRESSION)
+				index.remove(INDEX_INT_LITERAL, e, e->generation);
+			else if (e->tag == TAG_BLOCK_STATEMENT)
+				index.remove(INDEX_BLOCK, e, e->generation);
+		};
+		for_each_expr(e.get(), remove);
+	}
+
+	// Replace a (which must be an indexed node) by b
+	bool replace(const expr_ptr &a, expr_ptr b)
+	{
+		index_kind kind = a->tag == TAG_BLOCK_STATEMENT ? INDEX_BLOCK : INDEX_INT_LITERAL;
+		const index_entry *it = index.find(kind, a.get(), a->generation);
+		if (!it)
+			return false;
+
+		if (kind == INDEX_INT_LITERAL)
+			b = make_node<transformed_expression>(b->generation, static_cast<int_literal_expression *>(a.get())->value, b);
+
+		// b goes where a was
+		unsigned int fn = it->fn;
+		bool unreachable = it->unreachable;
+
+		if (!replace_in_tree(a, b, fn))
+			return false;
+
+		remove_from_index(a);
+		add_to_index(b, fn, unreachable);
+		return true;
+	}
+
+	// Insert stmt into block before position i; returns the new block
+	std::shared_ptr<block_statement> insert(const std::shared_ptr<block_statement> &block, unsigned int i, expr_ptr stmt)
+	{
+		const index_entry *it = index.find(INDEX_BLOCK, block.get(), block->generation);
+		if (!it)
+			return nullptr;
+
+		unsigned int fn = it->fn;
+		bool unreachable = it->unreachable;
+
+		auto new_block = block->insert(i, stmt);
+		if (!replace_in_tree(block, new_block, fn))
+			return nullptr;
+
+		index.rename(INDEX_BLOCK, block.get(), new_block.get(), block->generation);
+		add_to_index(stmt, fn, unreachable);
+		return new_block;
+	}
+
+	void add_decl(expr_ptr decl)
+	{
+		toplevel_decls.insert(toplevel_decls.begin() + 0, decl);
+		add_to_index(decl, index_entry::no_fn, false);
+	}
+
+	void add_function(function_ptr fn)
+	{
+		toplevel_fns.insert(toplevel_fns.begin() + 0, fn);
+		fn_names.push_back(fn->name);
+		add_to_index(fn->body, fn_names.size() - 1, false);
+	}
+
+	// Only looks in the function with the given index (see
+	// index_entry::fn), or in the top-level declarations
+	bool replace_in_tree(const expr_ptr &a, const expr_ptr &b, unsigned int fn)
+	{
+		if (fn == index_entry::no_fn) {
+			for (auto &stmt_ptr: toplevel_decls) {
+				if (auto new_stmt_ptr = stmt_ptr->replace(stmt_ptr, a, b, index)) {
+					stmt_ptr = new_stmt_ptr;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		function_ptr *fn_slot = find_function_slot(fn_names[fn]);
+		if (!fn_slot)
+			return false;
+
+		if (auto new_fn_ptr = (*fn_slot)->replace(a, b, index)) {
+			*fn_slot = new_fn_ptr;
+			return true;
+		}
+
+		return false;
+	}
+
+	// For nodes that aren't indexed; looks everywhere
+	bool replace_in_tree(const expr_ptr &a, const expr_ptr &b)
+	{
+		for (auto &stmt_ptr: toplevel_decls) {
+			if (auto new_stmt_ptr = stmt_ptr->replace(stmt_ptr, a, b, index)) {
+				stmt_ptr = new_stmt_ptr;
+				return true;
+			}
+		}
+
+		for (auto &fn_ptr: toplevel_fns) {
+			if (auto new_fn_ptr = fn_ptr->replace(a, b, index)) {
+				fn_ptr = new_fn_ptr;
+				return true;
+			}
+		}
+
+		if (auto new_toplevel_fn = toplevel_fn->replace(a, b, index)) {
+			toplevel_fn = new_toplevel_fn;
+			return true;
+		}
+
+		return false;
+	}
+
+	// Functions get copied by replace(), but their names are stable
+	function_ptr *find_function_slot(const std::string &name)
+	{
+		for (auto &fn_ptr: toplevel_fns) {
+			if (fn_ptr->name == name)
+				return &fn_ptr;
+		}
+
+		if (toplevel_fn->name == name)
+			return &toplevel_fn;
+
+		return nullptr;
+	}
+
+	function_ptr find_function(const std::string &name)
+	{
+		function_ptr *fn_slot = find_function_slot(name);
+		return fn_slot ? *fn_slot : nullptr;
+	}
+
+	function_ptr find_function(const index_entry &entry)
+	{
+		if (entry.fn == index_entry::no_fn)
+			return nullptr;
+
+		return find_function(fn_names[entry.fn]);
 	}
 
 	void visit(visitor &v)
@@ -841,175 +1946,222 @@ struct program {
 		// XXX? toplevel_call_expr->visit(nullptr, toplevel_call_expr, v);
 	}
 
-	void print(FILE *f)
+	size_t nr_exprs()
 	{
-		//fprintf(f, "#include <stdio.h>\n");
-		fprintf(f, "extern \"C\" {\n");
-		fprintf(f, "extern int printf (const char *__restrict __format, ...);\n");
-		fprintf(f, "}\n");
-		fprintf(f, "\n");
-
+		size_t n = 0;
+		auto count = [&n](expression *, bool) {
+			++n;
+		};
 		for (auto &stmt_ptr: toplevel_decls)
-			stmt_ptr->print(f, 0);
+			for_each_expr(stmt_ptr.get(), count);
+		for (auto &fn_ptr: toplevel_fns)
+			for_each_expr(fn_ptr->body.get(), count);
+		for_each_expr(toplevel_fn->body.get(), count);
+
+		return n;
+	}
+
+	// Roughly how much memory the program holds. Expressions shared
+	// with other programs are counted in full.
+	size_t memory()
+	{
+		return sizeof(*this) + nr_exprs() * expr_bytes + index.memory();
+	}
+
+	// Everything but the expressions go to out; those get saved to
+	// exprs_out (once, even if they're shared between programs)
+	void save(corpus_writer &out, corpus_writer &exprs_out, expr_ids &saved_ids)
+	{
+		out.put<uint32_t>(generation);
+		out.put<int32_t>(toplevel_value);
+		out.put<uint32_t>(ids.id);
+
+		put_ids(out, save_exprs(exprs_out, saved_ids, toplevel_decls));
 
+		out.put<uint32_t>(toplevel_fns.size());
 		for (auto &fn_ptr: toplevel_fns)
-			fn_ptr->print(f);
+			fn_ptr->save(out, exprs_out, saved_ids);
 
-		toplevel_fn->print(f);
+		toplevel_fn->save(out, exprs_out, saved_ids);
+		out.put<uint32_t>(save_expr(exprs_out, saved_ids, toplevel_call_expr));
 
-		fprintf(f, "int main(int argc, char *argv[])\n");
-		fprintf(f, "{\n");
-		fprintf(f, "  printf(\"%%d\\n\", ");
-		toplevel_call_expr->print(f, 0);
-		fprintf(f, ");\n");
-		fprintf(f, "}\n");
+		out.put<uint32_t>(fn_names.size());
+		for (const auto &name: fn_names)
+			out.put_string(name);
 	}
-};
 
-// Mutation
+	static program_ptr load(corpus_reader &in, const std::vector<expr_ptr> &exprs)
+	{
+		auto p = make_node<program>();
+		p->generation = in.get<uint32_t>();
+		p->toplevel_value = in.get<int32_t>();
+		p->ids.id = in.get<uint32_t>();
 
-static std::random_device r;
-static std::default_random_engine re;
+		p->toplevel_decls = load_expr_refs(in, exprs);
 
-// Tree traversal helpers
+		uint32_t nr_fns = in.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_fns; ++i)
+			p->toplevel_fns.push_back(function::load(in, exprs));
 
-template<typename T>
-struct find_result {
-	function_ptr fn;
-	expr_ptr *expr_ptr_ref;
-	std::shared_ptr<T> expr;
+		p->toplevel_fn = function::load(in, exprs);
+		p->toplevel_call_expr = in.get_ref(exprs);
 
-	find_result(function_ptr fn, expr_ptr &expr_ptr_ref, std::shared_ptr<T> expr):
-		fn(fn),
-		expr_ptr_ref(&expr_ptr_ref),
-		expr(expr)
+		uint32_t nr_fn_names = in.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_fn_names; ++i)
+			p->fn_names.push_back(in.get_string());
+
+		// The index isn't saved; every node knows its generation and
+		// reachability follows from the tree itself
+		for (auto &decl: p->toplevel_decls)
+			p->add_to_index(decl, index_entry::no_fn, false);
+		for (auto &fn_ptr: p->toplevel_fns)
+			p->add_to_index(fn_ptr->body, p->fn_name_index(fn_ptr->name), false);
+		p->add_to_index(p->toplevel_fn->body, p->fn_name_index(p->toplevel_fn->name), false);
+
+		return p;
+	}
+
+	unsigned int fn_name_index(const std::string &name)
 	{
+		auto it = std::find(fn_names.begin(), fn_names.end(), name);
+		if (it == fn_names.end())
+			error(EXIT_FAILURE, 0, "%s: unknown function in corpus", name.c_str());
+
+		return it - fn_names.begin();
 	}
 
-	// sort by generation in descending order (used for picking more recently modified expressions)
-	bool operator<(const find_result &other) const
+	static void print_prologue(std::string &out)
 	{
-		return expr->generation > other.expr->generation;
+		//out += "#include <stdio.h>\n";
+		out += "extern \"C\" {\n";
+		out += "extern int printf (const char *__restrict __format, ...);\n";
+		out += "}\n";
+		out += "\n";
 	}
-};
 
-template<typename T>
-std::vector<find_result<T>> find_exprs(program_ptr p)
-{
-	std::vector<find_result<T>> result;
+	// Everything but main(); see print_batch() for why it's separate
+	void print_body(std::string &out)
+	{
+		for (auto &stmt_ptr: toplevel_decls)
+			stmt_ptr->print(out, 0);
 
-	struct find_exprs_visitor: visitor {
-		std::vector<find_result<T>> &result;
+		for (auto &fn_ptr: toplevel_fns)
+			fn_ptr->print(out);
 
-		find_exprs_visitor(std::vector<find_result<T>> &result):
-			result(result)
-		{
-		}
+		toplevel_fn->print(out);
+	}
 
-		void visit(function_ptr fn, expr_ptr &e)
-		{
-			// Only return expressions within functions
-			if (!fn)
-				return;
+	// The line of main() that prints what the program computes, with the
+	// namespace it's in (if any)
+	void print_result(std::string &out, const std::string &ns = std::string())
+	{
+		out += "  printf(\"%d\\n\", ";
+		if (!ns.empty())
+			out += ns + "::";
+		toplevel_call_expr->print(out, 0);
+		out += ");\n";
+	}
 
-			auto cast_e = std::dynamic_pointer_cast<T>(e);
-			if (cast_e)
-				result.push_back(find_result<T>(fn, e, cast_e));
-		}
-	};
+	void print(std::string &out)
+	{
+		print_prologue(out);
+		print_body(out);
 
-	find_exprs_visitor v(result);
-	p->visit(v);
-	return result;
-}
+		out += "int main(int argc, char *argv[])\n";
+		out += "{\n";
+		print_result(out);
+		out += "}\n";
+	}
+};
 
-template<typename T>
-std::vector<find_result<T>> find_expr(program_ptr p)
-{
-	auto results = find_exprs<T>(p);
-	if (results.empty())
-		return results;
+// Mutation
 
-	std::sort(results.begin(), results.end());
+// What the transformations do with a program. Reseeded for every
+// candidate, so that's all it depends on (see next_candidate()).
+static thread_local rng re;
 
-	unsigned int index = std::geometric_distribution<unsigned int>(find_p)(re);
-	if (index >= results.size())
-		index = results.size() - 1;
+// Every worker's choices are derived from this (--seed)
+static uint64_t campaign_seed;
 
-	std::vector<find_result<T>> new_results;
-	new_results.push_back(results[index]);
-	return new_results;
-}
+// How each program was made (see replay.hh)
+static replay_log replay_out;
+
+// Tree traversal helpers
 
 template<typename T>
-struct find_stmts_result {
+struct index_kind_of;
+
+template<>
+struct index_kind_of<int_literal_expression> {
+	static const index_kind kind = INDEX_INT_LITERAL;
+};
+
+template<>
+struct index_kind_of<block_statement> {
+	static const index_kind kind = INDEX_BLOCK;
+};
+
+template<typename T>
+struct find_result {
 	function_ptr fn;
-	expr_ptr *stmt_ptr_ref;
-	std::shared_ptr<T> stmt;
+	std::shared_ptr<T> expr;
 
-	find_stmts_result(function_ptr fn, expr_ptr &stmt_ptr_ref, std::shared_ptr<T> stmt):
+	find_result(function_ptr fn, std::shared_ptr<T> expr):
 		fn(fn),
-		stmt_ptr_ref(&stmt_ptr_ref),
-		stmt(stmt)
-	{
-	}
-
-	// sort by generation in descending order (used for picking more recently modified expressions)
-	bool operator<(const find_stmts_result &other) const
+		expr(expr)
 	{
-		return stmt->generation > other.stmt->generation;
 	}
 };
 
-// TODO: merge this with find_expr() above...
-template<typename T>
-std::vector<find_stmts_result<T>> find_stmts(program_ptr p, std::function<bool(visitor &, std::shared_ptr<T>)> filter = [](visitor &, std::shared_ptr<T> e){ return true; })
+// Pick an indexed node, preferring more recently modified ones
+// (geometric distribution over the matches, most recent first)
+template<typename T, typename Filter>
+std::vector<find_result<T>> find_stmt(program_ptr p, Filter filter)
 {
-	std::vector<find_stmts_result<T>> result;
+	std::vector<find_result<T>> results;
 
-	struct find_stmts_visitor: visitor {
-		std::function<bool(visitor &, std::shared_ptr<T>)> filter;
-		std::vector<find_stmts_result<T>> &result;
+	unsigned int index = std::geometric_distribution<unsigned int>(find_p)(re);
 
-		find_stmts_visitor(std::function<bool(visitor &, std::shared_ptr<T>)> filter, std::vector<find_stmts_result<T>> &result):
-			filter(filter),
-			result(result)
-		{
-		}
+	const index_entry *found = nullptr;
+	const auto &list = p->index.entries(index_kind_of<T>::kind);
+	for (auto c = list.rbegin(); c != list.rend(); ++c) {
+		const auto &entries = (*c)->entries;
 
-		void visit(function_ptr fn, expr_ptr &s)
-		{
-			auto cast_s = std::dynamic_pointer_cast<T>(s);
-			if (cast_s) {
-				if (!filter(*this, cast_s))
-					return;
+		bool done = false;
+		for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+			if (!filter(*it, static_cast<T *>(it->expr)))
+				continue;
 
-				result.push_back(find_stmts_result<T>(fn, s, cast_s));
+			found = &*it;
+			if (index-- == 0) {
+				done = true;
+				break;
 			}
 		}
-	};
 
-	find_stmts_visitor v(filter, result);
-	p->visit(v);
-	return result;
+		if (done)
+			break;
+	}
+
+	if (found) {
+		auto expr = std::static_pointer_cast<T>(found->expr->shared_from_this());
+		results.push_back(find_result<T>(p->find_function(*found), expr));
+	}
+
+	return results;
 }
 
 template<typename T>
-std::vector<find_stmts_result<T>> find_stmt(program_ptr p, std::function<bool(visitor &, std::shared_ptr<T>)> filter = [](visitor &, std::shared_ptr<T> e){ return true; })
+std::vector<find_result<T>> find_stmt(program_ptr p)
 {
-	auto results = find_stmts<T>(p, filter);
-	if (results.empty())
-		return results;
-
-	std::sort(results.begin(), results.end());
-
-	unsigned int index = std::geometric_distribution<unsigned int>(find_p)(re);
-	if (index >= results.size())
-		index = results.size() - 1;
+	return find_stmt<T>(p, [](const index_entry &, T *) { return true; });
+}
 
-	std::vector<find_stmts_result<T>> new_results;
-	new_results.push_back(results[index]);
-	return new_results;
+// Like find_stmt(), but only returns expressions within functions
+template<typename T>
+std::vector<find_result<T>> find_expr(program_ptr p)
+{
+	return find_stmt<T>(p, [](const index_entry &entry, T *) { return entry.fn != index_entry::no_fn; });
 }
 
 
@@ -1053,10 +2205,10 @@ static program_ptr transform_integer_to_statement_expression(program_ptr p)
 
 	// Replace by a new expression
 	std::vector<expr_ptr> stmts;
-	auto new_e = std::make_shared<statement_expression>(generation,
-		std::make_shared<block_statement>(generation, stmts),
-		std::make_shared<expression_statement>(generation, int_e));
-	*e.expr_ptr_ref = new_e;
+	auto new_e = make_node<statement_expression>(generation,
+		make_node<block_statement>(generation, stmts),
+		make_node<expression_statement>(generation, int_e));
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1086,10 +2238,10 @@ static program_ptr transform_integer_to_sum(program_ptr p)
 	int value_b = int_e->value - value_a;
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, value_a);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, value_b);
-	auto new_e = std::make_shared<binop_expression>(generation, "+", a_expr, b_expr);
-	*e.expr_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, value_a);
+	auto b_expr = make_node<int_literal_expression>(generation, value_b);
+	auto new_e = make_node<binop_expression>(generation, "+", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1129,10 +2281,10 @@ static program_ptr transform_integer_to_product(program_ptr p)
 	int value_b = int_e->value / value_a;
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, value_a);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, value_b);
-	auto new_e = std::make_shared<binop_expression>(generation, "*", a_expr, b_expr);
-	*e.expr_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, value_a);
+	auto b_expr = make_node<int_literal_expression>(generation, value_b);
+	auto new_e = make_node<binop_expression>(generation, "*", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1151,9 +2303,9 @@ static program_ptr transform_integer_to_negation(program_ptr p)
 	auto int_e = e.expr;
 
 	// Replace by a new expression
-	auto arg_expr = std::make_shared<int_literal_expression>(generation, ~int_e->value);
-	auto new_e = std::make_shared<preop_expression>(generation, "~", arg_expr);
-	*e.expr_ptr_ref = new_e;
+	auto arg_expr = make_node<int_literal_expression>(generation, ~int_e->value);
+	auto new_e = make_node<preop_expression>(generation, "~", arg_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1178,10 +2330,10 @@ static program_ptr transform_integer_to_conjunction(program_ptr p)
 	int value_b = int_e->value | ~r;
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, value_a);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, value_b);
-	auto new_e = std::make_shared<binop_expression>(generation, "&", a_expr, b_expr);
-	*e.expr_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, value_a);
+	auto b_expr = make_node<int_literal_expression>(generation, value_b);
+	auto new_e = make_node<binop_expression>(generation, "&", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1206,10 +2358,10 @@ static program_ptr transform_integer_to_disjunction(program_ptr p)
 	int value_b = int_e->value & ~r;
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, value_a);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, value_b);
-	auto new_e = std::make_shared<binop_expression>(generation, "|", a_expr, b_expr);
-	*e.expr_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, value_a);
+	auto b_expr = make_node<int_literal_expression>(generation, value_b);
+	auto new_e = make_node<binop_expression>(generation, "|", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1234,10 +2386,10 @@ static program_ptr transform_integer_to_xor(program_ptr p)
 	int value_b = r ^ ~int_e->value;
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, value_a);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, value_b);
-	auto new_e = std::make_shared<binop_expression>(generation, "^", a_expr, b_expr);
-	*e.expr_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, value_a);
+	auto b_expr = make_node<int_literal_expression>(generation, value_b);
+	auto new_e = make_node<binop_expression>(generation, "^", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1258,10 +2410,10 @@ static program_ptr transform_integer_to_ternary(program_ptr p)
 	int min = std::numeric_limits<int>::min();
 	int max = std::numeric_limits<int>::max();
 
-	auto cond_expr = std::make_shared<int_literal_expression>(generation, std::uniform_int_distribution<int>(0, 1)(re));
-	expr_ptr true_expr = std::make_shared<int_literal_expression>(generation, int_e->value);
-	expr_ptr false_expr = std::make_shared<unreachable_statement>(generation,
-		std::make_shared<int_literal_expression>(generation, std::uniform_int_distribution<int>(min, max)(re)));
+	auto cond_expr = make_node<int_literal_expression>(generation, std::uniform_int_distribution<int>(0, 1)(re));
+	expr_ptr true_expr = make_node<int_literal_expression>(generation, int_e->value);
+	expr_ptr false_expr = make_node<unreachable_statement>(generation,
+		make_node<int_literal_expression>(generation, std::uniform_int_distribution<int>(min, max)(re)));
 
 	expr_ptr a_expr = true_expr;
 	expr_ptr b_expr = false_expr;
@@ -1269,8 +2421,8 @@ static program_ptr transform_integer_to_ternary(program_ptr p)
 		std::swap(a_expr, b_expr);
 
 	// Replace by a new expression
-	auto new_e = std::make_shared<ternop_expression>(generation, "?", ":", cond_expr, a_expr, b_expr);
-	*e.expr_ptr_ref = new_e;
+	auto new_e = make_node<ternop_expression>(generation, "?", ":", cond_expr, a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1280,21 +2432,21 @@ static program_ptr transform_integer_1_to_equals(program_ptr p)
 	unsigned int generation = new_p->generation;
 
 	// First, find all integer literals
-	auto int_literal_exprs = find_stmt<int_literal_expression>(new_p, [](visitor &, std::shared_ptr<int_literal_expression> e){ return e->value == 1; });
+	auto int_literal_exprs = find_stmt<int_literal_expression>(new_p, [](const index_entry &, int_literal_expression *e) { return e->value == 1; });
 	if (int_literal_exprs.empty())
 		return p;
 
 	// Pick a random one to mutate
 	auto e = int_literal_exprs[std::uniform_int_distribution<unsigned int>(0, int_literal_exprs.size() - 1)(re)];
-	auto int_e = e.stmt;
+	auto int_e = e.expr;
 
 	int r = std::uniform_int_distribution<int>(std::numeric_limits<int>::min(), std::numeric_limits<int>::max())(re);
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, r);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, r);
-	auto new_e = std::make_shared<binop_expression>(generation, "==", a_expr, b_expr);
-	*e.stmt_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, r);
+	auto b_expr = make_node<int_literal_expression>(generation, r);
+	auto new_e = make_node<binop_expression>(generation, "==", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1304,13 +2456,13 @@ static program_ptr transform_integer_1_to_not_equals(program_ptr p)
 	unsigned int generation = new_p->generation;
 
 	// First, find all integer literals
-	auto int_literal_exprs = find_stmt<int_literal_expression>(new_p, [](visitor &, std::shared_ptr<int_literal_expression> e){ return e->value == 1; });
+	auto int_literal_exprs = find_stmt<int_literal_expression>(new_p, [](const index_entry &, int_literal_expression *e) { return e->value == 1; });
 	if (int_literal_exprs.empty())
 		return p;
 
 	// Pick a random one to mutate
 	auto e = int_literal_exprs[std::uniform_int_distribution<unsigned int>(0, int_literal_exprs.size() - 1)(re)];
-	auto int_e = e.stmt;
+	auto int_e = e.expr;
 
 	// Pick two random numbers (not the same)
 	int r1 = std::uniform_int_distribution<int>(std::numeric_limits<int>::min(), std::numeric_limits<int>::max())(re);
@@ -1320,10 +2472,10 @@ static program_ptr transform_integer_1_to_not_equals(program_ptr p)
 	} while (r2 == r1);
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, r1);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, r2);
-	auto new_e = std::make_shared<binop_expression>(generation, "!=", a_expr, b_expr);
-	*e.stmt_ptr_ref = new_e;
+	auto a_expr = make_node<int_literal_expression>(generation, r1);
+	auto b_expr = make_node<int_literal_expression>(generation, r2);
+	auto new_e = make_node<binop_expression>(generation, "!=", a_expr, b_expr);
+	new_p->replace(e.expr, new_e);
 	return new_p;
 }
 
@@ -1342,11 +2494,13 @@ static program_ptr transform_integer_to_variable(program_ptr p)
 	auto int_e = e.expr;
 
 	// Replace by a new expression
-	auto new_var = std::make_shared<variable_expression>(generation, new_p->ids.new_ident());
-	auto new_decl = std::make_shared<declaration_statement>(generation, int_type, new_var, int_e);
-	auto body = std::dynamic_pointer_cast<block_statement>(e.fn->body);
-	body->statements.insert(body->statements.begin() + 0, new_decl);
-	*e.expr_ptr_ref = new_var;
+	auto new_var = make_node<variable_expression>(generation, new_p->ids.new_ident());
+	auto new_decl = make_node<declaration_statement>(generation, int_type, new_var, int_e);
+	new_p->replace(e.expr, new_var);
+
+	// The function got copied by replace(), so look it up again
+	auto body = expr_pointer_cast<block_statement>(new_p->find_function(e.fn->name)->body);
+	new_p->insert(body, 0, new_decl);
 	return new_p;
 }
 
@@ -1366,10 +2520,10 @@ static program_ptr transform_integer_to_global_variable(program_ptr p)
 	auto int_e = e.expr;
 
 	// Replace by a new expression
-	auto new_var = std::make_shared<variable_expression>(generation, new_p->ids.new_ident());
-	auto new_decl = std::make_shared<declaration_statement>(generation, int_type, new_var, int_e);
-	new_p->toplevel_decls.insert(new_p->toplevel_decls.begin() + 0, new_decl);
-	*e.expr_ptr_ref = new_var;
+	auto new_var = make_node<variable_expression>(generation, new_p->ids.new_ident());
+	auto new_decl = make_node<declaration_statement>(generation, int_type, new_var, int_e);
+	new_p->replace(e.expr, new_var);
+	new_p->add_decl(new_decl);
 	return new_p;
 }
 
@@ -1388,15 +2542,16 @@ static program_ptr transform_integer_to_function(program_ptr p)
 	auto int_e = e.expr;
 
 	// Create new function
-	auto new_body = std::make_shared<block_statement>(generation);
-	new_body->statements.push_back(std::make_shared<return_statement>(generation, int_e));
-	auto new_fn = std::make_shared<function>(new_p->ids.new_ident(), int_type, std::vector<type_ptr>(), new_body);
-	new_p->toplevel_fns.insert(new_p->toplevel_fns.begin() + 0, new_fn);
-
-	// Replace by a new expression
-	auto new_call = std::make_shared<call_expression>(generation,
-		std::make_shared<variable_expression>(generation, new_fn->name));
-	*e.expr_ptr_ref = new_call;
+	auto new_body = make_node<block_statement>(generation);
+	new_body->statements.push_back(make_node<return_statement>(generation, int_e));
+	auto new_fn = make_node<function>(new_p->ids.new_ident(), int_type, std::vector<type_ptr>(), new_body);
+
+	// Replace by a new expression (before the new function, which reuses
+	// the same literal, becomes reachable from the program)
+	auto new_call = make_node<call_expression>(generation,
+		make_node<variable_expression>(generation, new_fn->name));
+	new_p->replace(e.expr, new_call);
+	new_p->add_function(new_fn);
 	return new_p;
 }
 
@@ -1416,13 +2571,13 @@ static program_ptr transform_integer_to_builtin_constant_p(program_ptr p)
 
 	// Replace by a new expression
 	std::vector<expr_ptr> args;
-	args.push_back(std::make_shared<int_literal_expression>(generation, int_e->value));
-	auto new_call = std::make_shared<call_expression>(generation,
-		std::make_shared<variable_expression>(generation, "__builtin_constant_p"), args);
-	auto a_expr = std::make_shared<int_literal_expression>(generation, int_e->value);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, int_e->value);
-	auto new_ternop = std::make_shared<ternop_expression>(generation, "?", ":", new_call, a_expr, b_expr);
-	*e.expr_ptr_ref = new_ternop;
+	args.push_back(make_node<int_literal_expression>(generation, int_e->value));
+	auto new_call = make_node<call_expression>(generation,
+		make_node<variable_expression>(generation, "__builtin_constant_p"), args);
+	auto a_expr = make_node<int_literal_expression>(generation, int_e->value);
+	auto b_expr = make_node<int_literal_expression>(generation, int_e->value);
+	auto new_ternop = make_node<ternop_expression>(generation, "?", ":", new_call, a_expr, b_expr);
+	new_p->replace(e.expr, new_ternop);
 	return new_p;
 }
 
@@ -1448,11 +2603,11 @@ static program_ptr transform_insert_builtin_expect(program_ptr p)
 
 	// Replace by a new expression
 	std::vector<expr_ptr> args;
-	args.push_back(std::make_shared<int_literal_expression>(generation, int_e->value));
-	args.push_back(std::make_shared<int_literal_expression>(generation, value));
-	auto new_call = std::make_shared<call_expression>(generation,
-		std::make_shared<variable_expression>(generation, "__builtin_expect"), args);
-	*e.expr_ptr_ref = new_call;
+	args.push_back(make_node<int_literal_expression>(generation, int_e->value));
+	args.push_back(make_node<int_literal_expression>(generation, value));
+	auto new_call = make_node<call_expression>(generation,
+		make_node<variable_expression>(generation, "__builtin_expect"), args);
+	new_p->replace(e.expr, new_call);
 	return new_p;
 }
 
@@ -1468,19 +2623,18 @@ static program_ptr transform_insert_builtin_prefetch(program_ptr p)
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
 	int value = std::uniform_int_distribution<int>(std::numeric_limits<int>::min(), std::numeric_limits<int>::max())(re);
 
 	// Replace by a new expression
 	std::vector<expr_ptr> args;
-	args.push_back(std::make_shared<cast_expression>(generation, voidp_type,
-		std::make_shared<int_literal_expression>(generation, value)));
-	auto new_stmt = std::make_shared<expression_statement>(generation,
-		std::make_shared<call_expression>(generation,
-			std::make_shared<variable_expression>(generation, "__builtin_prefetch"), args));
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	args.push_back(make_node<cast_expression>(generation, voidp_type,
+		make_node<int_literal_expression>(generation, value)));
+	auto new_stmt = make_node<expression_statement>(generation,
+		make_node<call_expression>(generation,
+			make_node<variable_expression>(generation, "__builtin_prefetch"), args));
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 
@@ -1496,20 +2650,19 @@ static program_ptr transform_insert_if(program_ptr p)
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
-	auto cond_expr = std::make_shared<int_literal_expression>(generation, std::uniform_int_distribution<int>(0, 1)(re));
-	expr_ptr true_stmt = std::make_shared<block_statement>(generation);
-	expr_ptr false_stmt = std::make_shared<block_statement>(generation);
+	auto cond_expr = make_node<int_literal_expression>(generation, std::uniform_int_distribution<int>(0, 1)(re));
+	expr_ptr true_stmt = make_node<block_statement>(generation);
+	expr_ptr false_stmt = make_node<block_statement>(generation);
 
 	if (cond_expr->value)
-		false_stmt = std::make_shared<unreachable_statement>(generation, false_stmt);
+		false_stmt = make_node<unreachable_statement>(generation, false_stmt);
 	else
-		true_stmt = std::make_shared<unreachable_statement>(generation, true_stmt);
+		true_stmt = make_node<unreachable_statement>(generation, true_stmt);
 
-	auto new_stmt = std::make_shared<if_statement>(generation, cond_expr, true_stmt, false_stmt);
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	auto new_stmt = make_node<if_statement>(generation, cond_expr, true_stmt, false_stmt);
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 
@@ -1525,12 +2678,10 @@ static program_ptr transform_insert_asm(program_ptr p)
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
-	auto new_stmt = std::make_shared<asm_statement>(generation, std::uniform_int_distribution<unsigned int>(0, 1)(re), std::vector<expr_ptr>(), std::vector<expr_ptr>());
-	auto body = std::dynamic_pointer_cast<block_statement>(new_p->toplevel_fn->body);
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	auto new_stmt = make_node<asm_statement>(generation, std::uniform_int_distribution<unsigned int>(0, 1)(re), std::vector<expr_ptr>(), std::vector<expr_ptr>());
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 
@@ -1547,13 +2698,12 @@ static program_ptr transform_insert_asm_2(program_ptr p)
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
-	auto constraint_expr = std::make_shared<asm_constraint_expression>("+r", );
-	auto new_stmt = std::make_shared<asm_statement>(std::uniform_int_distribution<unsigned int>(0, 1)(re), std::vector<expr_ptr>{constraint_expr}, std::vector<expr_ptr>());
-	auto body = std::dynamic_pointer_cast<block_statement>(new_p->toplevel_fn->body);
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	auto constraint_expr = make_node<asm_constraint_expression>("+r", );
+	auto new_stmt = make_node<asm_statement>(std::uniform_int_distribution<unsigned int>(0, 1)(re), std::vector<expr_ptr>{constraint_expr}, std::vector<expr_ptr>());
+	auto body = expr_pointer_cast<block_statement>(new_p->toplevel_fn->body);
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 #endif
@@ -1564,20 +2714,19 @@ static program_ptr transform_insert_builtin_unreachable(program_ptr p)
 	unsigned int generation = new_p->generation;
 
 	// First, find all unreachable block statements
-	auto block_stmts = find_stmt<block_statement>(new_p, [](visitor &v, std::shared_ptr<block_statement>) { return v.is_unreachable(); });
+	auto block_stmts = find_stmt<block_statement>(new_p, [](const index_entry &entry, block_statement *) { return entry.unreachable; });
 	if (block_stmts.empty())
 		return p;
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
 	// Replace by a new expression
-	auto new_stmt = std::make_shared<expression_statement>(generation,
-		std::make_shared<call_expression>(generation,
-			std::make_shared<variable_expression>(generation, "__builtin_unreachable"), std::vector<expr_ptr>()));
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	auto new_stmt = make_node<expression_statement>(generation,
+		make_node<call_expression>(generation,
+			make_node<variable_expression>(generation, "__builtin_unreachable"), std::vector<expr_ptr>()));
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 
@@ -1587,20 +2736,19 @@ static program_ptr transform_insert_builtin_trap(program_ptr p)
 	unsigned int generation = new_p->generation;
 
 	// First, find all unreachable block statements
-	auto block_stmts = find_stmt<block_statement>(new_p, [](visitor &v, std::shared_ptr<block_statement>) { return v.is_unreachable(); });
+	auto block_stmts = find_stmt<block_statement>(new_p, [](const index_entry &entry, block_statement *) { return entry.unreachable; });
 	if (block_stmts.empty())
 		return p;
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
 	// Replace by a new expression
-	auto new_stmt = std::make_shared<expression_statement>(generation,
-		std::make_shared<call_expression>(generation,
-			std::make_shared<variable_expression>(generation, "__builtin_trap"), std::vector<expr_ptr>()));
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	auto new_stmt = make_node<expression_statement>(generation,
+		make_node<call_expression>(generation,
+			make_node<variable_expression>(generation, "__builtin_trap"), std::vector<expr_ptr>()));
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 
@@ -1610,21 +2758,20 @@ static program_ptr transform_insert_div_by_0(program_ptr p)
 	unsigned int generation = new_p->generation;
 
 	// First, find all unreachable block statements
-	auto block_stmts = find_stmt<block_statement>(new_p, [](visitor &v, std::shared_ptr<block_statement>) { return v.is_unreachable(); });
+	auto block_stmts = find_stmt<block_statement>(new_p, [](const index_entry &entry, block_statement *) { return entry.unreachable; });
 	if (block_stmts.empty())
 		return p;
 
 	// Pick a random one to mutate
 	auto stmt = block_stmts[std::uniform_int_distribution<unsigned int>(0, block_stmts.size() - 1)(re)];
-	auto block_stmt = stmt.stmt;
+	auto block_stmt = stmt.expr;
 
 	// Replace by a new expression
-	auto a_expr = std::make_shared<int_literal_expression>(generation, 1);
-	auto b_expr = std::make_shared<int_literal_expression>(generation, 0);
-	auto new_stmt = std::make_shared<expression_statement>(generation,
-		std::make_shared<binop_expression>(generation, "/", a_expr, b_expr));
-	auto &statements = block_stmt->statements;
-	statements.insert(statements.begin() + std::uniform_int_distribution<unsigned int>(0, statements.size())(re), new_stmt);
+	auto a_expr = make_node<int_literal_expression>(generation, 1);
+	auto b_expr = make_node<int_literal_expression>(generation, 0);
+	auto new_stmt = make_node<expression_statement>(generation,
+		make_node<binop_expression>(generation, "/", a_expr, b_expr));
+	new_p->insert(block_stmt, std::uniform_int_distribution<unsigned int>(0, block_stmt->statements.size())(re), new_stmt);
 	return new_p;
 }
 
@@ -1643,16 +2790,18 @@ static program_ptr transform_integer_to_variable_and_asm(program_ptr p)
 	auto int_e = e.expr;
 
 	// Replace by a new expression
-	auto new_var = std::make_shared<variable_expression>(generation, new_p->ids.new_ident());
-	auto new_decl = std::make_shared<declaration_statement>(generation, int_type, new_var, int_e);
-	auto body = std::dynamic_pointer_cast<block_statement>(e.fn->body);
-	body->statements.insert(body->statements.begin() + 0, new_decl);
-
-	auto constraint_expr = std::make_shared<asm_constraint_expression>(generation, "+r",
-		std::make_shared<variable_expression>(generation, new_var->name));
-	auto new_stmt = std::make_shared<asm_statement>(generation, std::uniform_int_distribution<unsigned int>(0, 1)(re), std::vector<expr_ptr>{constraint_expr}, std::vector<expr_ptr>());
-	body->statements.insert(body->statements.begin() + 1, new_stmt);
-	*e.expr_ptr_ref = new_var;
+	auto new_var = make_node<variable_expression>(generation, new_p->ids.new_ident());
+	auto new_decl = make_node<declaration_statement>(generation, int_type, new_var, int_e);
+	new_p->replace(e.expr, new_var);
+
+	auto constraint_expr = make_node<asm_constraint_expression>(generation, "+r",
+		make_node<variable_expression>(generation, new_var->name));
+	auto new_stmt = make_node<asm_statement>(generation, std::uniform_int_distribution<unsigned int>(0, 1)(re), std::vector<expr_ptr>{constraint_expr}, std::vector<expr_ptr>());
+
+	// The function got copied by replace(), so look it up again
+	auto body = expr_pointer_cast<block_statement>(new_p->find_function(e.fn->name)->body);
+	body = new_p->insert(body, 0, new_decl);
+	new_p->insert(body, 1, new_stmt);
 	return new_p;
 }
 
@@ -1685,38 +2834,33 @@ static const std::vector<transformation> transformations = {
 	&transform_integer_to_variable_and_asm,
 };
 
-// From AFL
-int shm_id;
-uint8_t *trace_bits;
-
-// From AFL
-static void remove_shm(void)
-{
-	if (shmctl(shm_id, IPC_RMID, NULL) == -1)
-		error(EXIT_FAILURE, errno, "shmctl(IPC_RMID)");
-	if (shmdt(trace_bits) == -1)
-		error(EXIT_FAILURE, errno, "shmdt()");
-}
-
-// From AFL
-static void setup_shm(void)
-{
-	shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-	if (shm_id < 0)
-		error(EXIT_FAILURE, errno, "shmget()");
-
-	//atexit(remove_shm);
-
-	char *shm_str;
-	if (asprintf(&shm_str, "%d", shm_id) == -1)
-		error(EXIT_FAILURE, errno, "asprintf()");
-	setenv(SHM_ENV_VAR, shm_str, 1);
-	free(shm_str);
-
-	trace_bits = (uint8_t *) shmat(shm_id, NULL, 0);
-	if (!trace_bits)
-		error(EXIT_FAILURE, errno, "shmat()");
-}
+#ifdef PROG_FUZZ_BENCH
+// The same, for the benchmarks (see bench-valid.cc)
+static const char *transformation_names[] = {
+	"transform_integer_to_statement_expression",
+	"transform_integer_to_sum",
+	"transform_integer_to_product",
+	"transform_integer_to_negation",
+	"transform_integer_to_conjunction",
+	"transform_integer_to_disjunction",
+	"transform_integer_to_xor",
+	"transform_integer_to_ternary",
+	"transform_integer_1_to_equals",
+	"transform_integer_1_to_not_equals",
+	"transform_integer_to_variable",
+	"transform_integer_to_global_variable",
+	"transform_integer_to_function",
+	"transform_integer_to_builtin_constant_p",
+	"transform_insert_builtin_expect",
+	"transform_insert_builtin_prefetch",
+	"transform_insert_if",
+	"transform_insert_asm",
+	"transform_insert_builtin_unreachable",
+	"transform_insert_builtin_trap",
+	"transform_insert_div_by_0",
+	"transform_integer_to_variable_and_asm",
+};
+#endif
 
 // Main
 
@@ -1731,65 +2875,214 @@ static void setup_shm(void)
  *  - then try to extend the small test-cases one by one by applying a smaller number of transformations (?)
  */
 
-static unsigned int trace_bits_counters[MAP_SIZE] = {};
-static unsigned int nr_bits;
+// TODO: clean up, take from command line
+static const char *compiler_path = "/home/vegard/personal/programming/gcc/build/gcc/cc1plus";
+static const char *compiler_argv[] = { "cc1plus", "-quiet", "-g", "-O3", "-Wno-div-by-zero", "-Wno-unused-value", "-Wno-int-to-pointer-cast", "-std=c++14", "-fpermissive", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", "-faggressive-loop-optimizations", "-fauto-inc-dec", "-fbranch-probabilities", "-fbranch-target-load-optimize2", "-fcheck-data-deps", "-fcompare-elim", "-fdce", "-fdse", "-fexpensive-optimizations", "-fhoist-adjacent-loads", "-fgcse-lm", "-fgcse-sm", "-fipa-profile", "-fno-toplevel-reorder", "-fsched-group-heuristic", "-fschedule-fusion", "-fschedule-insns", "-fschedule-insns2", "-ftracer", "-funroll-loops", "-fvect-cost-model", "-o", "prog.s", NULL };
+
+// Compiler profiles
+//
+// Every program gets built with each profile (a compiler and its flags)
+// and has to print the same, right value with all of them, so one
+// expensive program checks several compilers or sets of flags at once.
+// By default there is just the one above; --profiles FILE reads a list
+// instead, one per line:
+//
+//   name compiler arg...
+//
+// The compiler has to read the program on stdin and write assembly to
+// prog.s. With --forkserver they all have to be instrumented with AFL;
+// coverage from each of them counts.
+
+struct profile {
+	std::string name;
+	std::vector<std::string> args;
+
+	// args as execvpe() wants them; see finish_profiles()
+	std::vector<char *> argv;
+};
+
+static std::vector<profile> profiles;
 
-static bool build_and_run(program_ptr p)
+static void add_profile(const std::string &name, const std::vector<std::string> &args)
 {
-	FILE *fcurr = fopen("/tmp/current.cc", "w+");
-	if (!fcurr)
-		error(EXIT_FAILURE, errno, "fopen()");
-	p->print(fcurr);
-	fclose(fcurr);
+	profiles.push_back(profile());
+	profiles.back().name = name;
+	profiles.back().args = args;
+}
 
-	int stdin_pipefd[2];
-	if (pipe2(stdin_pipefd, 0) == -1)
-		error(EXIT_FAILURE, errno, "pipe2()");
+static void add_default_profile()
+{
+	std::vector<std::string> args(1, compiler_path);
+	for (unsigned int i = 1; compiler_argv[i]; ++i)
+		args.push_back(compiler_argv[i]);
 
-	int stderr_pipefd[2];
-	if (pipe2(stderr_pipefd, 0) == -1)
-		error(EXIT_FAILURE, errno, "pipe2()");
+	add_profile("cc1plus", args);
+}
 
-	setup_shm();
+static void load_profiles(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		error(EXIT_FAILURE, errno, "%s: fopen()", filename);
+
+	char *line = nullptr;
+	size_t size = 0;
+	unsigned int lineno = 0;
+	while (getline(&line, &size, f) != -1) {
+		++lineno;
+
+		std::vector<std::string> words;
+		for (char *p = line; ; ) {
+			while (isspace((unsigned char) *p))
+				++p;
+			if (!*p || *p == '#')
+				break;
 
-	pid_t child = fork();
-	if (child == -1)
-		error(EXIT_FAILURE, errno, "fork()");
+			char *word = p;
+			while (*p && !isspace((unsigned char) *p))
+				++p;
+			words.push_back(std::string(word, p));
+		}
 
-	if (child == 0) {
-		close(stdin_pipefd[1]);
-		dup2(stdin_pipefd[0], STDIN_FILENO);
-		close(stdin_pipefd[0]);
+		if (words.empty())
+			continue;
+		if (words.size() < 2)
+			error(EXIT_FAILURE, 0, "%s:%u: expected a name and a compiler", filename, lineno);
+
+		// It ends up in directory names
+		for (char c: words[0]) {
+			if (!isalnum((unsigned char) c) && c != '-' && c != '_' && c != '.')
+				error(EXIT_FAILURE, 0, "%s:%u: invalid profile name: %s", filename, lineno, words[0].c_str());
+		}
 
-		close(stderr_pipefd[0]);
-		dup2(stderr_pipefd[1], STDERR_FILENO);
-		close(stderr_pipefd[1]);
-		if (execlp("/home/vegard/personal/programming/gcc/build/gcc/cc1plus", "cc1plus", "-quiet", "-g", "-O3", "-Wno-div-by-zero", "-Wno-unused-value", "-Wno-int-to-pointer-cast", "-std=c++14", "-fpermissive", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", "-faggressive-loop-optimizations", "-fauto-inc-dec", "-fbranch-probabilities", "-fbranch-target-load-optimize2", "-fcheck-data-deps", "-fcompare-elim", "-fdce", "-fdse", "-fexpensive-optimizations", "-fhoist-adjacent-loads", "-fgcse-lm", "-fgcse-sm", "-fipa-profile", "-fno-toplevel-reorder", "-fsched-group-heuristic", "-fschedule-fusion", "-fschedule-insns", "-fschedule-insns2", "-ftracer", "-funroll-loops", "-fvect-cost-model", "-o", "prog.s", NULL) == -1)
-		//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/cc1plus", "cc1plus", "-quiet", "-g", "-Wall", "-std=c++14", "-ftree-pre", "-fstack-protector-all", "-faggressive-loop-optimizations", "-fauto-inc-dec", "-fbranch-probabilities", "-fbranch-target-load-optimize2", "-fcheck-data-deps", "-fcompare-elim", "-fdce", "-fdse", "-fexpensive-optimizations", "-fhoist-adjacent-loads", "-fgcse-lm", "-fgcse-sm", "-fipa-profile", "-fno-toplevel-reorder", "-fsched-group-heuristic", "-fschedule-fusion", "-fschedule-insns", "-fschedule-insns2", "-ftracer", "-funroll-loops", "-fvect-cost-model", "-o", "prog.s", NULL) == -1)
-			error(EXIT_FAILURE, errno, "execvp()");
+		add_profile(words[0], std::vector<std::string>(words.begin() + 1, words.end()));
 	}
 
-	close(stdin_pipefd[0]);
-	FILE *f = fdopen(stdin_pipefd[1], "w");
-	if (!f)
-		error(EXIT_FAILURE, errno, "fdopen()");
-	p->print(f);
+	free(line);
 	fclose(f);
 
-	static char stderr_buffer[10 * 4096];
-	size_t stderr_len;
+	if (profiles.empty())
+		error(EXIT_FAILURE, 0, "%s: no profiles", filename);
+}
 
-	{
-		close(stderr_pipefd[1]);
-		FILE *f = fdopen(stderr_pipefd[0], "r");
-		if (!f)
-			error(EXIT_FAILURE, errno, "fdopen()");
+// Only once they've stopped moving around
+static void finish_profiles()
+{
+	for (auto &p: profiles) {
+		for (auto &arg: p.args)
+			p.argv.push_back(&arg[0]);
+		p.argv.push_back(nullptr);
+	}
+}
 
-		stderr_len = fread(stderr_buffer, 1, sizeof(stderr_buffer), f);
-		if (stderr_len > 0)
-			stderr_buffer[stderr_len - 1] = '\0';
+// Assembling and linking
+//
+// Rather than system("g++ -o a.out prog.s"), which means a shell, the
+// gcc driver, as, collect2 and finally ld, we ask the driver once what
+// it would run (-###) and then run as and ld directly ourselves.
 
-		fclose(f);
+static const char *driver_assemble_command = "g++ -c -o prog.o prog.s";
+static const char *driver_link_command = "g++ -o a.out prog.o";
+
+// Everything we create in a worker's staging directory
+static const char *staged_files[] = { "input.cc", "prog.s", "prog.o", "a.out" };
+
+static std::vector<std::string> assemble_args;
+static std::vector<std::string> link_args;
+
+// Parse the commands printed by the gcc driver for -###
+static std::vector<std::vector<std::string>> driver_commands(const char *driver_command)
+{
+	std::string cmdline = std::string(driver_command) + " -### 2>&1";
+	FILE *f = popen(cmdline.c_str(), "r");
+	if (!f)
+		error(EXIT_FAILURE, errno, "popen()");
+
+	std::vector<std::vector<std::string>> result;
+
+	char *line = nullptr;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) != -1) {
+		// Commands are indented by a space; the rest is informational
+		if (line[0] != ' ')
+			continue;
+
+		std::vector<std::string> args;
+		for (const char *p = line; ; ) {
+			while (*p == ' ')
+				++p;
+			if (!*p || *p == '\n')
+				break;
+
+			std::string arg;
+			if (*p == '"') {
+				for (++p; *p && *p != '"'; ++p) {
+					if (*p == '\\' && p[1])
+						++p;
+					arg += *p;
+				}
+
+				if (*p == '"')
+					++p;
+			} else {
+				while (*p && *p != ' ' && *p != '\n')
+					arg += *p++;
+			}
+
+			args.push_back(arg);
+		}
+
+		result.push_back(args);
+	}
+
+	free(line);
+
+	if (pclose(f) != 0)
+		error(EXIT_FAILURE, 0, "%s: failed", cmdline.c_str());
+	if (result.empty())
+		error(EXIT_FAILURE, 0, "%s: no commands", cmdline.c_str());
+
+	return result;
+}
+
+static void setup_toolchain()
+{
+	assemble_args = driver_commands(driver_assemble_command).back();
+
+	// collect2 is just a wrapper around ld; we don't need its LTO plugin
+	// for a single non-LTO object either.
+	auto collect2_args = driver_commands(driver_link_command).back();
+	link_args.push_back("ld");
+	for (unsigned int i = 1; i < collect2_args.size(); ++i) {
+		if (collect2_args[i] == "-plugin") {
+			++i;
+			continue;
+		}
+
+		if (collect2_args[i].compare(0, strlen("-plugin-opt="), "-plugin-opt=") == 0)
+			continue;
+
+		link_args.push_back(collect2_args[i]);
+	}
+}
+
+// Run a command in the given directory and return its waitpid() status
+static int run_command(const std::vector<std::string> &args, const char *dir)
+{
+	std::vector<char *> argv;
+	for (const auto &arg: args)
+		argv.push_back((char *) arg.c_str());
+	argv.push_back(nullptr);
+
+	pid_t child = fork();
+	if (child == -1)
+		error(EXIT_FAILURE, errno, "fork()");
+
+	if (child == 0) {
+		if (chdir(dir) == -1)
+			error(EXIT_FAILURE, errno, "%s: chdir()", dir);
+		if (execvp(argv[0], argv.data()) == -1)
+			error(EXIT_FAILURE, errno, "%s: execvp()", argv[0]);
 	}
 
 	int status;
@@ -1808,38 +3101,363 @@ static bool build_and_run(program_ptr p)
 			break;
 	}
 
+	return status;
+}
+
+// Staged files (the input, the assembly, the object and the binary)
+// are rewritten for every single program, so we keep them on tmpfs
+// when we can and clean up after ourselves.
+static pid_t stage_owner;
+static char stage_root[PATH_MAX];
+
+// Everything to unlink()/rmdir(), precomputed so that we can clean up
+// from a signal handler too
+static std::vector<std::string> stage_files;
+static std::vector<std::string> stage_dirs;
+
+static void remove_stage_dirs(void)
+{
+	if (getpid() != stage_owner)
+		return;
+
+	for (const auto &file: stage_files)
+		unlink(file.c_str());
+	for (const auto &dir: stage_dirs)
+		rmdir(dir.c_str());
+
+	rmdir(stage_root);
+}
+
+static void handle_stop_signal(int sig)
+{
+	remove_stage_dirs();
+
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void add_stage_dir(const char *dir)
+{
+	for (const char *name: staged_files)
+		stage_files.push_back(std::string(dir) + "/" + name);
+	stage_dirs.push_back(dir);
+}
+
+static void setup_stage_root()
+{
+	struct stat st;
+	if (stat("/dev/shm", &st) == -1 || !S_ISDIR(st.st_mode)) {
+		// Stage in the per-worker work directories instead
+		stage_root[0] = '\0';
+		return;
+	}
+
+	snprintf(stage_root, sizeof(stage_root), "/dev/shm/prog-fuzz-%u", (unsigned int) getpid());
+	if (mkdir(stage_root, 0700) == -1)
+		error(EXIT_FAILURE, errno, "%s: mkdir()", stage_root);
+
+	stage_owner = getpid();
+	atexit(remove_stage_dirs);
+	signal(SIGINT, handle_stop_signal);
+	signal(SIGTERM, handle_stop_signal);
+}
+
+// A worker's copy of a profile, with everything it needs to build and
+// run programs with it on its own
+struct compiler {
+	const profile *prof;
+
+	// staging directory (everything the compiler, as and ld produce);
+	// the compiler, as, ld and the generated program all run here
+	char stage_dir[PATH_MAX];
+
+	trace_map trace;
+	forkserver fsrv;
+
+	int input_fd;
+	stderr_capture capture;
+
+	// compiler started by start_fork_exec() (without the fork server)
+	pid_t child;
+
+	// what the last program built with it printed
+	bool have_result;
+	int result;
+
+	compiler():
+		prof(nullptr),
+		input_fd(-1),
+		child(-1),
+		have_result(false),
+		result(0)
+	{
+	}
+};
+
+// Everything a worker needs to build and run programs on its own
+struct worker {
+	unsigned int id;
+
+	// Which programs and transformations we pick, derived from the
+	// campaign's seed (--seed)
+	rng choices;
+
+	// work directory (current.cc, see save_current())
+	char dir[PATH_MAX];
+
+	// one per profile
+	std::vector<compiler> compilers;
+
+	worker_stats stats;
+
+	std::thread thread;
+};
+
+// A transformed program, ready to be built and run. Each worker
+// prepares the next one while the compiler is busy with the previous
+// one.
+struct candidate {
+	// pool entry it was derived from, unless it's a fresh program
+	bool fresh;
+	unsigned int testcase_id;
+
+	program_ptr program;
+
+	// its entry in the replay log, and what goes in there
+	uint64_t replay_id;
+	uint64_t parent_replay_id;
+	uint64_t seed;
+
+	// what we did to it (unless it's fresh), for the scheduler
+	std::vector<unsigned int> transformations;
+
+	// printed in front of the results
+	char label[64];
+
+	// Source of the program; rendered once and reused for the
+	// compiler's input and anything we write out
+	std::string source;
+
+	// What it should print, one value per line (one per program in a
+	// batch, which has no program of its own; see print_batch())
+	std::vector<int> expected;
+};
+
+// State shared between all workers
+static bool use_forkserver;
+static seen_filter seen;
+static bool quiet;
+static unsigned int fixed_timeout_ms;
+
+static std::atomic<unsigned int> nr_bits;
+
+static scheduler transformation_scheduler(transformations.size());
+
+static void start_fork_exec(compiler &cc, const std::string &source)
+{
+	int stdin_pipefd[2];
+	if (pipe2(stdin_pipefd, O_CLOEXEC) == -1)
+		error(EXIT_FAILURE, errno, "pipe2()");
+
+	pid_t child = fork();
+	if (child == -1)
+		error(EXIT_FAILURE, errno, "fork()");
+
+	if (child == 0) {
+		dup2(stdin_pipefd[0], STDIN_FILENO);
+		dup2(cc.capture.write_fd, STDERR_FILENO);
+		exec_target(cc.prof->argv[0], cc.prof->argv.data(), cc.trace, cc.stage_dir);
+	}
+
+	close(stdin_pipefd[0]);
+	write_all(stdin_pipefd[1], source);
+	close(stdin_pipefd[1]);
+
+	cc.child = child;
+}
+
+static void start_forkserver(compiler &cc, const std::string &source)
+{
+	// The fork server keeps the same stdin file description across
+	// runs, so rewrite it in place.
+	if (ftruncate(cc.input_fd, 0) == -1)
+		error(EXIT_FAILURE, errno, "ftruncate()");
+	if (lseek(cc.input_fd, 0, SEEK_SET) == -1)
+		error(EXIT_FAILURE, errno, "lseek()");
+
+	write_all(cc.input_fd, source);
+
+	if (lseek(cc.input_fd, 0, SEEK_SET) == -1)
+		error(EXIT_FAILURE, errno, "lseek()");
+
+	cc.fsrv.start_run();
+}
+
+// Start compiling a program with every compiler, or just the one
+// given; returns the time we started
+static uint64_t start_build(worker &w, const candidate &c, int only = -1)
+{
+	uint64_t t = now_us();
+
+	for (unsigned int i = 0; i < w.compilers.size(); ++i) {
+		auto &cc = w.compilers[i];
+
+		// Also the ones we don't build with, so nobody takes what they
+		// printed for a different program to be this one's result
+		cc.have_result = false;
+
+		if (only >= 0 && i != (unsigned int) only)
+			continue;
+
+		cc.trace.clear();
+		cc.capture.reset();
+
+		if (use_forkserver)
+			start_forkserver(cc, c.source);
+		else
+			start_fork_exec(cc, c.source);
+	}
+
+	return t;
+}
+
+// Wait for a compiler started by start_build() and return its waitpid()
+// status; it gets killed if it's taking too long
+static int wait_compiler(worker &w, compiler &cc, bool &timed_out)
+{
+	unsigned int timeout_ms = w.stats.timeout_ms(PHASE_COMPILE, fixed_timeout_ms);
+
+	int status;
+	if (use_forkserver)
+		status = cc.fsrv.wait(timeout_ms, timed_out, &cc.capture);
+	else
+		status = wait_child(cc.child, timeout_ms, timed_out, &cc.capture);
+
+	if (timed_out)
+		++w.stats.nr_timeouts;
+
+	return status;
+}
+
+// The line of the compiler's output that says what went wrong, or an
+// empty string if there's no such line. Without the source location in
+// front of it (which changes as we reduce) and with anything quoted
+// replaced by '...', since names differ between a batch (batch_<i>::)
+// and the same program built on its own.
+static std::string diagnostic_signature(const char *buffer, const char *what)
+{
+	const char *start = strstr(buffer, what);
+	if (!start)
+		return std::string();
+
+	return normalize_ice_message(start, strchrnul(start, '\n'));
+}
+
+// What became of a program we tried to build and run
+enum build_result {
+	BUILD_OK,
+	// the compiler timed out or hit a bug we don't care about
+	BUILD_FAILED,
+	// the compiler crashed or rejected a valid program
+	BUILD_COMPILER_BUG,
+	// the program crashed, hung or printed the wrong value
+	BUILD_WRONG_CODE,
+};
+
+struct build_outcome {
+	build_result result;
+
+	// what happened, for the log
+	std::string message;
+
+	// what has to stay the same while we reduce the program
+	std::string signature;
+
+	// which of the worker's compilers it happened with
+	unsigned int compiler_i;
+
+	// which program in a batch printed the wrong value, or no_program
+	// if we can't tell
+	static const unsigned int no_program = -1;
+	unsigned int program_i;
+
+	build_outcome(build_result result, const std::string &message = std::string(), const std::string &signature = std::string()):
+		result(result),
+		message(message),
+		signature(signature),
+		compiler_i(0),
+		program_i(no_program)
+	{
+	}
+
+	bool is_bug() const
+	{
+		return result == BUILD_COMPILER_BUG || result == BUILD_WRONG_CODE;
+	}
+};
+
+// Write the program to the worker's current.cc, for an error message to
+// point to. Not for every build, since that would be a disk write per
+// exec (the staging directory may be on tmpfs, but it goes away when
+// we exit).
+static std::string save_current(worker &w, const candidate &c)
+{
+	char current_filename[PATH_MAX];
+	if (snprintf(current_filename, sizeof(current_filename), "%s/current.cc", w.dir) >= (int) sizeof(current_filename))
+		error(EXIT_FAILURE, 0, "%s: path too long", w.dir);
+
+	write_reproducer(current_filename, c.source);
+	return current_filename;
+}
+
+// Assemble, link and run a program one compiler is done with
+static build_outcome finish_build_and_run(worker &w, compiler &cc, const candidate &c, int status, bool timed_out, uint64_t &t)
+{
+	cc.have_result = false;
+
+	char message[256];
+
+	// Don't hold up the campaign; the program counts as a failure
+	if (timed_out)
+		return build_outcome(BUILD_FAILED, "cc1plus timed out");
+
 	if (WIFSIGNALED(status)) {
-		printf("cc1plus WIFSIGNALED()\n");
-		exit(1);
+		snprintf(message, sizeof(message), "cc1plus WIFSIGNALED() (signal %d)", WTERMSIG(status));
+		return build_outcome(BUILD_COMPILER_BUG, message, message);
 	}
 
 	if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-		printf("cc1plus WIFEXITED; exit code = %d\n", WEXITSTATUS(status));
-
-		// TODO
-		bool ignore = false;
-		if (strstr(stderr_buffer, "internal compiler error")) {
-			if (strstr(stderr_buffer, "unexpected expression") && strstr(stderr_buffer, "of kind asm_expr"))
-				ignore = true;
-			if (strstr(stderr_buffer, "gimplification failed"))
-				ignore = true;
-		}
+		snprintf(message, sizeof(message), "cc1plus WIFEXITED; exit code = %d", WEXITSTATUS(status));
 
-		if (ignore) {
-			remove_shm();
-			return false;
+		// The ICE, or else the first error
+		std::string signature;
+		if (WEXITSTATUS(status) == ice_exit_code && cc.capture.ice) {
+			ice_bucket ice = parse_ice(cc.capture.buffer);
+			if (is_known_ice(ice))
+				return build_outcome(BUILD_FAILED, message);
+
+			signature = ice.key();
 		}
+		if (signature.empty())
+			signature = diagnostic_signature(cc.capture.buffer, "error:");
+		if (signature.empty())
+			signature = message;
 
-		exit(1);
+		return build_outcome(BUILD_COMPILER_BUG, message, signature);
 	}
 
-	// TODO
-	if (system("g++ prog.s") != 0)
-		error(EXIT_FAILURE, 0, "system()");
+	status = run_command(assemble_args, cc.stage_dir);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		error(EXIT_FAILURE, 0, "%s: failed (see %s)", assemble_args[0].c_str(), save_current(w, c).c_str());
+
+	status = run_command(link_args, cc.stage_dir);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		error(EXIT_FAILURE, 0, "%s: failed (see %s)", link_args[0].c_str(), save_current(w, c).c_str());
+	t = w.stats.time(PHASE_LINK, t);
 
 	{
 		int pipefd[2];
-		if (pipe2(pipefd, 0) == -1)
+		if (pipe2(pipefd, O_CLOEXEC) == -1)
 			error(EXIT_FAILURE, errno, "pipe2()");
 
 		pid_t child = fork();
@@ -1847,129 +3465,1283 @@ static bool build_and_run(program_ptr p)
 			error(EXIT_FAILURE, errno, "fork()");
 
 		if (child == 0) {
-			close(pipefd[0]);
 			dup2(pipefd[1], STDOUT_FILENO);
-			close(pipefd[1]);
 
+			if (chdir(cc.stage_dir) == -1)
+				error(EXIT_FAILURE, errno, "%s: chdir()", cc.stage_dir);
 			if (execl("./a.out", "./a.out", NULL) == -1)
 				error(EXIT_FAILURE, errno, "execl()");
 		}
 
-		int actual_result = 0;
-
+		// None of the programs we generate loop, so one that doesn't
+		// finish in time has been miscompiled. It only writes a number
+		// per program, so that will fit in the pipe in the meantime
+		// (see max_batch_size).
 		close(pipefd[1]);
+
+		bool timed_out;
+		int status = wait_child(child, w.stats.timeout_ms(PHASE_RUN, fixed_timeout_ms), timed_out);
+		if (timed_out) {
+			close(pipefd[0]);
+			return build_outcome(BUILD_WRONG_CODE, "prog timed out", "prog timed out");
+		}
+
+		std::vector<int> results;
+
 		FILE *f = fdopen(pipefd[0], "r");
 		if (!f)
 			error(EXIT_FAILURE, errno, "fdopen()");
-		if (fscanf(f, "%d", &actual_result) != 1)
-			error(EXIT_FAILURE, 0, "fscanf()");
+		int actual_result;
+		while (results.size() < c.expected.size() && fscanf(f, "%d", &actual_result) == 1)
+			results.push_back(actual_result);
 		fclose(f);
 
-		if (actual_result != p->toplevel_value) {
-			printf("prog unexpected result: %d vs. %d\n", actual_result, p->toplevel_value);
-			exit(1);
-		}
-
-		int status;
-		while (true) {
-			pid_t kid = waitpid(child, &status, 0);
-			if (kid == -1) {
-				if (errno == EINTR || errno == EAGAIN)
-					continue;
-				error(EXIT_FAILURE, errno, "waitpid()");
-			}
+		cc.have_result = !results.empty();
+		cc.result = cc.have_result ? results[0] : 0;
 
-			if (kid != child)
-				error(EXIT_FAILURE, 0, "kid != child");
+		// Any wrong value counts as the same bug
+		for (unsigned int i = 0; i < results.size(); ++i) {
+			if (results[i] != c.expected[i]) {
+				cc.result = results[i];
 
-			if (WIFEXITED(status) || WIFSIGNALED(status))
-				break;
+				snprintf(message, sizeof(message), "prog unexpected result: %d vs. %d", results[i], c.expected[i]);
+				build_outcome outcome(BUILD_WRONG_CODE, message, "prog unexpected result");
+				outcome.program_i = i;
+				return outcome;
+			}
 		}
 
 		if (WIFSIGNALED(status)) {
-			printf("prog WIFSIGNALED\n");
-			exit(1);
+			snprintf(message, sizeof(message), "prog WIFSIGNALED (signal %d)", WTERMSIG(status));
+			return build_outcome(BUILD_WRONG_CODE, message, message);
 		}
 
 		if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
-			printf("prog WIFEXITED; exit code = %d\n", WEXITSTATUS(status));
-			exit(1);
+			snprintf(message, sizeof(message), "prog WIFEXITED; exit code = %d", WEXITSTATUS(status));
+			return build_outcome(BUILD_WRONG_CODE, message, message);
 		}
+
+		if (results.empty())
+			return build_outcome(BUILD_WRONG_CODE, "prog printed nothing", "prog printed nothing");
+		if (results.size() < c.expected.size())
+			return build_outcome(BUILD_WRONG_CODE, "prog printed too little", "prog printed too little");
+	}
+	t = w.stats.time(PHASE_RUN, t);
+
+	return build_outcome(BUILD_OK);
+}
+
+// Wait for the compilers started by start_build(), then assemble, link
+// and run whatever they made. If any of them went wrong, that's the
+// outcome (tagged with the profile, when there's more than one); the
+// log also gets what each of the others printed.
+static build_outcome finish_build(worker &w, const candidate &c, uint64_t t, int only = -1)
+{
+	std::vector<int> statuses(w.compilers.size());
+	std::vector<bool> timeouts(w.compilers.size());
+	for (unsigned int i = 0; i < w.compilers.size(); ++i) {
+		if (only >= 0 && i != (unsigned int) only)
+			continue;
+
+		bool timed_out;
+		statuses[i] = wait_compiler(w, w.compilers[i], timed_out);
+		timeouts[i] = timed_out;
+		++w.stats.nr_execs;
 	}
+	t = w.stats.time(PHASE_COMPILE, t);
+
+	build_outcome outcome(BUILD_OK);
+	for (unsigned int i = 0; i < w.compilers.size(); ++i) {
+		if (only >= 0 && i != (unsigned int) only)
+			continue;
+
+		auto o = finish_build_and_run(w, w.compilers[i], c, statuses[i], timeouts[i], t);
+		o.compiler_i = i;
 
-	unsigned int nr_new_bits = 0;
-	for (unsigned int i = 0; i < MAP_SIZE; ++i) {
-		if (trace_bits[i] && ++trace_bits_counters[i] == 1)
-			++nr_new_bits;
+		// The first bug, or else the first failure
+		if (o.result != BUILD_OK && (outcome.result == BUILD_OK || (o.is_bug() && !outcome.is_bug())))
+			outcome = o;
 	}
 
-	nr_bits += nr_new_bits;
+	if (w.compilers.size() > 1 && outcome.result != BUILD_OK) {
+		const std::string &name = w.compilers[outcome.compiler_i].prof->name;
+		outcome.message = name + ": " + outcome.message;
+		if (!outcome.signature.empty())
+			outcome.signature = name + ": " + outcome.signature;
 
-	printf("%u bits; %u new\n", nr_bits, nr_new_bits);
+		std::string others;
+		for (unsigned int i = 0; i < w.compilers.size(); ++i) {
+			const auto &cc = w.compilers[i];
+			if (i == outcome.compiler_i || !cc.have_result)
+				continue;
 
-	remove_shm();
+			others += (others.empty() ? " (" : ", ") + cc.prof->name + ": " + std::to_string(cc.result);
+		}
+		if (!others.empty())
+			outcome.message += others + ")";
+	}
 
-	return nr_new_bits > 0;
+	return outcome;
 }
 
 struct testcase {
+	// stable identifier, since other workers may remove entries
+	// from the pool while we're building and running a program
+	unsigned int id;
+
 	program_ptr program;
 	unsigned int nr_failures;
 	double nr_transformations;
 
-	testcase(program_ptr p):
+	// the replay log entry that made the program
+	uint64_t replay_id;
+
+	// Coverage this entry (and the ones it replaced) found
+	unsigned int new_bits;
+
+	// see program::memory()
+	size_t bytes;
+
+	testcase(unsigned int id, program_ptr p, uint64_t replay_id, unsigned int new_bits, size_t bytes):
+		id(id),
 		program(p),
 		nr_failures(0),
-		nr_transformations(10)
+		nr_transformations(10),
+		replay_id(replay_id),
+		new_bits(new_bits),
+		bytes(bytes)
+	{
+	}
+
+	// What we keep it around for, per byte
+	double value() const
+	{
+		return (new_bits + 1.) / bytes;
+	}
+
+	void save(corpus_writer &out, corpus_writer &exprs_out, expr_ids &ids) const
+	{
+		out.put<uint32_t>(id);
+		out.put<uint32_t>(nr_failures);
+		out.put<double>(nr_transformations);
+		out.put<uint32_t>(new_bits);
+		program->save(out, exprs_out, ids);
+	}
+
+	static testcase load(corpus_reader &in, const std::vector<expr_ptr> &exprs)
 	{
+		unsigned int id = in.get<uint32_t>();
+		unsigned int nr_failures = in.get<uint32_t>();
+		double nr_transformations = in.get<double>();
+		unsigned int new_bits = in.get<uint32_t>();
+
+		// We can't make it again from a replay log
+		auto p = program::load(in, exprs);
+		testcase result(id, p, replay_out.skip(), new_bits, p->memory());
+		result.nr_failures = nr_failures;
+		result.nr_transformations = nr_transformations;
+		return result;
 	}
 };
 
-int main(int argc, char *argv[])
+// The pool of programs, shared between all workers
+static std::mutex testcases_mutex;
+static std::vector<testcase> testcases;
+
+// How much memory the pool may use (--memory)
+static size_t max_pool_bytes = (size_t) 1024 << 20;
+
+// Throw out whatever found the least for its size until the pool fits
+// again (but keep at least one program). Call with testcases_mutex held.
+static void enforce_memory_limit()
 {
-	re = std::default_random_engine(r());
+	size_t bytes = 0;
+	for (const auto &t: testcases)
+		bytes += t.bytes;
+
+	while (bytes > max_pool_bytes && testcases.size() > 1) {
+		auto it = std::min_element(testcases.begin(), testcases.end(), [](const testcase &a, const testcase &b) { return a.value() < b.value(); });
+		bytes -= it->bytes;
+		testcases.erase(it);
+	}
+}
 
-	// Seed the set of programs with some randomly generated ones
-	std::vector<testcase> testcases;
+// How quickly a program's number of transformations follows its failures
+static const float nr_transformations_alpha = 0.85;
 
-	const float alpha = 0.85;
+// Another program made from it didn't find anything; it gets dropped
+// after too many in a row. Call with testcases_mutex held.
+static void add_failure(std::vector<testcase>::iterator it)
+{
+	auto &tc = *it;
+	if (++tc.nr_failures == 50)
+		testcases.erase(it);
+	else
+		tc.nr_transformations = nr_transformations_alpha * tc.nr_transformations + (1 - nr_transformations_alpha) * tc.nr_failures;
+}
 
-	while (1) {
-		while (testcases.size() < pool_size) {
-			printf("[%3lu new]... ", testcases.size());
+static std::vector<testcase>::iterator find_testcase(unsigned int id)
+{
+	return std::find_if(testcases.begin(), testcases.end(), [&](const testcase &x) { return x.id == id; });
+}
 
-			auto p = std::make_shared<program>(std::uniform_int_distribution<int>(std::numeric_limits<int>::min(), std::numeric_limits<int>::max())(re));
-			for (unsigned int i = 0; i < nr_initial_transformations; ++i) {
-				unsigned int transformation_i = std::uniform_int_distribution<unsigned int>(0, transformations.size() - 1)(re);
-				p = transformations[transformation_i](p);
-			}
+static unsigned int next_testcase_id;
+
+// A randomly generated program; only depends on re
+static program_ptr fresh_program()
+{
+	auto p = make_node<program>(std::uniform_int_distribution<int>(std::numeric_limits<int>::min(), std::numeric_limits<int>::max())(re));
+	for (unsigned int i = 0; i < nr_initial_transformations; ++i) {
+		unsigned int transformation_i = std::uniform_int_distribution<unsigned int>(0, transformations.size() - 1)(re);
+		p = transformations[transformation_i](p);
+	}
+
+	return p;
+}
+
+static void finish_candidate(worker &w, candidate &c, uint64_t t)
+{
+	t = w.stats.time(PHASE_MUTATE, t);
+
+	c.source.clear();
+	c.program->print(c.source);
+	c.expected.assign(1, c.program->toplevel_value);
+	w.stats.time(PHASE_SERIALIZE, t);
+}
+
+static bool replaying;
+static replay_reader<program_ptr> replay_in;
 
-			if (build_and_run(p))
-				testcases.push_back(testcase(p));
+// Make the next program in the replay log (instead of choosing one);
+// returns false at the end of the log. The log has the seed for re and
+// the transformations, if any, after the parent.
+static bool replay_candidate(worker &w, candidate &c)
+{
+	std::lock_guard<std::mutex> replay_lock(replay_in.mutex);
+
+	uint64_t t = now_us();
+
+	replay_entry e;
+	if (!replay_in.next(e))
+		return false;
+	if (e.args.empty())
+		replay_in.invalid(e);
+
+	snprintf(c.label, sizeof(c.label), "[replay %" PRIu64 "]", e.id);
+	re = rng(e.args[0]);
+
+	if (e.parent == no_parent) {
+		if (e.args.size() != 1)
+			replay_in.invalid(e);
+
+		c.fresh = true;
+		c.program = fresh_program();
+	} else {
+		auto p = replay_in.get_parent(e);
+		c.transformations.clear();
+		for (unsigned int i = 1; i < e.args.size(); ++i) {
+			if (e.args[i] >= transformations.size())
+				replay_in.invalid(e);
+
+			p = transformations[e.args[i]](p);
+			c.transformations.push_back(e.args[i]);
 		}
 
-		unsigned int testcase_i = std::uniform_int_distribution<unsigned int>(0, testcases.size() - 1)(re);
-		auto &t = testcases[testcase_i];
+		// Not in the pool, since we don't pick from it
+		c.fresh = false;
+		c.testcase_id = -1;
+		c.program = p;
+	}
+
+	c.replay_id = e.id;
+	replay_in.add(e.id, c.program);
+
+	finish_candidate(w, c, t);
+	return true;
+}
+
+// Pick a program from the pool and transform it, or make a new one
+static void pick_candidate(worker &w, candidate &c, bool fresh)
+{
+	std::unique_lock<std::mutex> testcases_lock(testcases_mutex);
+
+	uint64_t t = now_us();
+
+	// Seed the set of programs with some randomly generated ones
+	if (fresh || testcases.size() < pool_size) {
+		snprintf(c.label, sizeof(c.label), "[%3lu new]", testcases.size());
+		testcases_lock.unlock();
+
+		c.seed = w.choices();
+		re = rng(c.seed);
+
+		c.fresh = true;
+		c.program = fresh_program();
+		c.transformations.clear();
+	} else {
+		unsigned int testcase_i = std::uniform_int_distribution<unsigned int>(0, testcases.size() - 1)(w.choices);
+		auto t = testcases[testcase_i];
+		testcases_lock.unlock();
 
-		printf("[%3u | %2u | %5.2f]... ", testcase_i, t.nr_failures, t.nr_transformations);
+		snprintf(c.label, sizeof(c.label), "[%3u | %2u | %5.2f]", testcase_i, t.nr_failures, t.nr_transformations);
+
+		c.seed = w.choices();
+		re = rng(c.seed);
 
 		auto p = t.program;
+		c.transformations.clear();
 		for (unsigned int i = 0; i < (unsigned int) std::max(1, (int) ceil(nr_transformations_multiplier * t.nr_transformations)); ++i) {
-			unsigned int transformation_i = std::uniform_int_distribution<unsigned int>(0, transformations.size() - 1)(re);
+			unsigned int transformation_i = transformation_scheduler.pick(w.choices);
 			p = transformations[transformation_i](p);
+			c.transformations.push_back(transformation_i);
 		}
 
-		if (build_and_run(p)) {
-			t.nr_transformations = alpha * t.nr_transformations + (1 - alpha) * t.nr_failures;
-			t.nr_failures = 0;
-			t.program = p;
-		} else {
-			if (++t.nr_failures == 50)
-				testcases.erase(testcases.begin() + testcase_i);
-			else
-				t.nr_transformations = alpha * t.nr_transformations + (1 - alpha) * t.nr_failures;
+		c.fresh = false;
+		c.testcase_id = t.id;
+		c.parent_replay_id = t.replay_id;
+		c.program = p;
+	}
+
+	finish_candidate(w, c, t);
+}
+
+// Programs from other instances, waiting to be built
+static std::mutex imports_mutex;
+static std::deque<program_ptr> imports;
+
+static bool next_import(worker &w, candidate &c)
+{
+	std::unique_lock<std::mutex> imports_lock(imports_mutex);
+	if (imports.empty())
+		return false;
+
+	c.program = imports.front();
+	imports.pop_front();
+	imports_lock.unlock();
+
+	uint64_t t = now_us();
+
+	snprintf(c.label, sizeof(c.label), "[imported]");
+	c.fresh = true;
+	c.transformations.clear();
+
+	// We can't make it again from a replay log
+	c.replay_id = replay_out.skip();
+
+	finish_candidate(w, c, t);
+	return true;
+}
+
+// The next program to build; returns false at the end of a replay
+static bool next_candidate(worker &w, candidate &c)
+{
+	if (replaying)
+		return replay_candidate(w, c);
+
+	if (next_import(w, c))
+		return true;
+
+	// Making one we've built already counts against the program it was
+	// made from, like building it and finding nothing would; if that
+	// keeps happening, we make new ones instead
+	for (unsigned int i = 0; ; ++i) {
+		pick_candidate(w, c, i >= max_duplicates_in_row);
+		if (!seen.insert(std::hash<std::string>()(c.source)))
+			break;
+
+		++w.stats.nr_duplicates;
+
+		if (!c.fresh) {
+			std::lock_guard<std::mutex> testcases_lock(testcases_mutex);
+			auto it = find_testcase(c.testcase_id);
+			if (it != testcases.end())
+				add_failure(it);
 		}
 	}
 
-	return 0;
+	std::vector<uint64_t> args(1, c.seed);
+	args.insert(args.end(), c.transformations.begin(), c.transformations.end());
+	c.replay_id = replay_out.write(c.fresh ? no_parent : c.parent_replay_id, args);
+	return true;
 }
+
+// Reduction
+//
+// Transformations never change what a program computes, and neither
+// does undoing one that replaced an integer literal (put the literal
+// back) or taking out a statement or declaration that one of them added
+// (if anything still needs it, the program no longer compiles and that
+// change is rejected). So a reduced program is just as valid as the one
+// we started with, and a wrong result is still a wrong result.
+
+typedef std::function<program_ptr(program_ptr)> reduction;
+
+// Finds the block a statement is in
+struct block_finder: visitor {
+	const expr_ptr &stmt;
+	std::shared_ptr<block_statement> block;
+
+	block_finder(const expr_ptr &stmt):
+		stmt(stmt)
+	{
+	}
+
+	void visit(function_ptr, expr_ptr &e)
+	{
+		auto b = expr_cast<block_statement>(e.get());
+		if (b && std::find(b->statements.begin(), b->statements.end(), stmt) != b->statements.end())
+			block = std::static_pointer_cast<block_statement>(e);
+	}
+};
+
+// All of these return nullptr if there's nothing (left) to do
+static program_ptr undo_transformation(program_ptr p, std::shared_ptr<transformed_expression> e)
+{
+	auto new_p = p->clone();
+	if (!new_p->replace_in_tree(e, make_node<int_literal_expression>(e->generation, e->value)))
+		return nullptr;
+
+	return new_p;
+}
+
+static program_ptr remove_statement(program_ptr p, expr_ptr stmt)
+{
+	auto new_p = p->clone();
+
+	block_finder v(stmt);
+	new_p->visit(v);
+	if (!v.block)
+		return nullptr;
+
+	std::vector<expr_ptr> statements;
+	for (const auto &s: v.block->statements) {
+		if (s != stmt)
+			statements.push_back(s);
+	}
+
+	if (!new_p->replace_in_tree(v.block, make_node<block_statement>(v.block->generation, statements)))
+		return nullptr;
+
+	return new_p;
+}
+
+static program_ptr remove_decl(program_ptr p, expr_ptr decl)
+{
+	auto new_p = p->clone();
+
+	auto &decls = new_p->toplevel_decls;
+	auto it = std::find(decls.begin(), decls.end(), decl);
+	if (it == decls.end())
+		return nullptr;
+
+	decls.erase(it);
+	return new_p;
+}
+
+static program_ptr remove_function(program_ptr p, std::string name)
+{
+	auto new_p = p->clone();
+
+	auto &fns = new_p->toplevel_fns;
+	auto it = std::find_if(fns.begin(), fns.end(), [&](const function_ptr &fn) { return fn->name == name; });
+	if (it == fns.end())
+		return nullptr;
+
+	fns.erase(it);
+	return new_p;
+}
+
+// Everything we could try to take out of a program, outermost first
+struct reduction_finder: visitor {
+	std::vector<reduction> reductions;
+
+	void visit(function_ptr, expr_ptr &e)
+	{
+		using namespace std::placeholders;
+
+		if (auto t = expr_pointer_cast<transformed_expression>(e)) {
+			reductions.push_back(std::bind(undo_transformation, _1, t));
+		} else if (auto b = expr_pointer_cast<block_statement>(e)) {
+			for (const auto &stmt: b->statements) {
+				if (stmt->tag != TAG_RETURN_STATEMENT)
+					reductions.push_back(std::bind(remove_statement, _1, stmt));
+			}
+		}
+	}
+};
+
+static std::vector<reduction> find_reductions(program_ptr p)
+{
+	using namespace std::placeholders;
+
+	reduction_finder v;
+	for (const auto &fn: p->toplevel_fns)
+		v.reductions.push_back(std::bind(remove_function, _1, fn->name));
+	for (const auto &decl: p->toplevel_decls)
+		v.reductions.push_back(std::bind(remove_decl, _1, decl));
+
+	p->visit(v);
+	return v.reductions;
+}
+
+// Compile, assemble, link and run a program in one go
+static build_outcome build_and_run(worker &w, const candidate &c, int only = -1)
+{
+	uint64_t t = start_build(w, c, only);
+	return finish_build(w, c, t, only);
+}
+
+// Shrink a program for as long as it keeps showing the same bug (with
+// the same compiler; we don't bother with the others); each pass tries
+// everything find_reductions() comes up with and we stop when a whole
+// pass doesn't find anything.
+static program_ptr reduce(worker &w, program_ptr p, const build_outcome &bug, unsigned int &nr_tests)
+{
+	time_t deadline = time(NULL) + max_reduce_seconds;
+
+	bool progress = true;
+	while (progress) {
+		progress = false;
+
+		for (const auto &r: find_reductions(p)) {
+			if (time(NULL) >= deadline)
+				return p;
+
+			auto new_p = r(p);
+			if (!new_p)
+				continue;
+
+			candidate c;
+			c.program = new_p;
+			new_p->print(c.source);
+			c.expected.assign(1, new_p->toplevel_value);
+
+			auto outcome = build_and_run(w, c, bug.compiler_i);
+			++nr_tests;
+
+			if (outcome.result == bug.result && outcome.signature == bug.signature) {
+				p = new_p;
+				progress = true;
+			}
+		}
+	}
+
+	return p;
+}
+
+// Save a reproducer for a bug we just found, then reduce it and save
+// the result as well
+static void report_bug(worker &w, const candidate &c, const build_outcome &bug)
+{
+	unsigned int id = next_bug_id();
+	unsigned long now = time(NULL);
+
+	char filename[PATH_MAX];
+	snprintf(filename, sizeof(filename), "output/%lu-%u.cc", now, id);
+	write_reproducer(filename, c.source);
+	printf("Writing reproducer to %s\n", filename);
+
+	// A batch that only goes wrong as a whole; see isolate_bug()
+	if (!c.program)
+		return;
+
+	unsigned int nr_tests = 0;
+	std::string source;
+	reduce(w, c.program, bug, nr_tests)->print(source);
+
+	snprintf(filename, sizeof(filename), "output/%lu-%u-reduced.cc", now, id);
+	write_reproducer(filename, source);
+	printf("Reduced %s from %zu to %zu bytes in %u tests; writing it to %s\n", bug.signature.c_str(), c.source.size(), source.size(), nr_tests, filename);
+}
+
+// What we learned from building a program (on its own or in a batch):
+// log it, credit its transformations and update the pool
+static void update_pool(const candidate &c, const build_outcome &outcome, unsigned int nr_new_bits, bool rare, uint64_t build_us)
+{
+	bool new_bits = nr_new_bits > 0;
+
+	if (!quiet || outcome.is_bug())
+		printf("%s... %s\n", c.label, outcome.message.c_str());
+
+	// Every transformation gets the credit (and its share of the cost)
+	if (!c.fresh) {
+		for (unsigned int transformation_i: c.transformations)
+			transformation_scheduler.update(transformation_i, new_bits || outcome.is_bug(), build_us / c.transformations.size());
+	}
+
+	// Outside the lock, since it walks the whole program
+	size_t bytes = new_bits || rare ? c.program->memory() : 0;
+
+	std::lock_guard<std::mutex> testcases_lock(testcases_mutex);
+
+	if (c.fresh) {
+		if (new_bits || rare)
+			testcases.push_back(testcase(next_testcase_id++, c.program, c.replay_id, nr_new_bits, bytes));
+	} else {
+		// Somebody else may have replaced or removed it in the meantime
+		auto it = find_testcase(c.testcase_id);
+		if (it != testcases.end()) {
+			auto &tc = *it;
+			if (outcome.is_bug()) {
+				// Whatever we make from it next is likely to hit
+				// the same bug again
+				testcases.erase(it);
+			} else if (new_bits || rare) {
+				tc.nr_transformations = nr_transformations_alpha * tc.nr_transformations + (1 - nr_transformations_alpha) * tc.nr_failures;
+				tc.nr_failures = 0;
+				tc.program = c.program;
+				tc.replay_id = c.replay_id;
+				tc.new_bits += nr_new_bits;
+				tc.bytes = bytes;
+			} else {
+				add_failure(it);
+			}
+		}
+	}
+
+	if (new_bits || rare)
+		enforce_memory_limit();
+}
+
+// The same compiler bug tends to show up again and again, but every
+// wrong result could be a different bug
+static void maybe_report_bug(worker &w, const candidate &c, const build_outcome &bug)
+{
+	if (bug.result == BUILD_WRONG_CODE || first_report(bug.signature))
+		report_bug(w, c, bug);
+}
+
+// Batches
+//
+// Most programs are so small that starting the compiler costs more than
+// compiling them, so with --batch K we put K of them (each in its own
+// namespace) into one translation unit, and main() prints what each of
+// them computes. Coverage is for the translation unit as a whole, so all
+// the programs in a batch that finds some get the credit. A wrong value
+// tells us which program printed it; for any other bug we build halves
+// of the batch until we know which program it was.
+
+// Each program's result has to fit in the pipe (see finish_build_and_run())
+static const unsigned int max_batch_size = 256;
+
+static unsigned int batch_size = 1;
+
+// Candidates that get built together
+struct batch {
+	std::vector<candidate> members;
+
+	// all of them in one translation unit
+	candidate combined;
+};
+
+// A batch of one is just that program
+static void print_batch(const std::vector<const candidate *> &members, candidate &combined)
+{
+	if (members.size() == 1) {
+		combined = *members[0];
+		return;
+	}
+
+	combined = candidate();
+	snprintf(combined.label, sizeof(combined.label), "[batch of %zu]", members.size());
+
+	std::string &out = combined.source;
+	program::print_prologue(out);
+
+	for (unsigned int i = 0; i < members.size(); ++i) {
+		out += "namespace batch_" + std::to_string(i) + " {\n";
+		members[i]->program->print_body(out);
+		out += "}\n\n";
+	}
+
+	out += "int main(int argc, char *argv[])\n";
+	out += "{\n";
+	for (unsigned int i = 0; i < members.size(); ++i) {
+		members[i]->program->print_result(out, "batch_" + std::to_string(i));
+		combined.expected.push_back(members[i]->program->toplevel_value);
+	}
+	out += "}\n";
+}
+
+// Returns false at the end of a replay
+static bool next_batch(worker &w, batch &b)
+{
+	b.members.resize(batch_size);
+
+	std::vector<const candidate *> members;
+	for (auto &c: b.members) {
+		if (!next_candidate(w, c))
+			break;
+		members.push_back(&c);
+	}
+
+	if (members.empty())
+		return false;
+
+	// A replay can end in the middle of one
+	b.members.resize(members.size());
+
+	uint64_t t = now_us();
+	print_batch(members, b.combined);
+	w.stats.time(PHASE_SERIALIZE, t);
+	return true;
+}
+
+// Which program in a batch shows the bug on its own (and what building
+// it on its own gave us); -1 if it takes more than one of them
+static int isolate_bug(worker &w, const std::vector<candidate> &members, const build_outcome &bug, build_outcome &outcome)
+{
+	auto same_bug = [&](const std::vector<unsigned int> &suspects) {
+		std::vector<const candidate *> suspect_members;
+		for (unsigned int i: suspects)
+			suspect_members.push_back(&members[i]);
+
+		candidate c;
+		print_batch(suspect_members, c);
+		outcome = build_and_run(w, c, bug.compiler_i);
+		return outcome.result == bug.result && outcome.signature == bug.signature;
+	};
+
+	if (bug.result == BUILD_WRONG_CODE && bug.program_i != build_outcome::no_program && same_bug({bug.program_i}))
+		return bug.program_i;
+
+	std::vector<unsigned int> suspects;
+	for (unsigned int i = 0; i < members.size(); ++i)
+		suspects.push_back(i);
+
+	while (suspects.size() > 1) {
+		std::vector<unsigned int> first(suspects.begin(), suspects.begin() + suspects.size() / 2);
+		std::vector<unsigned int> second(suspects.begin() + suspects.size() / 2, suspects.end());
+
+		if (same_bug(first))
+			suspects = first;
+		else if (same_bug(second))
+			suspects = second;
+		else
+			return -1;
+	}
+
+	return suspects[0];
+}
+
+static void run_worker(worker &w)
+{
+	use_own_free_lists();
+
+	// The batch being compiled and the one we prepare in the meantime
+	batch current;
+	batch next;
+
+	if (!next_batch(w, current))
+		return;
+
+	while (1) {
+		start_build(w, current.combined);
+
+		// Keep the CPU busy while the compilers run
+		bool have_next = next_batch(w, next);
+
+		// Preparing it was timed on its own; the build only costs us
+		// however long we still have to wait for it
+		uint64_t start = now_us();
+		auto outcome = finish_build(w, current.combined, start);
+		uint64_t t = now_us();
+		uint64_t build_us = t - start;
+
+		bool rare = false;
+		unsigned int nr_new_bits = 0;
+		if (outcome.result == BUILD_OK) {
+			double rarity = 0;
+			for (auto &cc: w.compilers) {
+				classify_counts(cc.trace.trace_bits);
+				nr_new_bits += has_new_bits(cc.trace.trace_bits);
+				rarity += record_edge_hits(cc.trace.trace_bits);
+			}
+			nr_bits += nr_new_bits;
+			w.stats.time(PHASE_COVERAGE, t);
+
+			char message[64];
+			snprintf(message, sizeof(message), "%u bits; %u new; rarity %.2f", (unsigned int) nr_bits, nr_new_bits, rarity);
+			outcome.message = message;
+			rare = rarity >= min_rarity;
+		}
+
+		// Everybody gets their share
+		unsigned int nr_members = current.members.size();
+		unsigned int member_new_bits = (nr_new_bits + nr_members - 1) / nr_members;
+		uint64_t member_us = build_us / nr_members;
+
+		if (!outcome.is_bug()) {
+			for (const auto &c: current.members)
+				update_pool(c, outcome, member_new_bits, rare, member_us);
+		} else if (nr_members == 1) {
+			update_pool(current.members[0], outcome, 0, false, member_us);
+			maybe_report_bug(w, current.members[0], outcome);
+		} else {
+			build_outcome culprit_outcome(BUILD_OK);
+			int culprit = isolate_bug(w, current.members, outcome, culprit_outcome);
+
+			if (culprit >= 0) {
+				for (unsigned int i = 0; i < nr_members; ++i) {
+					if (i == (unsigned int) culprit)
+						update_pool(current.members[i], culprit_outcome, 0, false, member_us);
+					else
+						update_pool(current.members[i], build_outcome(BUILD_FAILED, "another program in the batch had a bug"), 0, false, member_us);
+				}
+
+				maybe_report_bug(w, current.members[culprit], culprit_outcome);
+			} else {
+				for (const auto &c: current.members)
+					update_pool(c, outcome, 0, false, member_us);
+
+				printf("%s... %s (only with the whole batch)\n", current.combined.label, outcome.message.c_str());
+				maybe_report_bug(w, current.combined, outcome);
+			}
+		}
+
+		if (!have_next)
+			break;
+
+		std::swap(current, next);
+	}
+}
+
+static void setup_compiler(worker &w, compiler &cc, const profile &prof)
+{
+	cc.prof = &prof;
+
+	// With more than one profile, each gets its own directory
+	std::string suffix = profiles.size() > 1 ? "-" + prof.name : "";
+
+	if (stage_root[0]) {
+		if (snprintf(cc.stage_dir, sizeof(cc.stage_dir), "%s/%u%s", stage_root, w.id, suffix.c_str()) >= (int) sizeof(cc.stage_dir))
+			error(EXIT_FAILURE, 0, "%s: path too long", stage_root);
+		if (mkdir(cc.stage_dir, 0700) == -1)
+			error(EXIT_FAILURE, errno, "%s: mkdir()", cc.stage_dir);
+		add_stage_dir(cc.stage_dir);
+	} else if (profiles.size() > 1) {
+		if (snprintf(cc.stage_dir, sizeof(cc.stage_dir), "%s/%s", w.dir, prof.name.c_str()) >= (int) sizeof(cc.stage_dir))
+			error(EXIT_FAILURE, 0, "%s: path too long", w.dir);
+		if (mkdir(cc.stage_dir, 0755) == -1 && errno != EEXIST)
+			error(EXIT_FAILURE, errno, "%s: mkdir()", cc.stage_dir);
+	} else {
+		strcpy(cc.stage_dir, w.dir);
+	}
+
+	cc.trace.setup();
+
+	// No limit on how much it prints: a valid program that makes the
+	// compiler print a lot is worth reporting, and we'd lose the exit
+	// code if we killed it
+	cc.capture.setup(0);
+
+	if (use_forkserver) {
+		char input_filename[PATH_MAX];
+		if (snprintf(input_filename, sizeof(input_filename), "%s/input.cc", cc.stage_dir) >= (int) sizeof(input_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", cc.stage_dir);
+		cc.input_fd = open(input_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (cc.input_fd == -1)
+			error(EXIT_FAILURE, errno, "%s: open()", input_filename);
+
+		cc.fsrv.start(prof.argv[0], prof.argv.data(), cc.trace, cc.stage_dir, cc.input_fd, STDOUT_FILENO, cc.capture.write_fd);
+	}
+}
+
+static void setup_worker(worker &w, unsigned int id, const char *work_dir)
+{
+	w.id = id;
+	w.choices = rng(stream_seed(campaign_seed, id));
+
+	if (snprintf(w.dir, sizeof(w.dir), "%s/%u", work_dir, id) >= (int) sizeof(w.dir))
+		error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+	if (mkdir(w.dir, 0755) == -1 && errno != EEXIST)
+		error(EXIT_FAILURE, errno, "%s: mkdir()", w.dir);
+
+	// Never resized again, since they're set up in place
+	w.compilers = std::vector<compiler>(profiles.size());
+	for (unsigned int i = 0; i < profiles.size(); ++i)
+		setup_compiler(w, w.compilers[i], profiles[i]);
+}
+
+// Where we load the corpus from and save checkpoints to
+static const char *corpus_filename;
+static const uint32_t corpus_magic = 0x56534650; // "PFSV"
+
+static void save_corpus()
+{
+	// At least as far along as the checkpoint
+	replay_out.flush();
+
+	std::vector<testcase> pool;
+	uint8_t virgin[MAP_SIZE];
+	std::vector<uint32_t> hits(MAP_SIZE);
+	unsigned int next_id;
+
+	{
+		std::lock_guard<std::mutex> testcases_lock(testcases_mutex);
+
+		pool = testcases;
+		copy_virgin_bits(virgin);
+		copy_edge_hits(hits.data());
+		next_id = next_testcase_id;
+	}
+
+	// Programs never change once they're in the pool, so it's fine
+	// to serialise them without holding the lock
+	corpus_writer out(corpus_magic);
+	out.put(virgin, MAP_SIZE);
+	out.put(hits.data(), MAP_SIZE * sizeof(hits[0]));
+	out.put<uint32_t>(nr_bits);
+	out.put<uint32_t>(next_id);
+	transformation_scheduler.save(out);
+
+	// All the expressions first, then the programs that refer to them
+	expr_ids ids;
+	corpus_writer testcases_out;
+
+	size_t nr_exprs_offset = out.reserve<uint32_t>();
+	for (const auto &t: pool)
+		t.save(testcases_out, out, ids);
+	out.put_at<uint32_t>(nr_exprs_offset, ids.size());
+
+	out.put<uint32_t>(pool.size());
+	out.put(testcases_out.buf.data(), testcases_out.buf.size());
+
+	out.save(corpus_filename);
+}
+
+static void load_corpus()
+{
+	corpus_reader in;
+	if (!in.open(corpus_filename, corpus_magic))
+		return;
+
+	in.get(virgin_bits, MAP_SIZE);
+	in.get(edge_hits, sizeof(edge_hits));
+	nr_bits = in.get<uint32_t>();
+	next_testcase_id = in.get<uint32_t>();
+	transformation_scheduler.load(in);
+
+	std::vector<expr_ptr> exprs;
+	uint32_t nr_exprs = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_exprs; ++i)
+		exprs.push_back(load_expr(in, exprs));
+
+	uint32_t nr_testcases = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_testcases; ++i)
+		testcases.push_back(testcase::load(in, exprs));
+
+	// --memory may be smaller than it was
+	enforce_memory_limit();
+
+	printf("Loaded %u programs from %s\n", nr_testcases, corpus_filename);
+}
+
+// What we give other instances: our coverage and the programs in the
+// pool that found the most for their size
+static const uint32_t sync_magic = 0x56594650; // "PFYV"
+
+static void export_testcases(corpus_writer &out)
+{
+	std::vector<testcase> pool;
+	uint8_t virgin[MAP_SIZE];
+
+	{
+		std::lock_guard<std::mutex> testcases_lock(testcases_mutex);
+
+		pool = testcases;
+		copy_virgin_bits(virgin);
+	}
+
+	std::sort(pool.begin(), pool.end(), [](const testcase &a, const testcase &b) { return a.value() > b.value(); });
+	if (pool.size() > sync_nr_testcases)
+		pool.erase(pool.begin() + sync_nr_testcases, pool.end());
+
+	out.put(virgin, MAP_SIZE);
+
+	// All the expressions first, like in save_corpus()
+	expr_ids ids;
+	corpus_writer programs_out;
+
+	size_t nr_exprs_offset = out.reserve<uint32_t>();
+	for (const auto &t: pool)
+		t.program->save(programs_out, out, ids);
+	out.put_at<uint32_t>(nr_exprs_offset, ids.size());
+
+	out.put<uint32_t>(pool.size());
+	out.put(programs_out.buf.data(), programs_out.buf.size());
+}
+
+static void import_testcases(corpus_reader &in, const char *peer)
+{
+	uint8_t virgin[MAP_SIZE];
+	in.get(virgin, MAP_SIZE);
+	if (!has_unseen_coverage(virgin))
+		return;
+
+	std::vector<expr_ptr> exprs;
+	uint32_t nr_exprs = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_exprs; ++i)
+		exprs.push_back(load_expr(in, exprs));
+
+	std::vector<program_ptr> programs;
+	uint32_t nr_programs = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_programs; ++i) {
+		auto p = program::load(in, exprs);
+
+		std::string source;
+		p->print(source);
+		if (!seen.insert(std::hash<std::string>()(source)))
+			programs.push_back(p);
+	}
+
+	std::lock_guard<std::mutex> imports_lock(imports_mutex);
+
+	unsigned int nr_imported = 0;
+	for (const auto &p: programs) {
+		if (imports.size() >= max_pending_imports)
+			break;
+
+		imports.push_back(p);
+		++nr_imported;
+	}
+
+	printf("Imported %u of %u programs from %s\n", nr_imported, nr_programs, peer);
+}
+
+static campaign_stats get_campaign_stats()
+{
+	std::lock_guard<std::mutex> testcases_lock(testcases_mutex);
+
+	campaign_stats c;
+	c.queue_depth = testcases.size();
+	c.total_bits = count_seen_entries();
+	c.restarts = 0;
+	return c;
+}
+
+// The benchmarks (bench.cc, bench-valid.cc) include everything but this
+#ifndef PROG_FUZZ_BENCH
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "forkserver", no_argument, 0, 'F' },
+		{ "jobs", required_argument, 0, 'j' },
+		{ "quiet", no_argument, 0, 'q' },
+		{ "plot", no_argument, 0, 'P' },
+		{ "timeout", required_argument, 0, 't' },
+		{ "corpus", required_argument, 0, 'c' },
+		{ "known-ices", required_argument, 0, 'k' },
+		{ "profiles", required_argument, 0, 'p' },
+		{ "memory", required_argument, 0, 'm' },
+		{ "batch", required_argument, 0, 'b' },
+		{ "seed", required_argument, 0, 's' },
+		{ "replay", required_argument, 0, 'r' },
+		{ "sync-dir", required_argument, 0, 'S' },
+		{ "sync-id", required_argument, 0, 'I' },
+		{ 0, 0, 0, 0 },
+	};
+
+	// Number of workers building and running programs
+	unsigned int nr_workers = 1;
+
+	// Append to plot_data as well as writing fuzzer_stats
+	bool plot = false;
+
+	// ICEs we don't report (known-ices.txt if there is one)
+	const char *known_ices_filename = nullptr;
+
+	// Build every program with each of these instead of just cc1plus
+	const char *profiles_filename = nullptr;
+
+	// Random unless given (or taken from the replay log)
+	bool have_seed = false;
+
+	// Make the programs in this log instead of choosing
+	const char *replay_filename = nullptr;
+
+	// Share programs with other instances through this directory
+	const char *sync_dir_name = nullptr;
+	const char *sync_id = nullptr;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "Fj:qPt:c:k:p:m:b:s:r:S:I:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'F':
+			use_forkserver = true;
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			if (nr_workers < 1)
+				error(EXIT_FAILURE, 0, "invalid number of jobs: %s", optarg);
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'P':
+			plot = true;
+			break;
+		case 't':
+			fixed_timeout_ms = atoi(optarg);
+			if (fixed_timeout_ms < 1)
+				error(EXIT_FAILURE, 0, "invalid timeout: %s", optarg);
+			break;
+		case 'c':
+			corpus_filename = optarg;
+			break;
+		case 'k':
+			known_ices_filename = optarg;
+			break;
+		case 'p':
+			profiles_filename = optarg;
+			break;
+		case 'm':
+			if (atoi(optarg) < 1)
+				error(EXIT_FAILURE, 0, "invalid memory limit: %s", optarg);
+			max_pool_bytes = (size_t) atoi(optarg) << 20;
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			if (batch_size < 1 || batch_size > max_batch_size)
+				error(EXIT_FAILURE, 0, "invalid batch size: %s (at most %u)", optarg, max_batch_size);
+			break;
+		case 's': {
+			char *end;
+			campaign_seed = strtoull(optarg, &end, 0);
+			if (!*optarg || *end)
+				error(EXIT_FAILURE, 0, "invalid seed: %s", optarg);
+			have_seed = true;
+			break;
+		}
+		case 'r':
+			replay_filename = optarg;
+			break;
+		case 'S':
+			sync_dir_name = optarg;
+			break;
+		case 'I':
+			sync_id = optarg;
+			break;
+		default:
+			error(EXIT_FAILURE, 0, "usage: %s [--forkserver] [--jobs N] [--quiet] [--plot] [--timeout MS] [--corpus FILE] [--known-ices FILE] [--profiles FILE] [--memory MB] [--batch K] [--seed N] [--replay FILE] [--sync-dir DIR] [--sync-id NAME]", argv[0]);
+		}
+	}
+
+	// Imports would make the replay something else
+	if (replay_filename && sync_dir_name)
+		error(EXIT_FAILURE, 0, "--replay and --sync-dir don't go together");
+
+	if (replay_filename) {
+		replay_in.load(replay_filename);
+		replaying = true;
+
+		if (!have_seed && replay_in.have_seed) {
+			campaign_seed = replay_in.seed;
+			have_seed = true;
+		}
+	}
+
+	if (!have_seed) {
+		std::random_device r;
+		campaign_seed = (uint64_t) r() << 32 | r();
+	}
+
+	printf("Seed: %" PRIu64 "\n", campaign_seed);
+
+	if (known_ices_filename) {
+		if (!load_known_ices(known_ices_filename))
+			error(EXIT_FAILURE, ENOENT, "%s: fopen()", known_ices_filename);
+	} else {
+		load_known_ices("known-ices.txt");
+	}
+
+	if (profiles_filename)
+		load_profiles(profiles_filename);
+	else
+		add_default_profile();
+	finish_profiles();
+
+	struct timeval tv_start;
+	if (gettimeofday(&tv_start, 0) == -1)
+		error(EXIT_FAILURE, errno, "gettimeofday()");
+
+	static char work_dir[PATH_MAX];
+	snprintf(work_dir, sizeof(work_dir), "work-%lu", tv_start.tv_sec);
+	if (mkdir(work_dir, 0755) == -1 && errno != EEXIST)
+		error(EXIT_FAILURE, errno, "%s: mkdir()", work_dir);
+
+	reset_virgin_bits();
+	setup_toolchain();
+	setup_stage_root();
+
+	// Nothing new to log while replaying
+	if (!replaying) {
+		char log_filename[PATH_MAX];
+		if (snprintf(log_filename, sizeof(log_filename), "%s/replay", work_dir) >= (int) sizeof(log_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+		replay_out.open(log_filename, campaign_seed);
+	} else {
+		printf("Replaying %zu programs from %s\n", replay_in.entries.size(), replay_in.filename);
+	}
+
+	static char default_corpus_filename[PATH_MAX];
+	if (!corpus_filename) {
+		if (snprintf(default_corpus_filename, sizeof(default_corpus_filename), "%s/corpus", work_dir) >= (int) sizeof(default_corpus_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+		corpus_filename = default_corpus_filename;
+	}
+
+	load_corpus();
+
+	static sync_dir sync;
+	if (sync_dir_name)
+		sync.setup(sync_dir_name, sync_id);
+
+	std::vector<worker> workers(nr_workers);
+	for (unsigned int i = 0; i < nr_workers; ++i)
+		setup_worker(workers[i], i, work_dir);
+
+	static stats_writer stats;
+	stats.setup(work_dir, plot);
+
+	std::vector<const worker_stats *> all_worker_stats;
+	for (auto &w: workers)
+		all_worker_stats.push_back(&w.stats);
+
+	uint64_t start_us = now_us();
+	for (auto &w: workers)
+		w.thread = std::thread(run_worker, std::ref(w));
+
+	// Only set at the end of a replay; otherwise we keep going after
+	// finding something
+	static std::atomic<bool> stop;
+
+	std::thread stats_thread(run_stats, std::ref(stats), std::cref(all_worker_stats), std::cref(stop), get_campaign_stats);
+	std::thread checkpoint_thread(run_checkpoints, std::cref(stop), save_corpus);
+
+	std::thread sync_thread;
+	if (sync_dir_name)
+		sync_thread = std::thread(run_sync, std::ref(sync), std::cref(stop), sync_magic, export_testcases, import_testcases);
+
+	for (auto &w: workers)
+		w.thread.join();
+
+	// Only replays ever get here
+	uint64_t nr_builds = 0;
+	for (const auto &w: workers)
+		nr_builds += w.stats.nr_execs;
+
+	printf("Replayed %zu programs in %.2f s (%" PRIu64 " builds); %u bits\n", replay_in.entries.size(), (now_us() - start_us) / 1e6, nr_builds, (unsigned int) nr_bits);
+	stop = true;
+
+	stats_thread.join();
+	checkpoint_thread.join();
+	if (sync_thread.joinable())
+		sync_thread.join();
+
+	return 0;
+}
+#endif
@@ -1,7 +1,6 @@
 // Copyright (C) 2017  Vegard Nossum <vegard.nossum@oracle.com>
 
-#include <sys/ipc.h>
-#include <sys/shm.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -9,6 +8,8 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <error.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,18 +17,38 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
 #include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 // From AFL
 #include "config.h"
 
+#include "afl.hh"
+#include "bugs.hh"
+#include "corpus.hh"
+#include "pool.hh"
+#include "replay.hh"
+#include "rng.hh"
+#include "scheduler.hh"
+#include "seen.hh"
+#include "stats.hh"
+#include "sync.hh"
+
 struct node;
 typedef std::shared_ptr<node> node_ptr;
 
+// Base of the polynomial hash of the flattened text (see node::hash)
+static const uint64_t hash_base = 0x100000001b3;
+
 // Internal representation of a (sub)program; either
 // (a) a fixed string, OR (b) a sequence of child nodes
 struct node {
@@ -37,54 +58,141 @@ struct node {
 	// Fixed means the node cannot be replaced through mutation
 	bool fixed;
 
+	// Summaries of the subtree, so nothing needs to walk the whole
+	// tree to get them. Nodes never change once they're in a tree, so
+	// these only get computed (by update()) when a node is made, from
+	// its text and its children's summaries; call update() again after
+	// adding children to a new node.
+	//
+	// The hash is of the flattened text (the sum of text[i] *
+	// hash_base^(flat_size - 1 - i)), so trees that print the same
+	// hash the same whatever their shape, and a node's hash is easy
+	// to get from its children's.
+	unsigned int flat_size;
+	unsigned int nr_leaves;
+	size_t nr_bytes; // see memory()
+	uint64_t hash;
+	uint64_t hash_pow; // hash_base^flat_size
+
 	node():
 		fixed(false)
 	{
+		update();
 	}
 
 	node(std::string text, bool fixed = false):
 		text(text),
 		fixed(fixed)
 	{
+		update();
 	}
 
 	explicit node(const std::vector<node_ptr> &children):
 		children(children),
 		fixed(false)
 	{
+		update();
 	}
 
 	virtual ~node()
 	{
 	}
 
+	void update()
+	{
+		flat_size = 0;
+		nr_leaves = children.empty() && !fixed;
+		nr_bytes = fixed ? 0 : sizeof(node) + 2 * sizeof(long) + text.capacity() + children.capacity() * sizeof(node_ptr);
+		hash = 0;
+		hash_pow = 1;
+
+		for (char c: text) {
+			hash = hash * hash_base + (unsigned char) c;
+			hash_pow *= hash_base;
+		}
+		flat_size += text.size();
+
+		for (const auto &child: children) {
+			flat_size += child->flat_size;
+			nr_leaves += child->nr_leaves;
+			nr_bytes += fixed ? 0 : child->nr_bytes;
+			hash = hash * child->hash_pow + child->hash;
+			hash_pow *= child->hash_pow;
+		}
+	}
+
 	node_ptr set_child(unsigned int i, node_ptr x) const
 	{
-		auto ret = std::make_shared<node>(children);
+		auto ret = make_node<node>(children);
 		ret->children[i] = x;
+		ret->update();
 		return ret;
 	}
 
-	void print(FILE *f) const
+	// Render (append) the flattened program text to out
+	void print(std::string &out) const
 	{
-		fprintf(f, "%s", text.c_str());
+		out += text;
 		for (const auto &child: children)
-			child->print(f);
+			child->print(out);
 	}
 
 	// textual size when flattened (may be used to score test cases)
 	unsigned int size() const
 	{
-		unsigned int n = text.size();
+		return flat_size;
+	}
+
+	// Roughly how much memory this subtree holds (the node, its shared_ptr
+	// control block, its text and its children), not counting fixed
+	// nodes since everything shares those (see fixed_nodes). Subtrees
+	// shared with other trees are counted in full.
+	size_t memory() const
+	{
+		return nr_bytes;
+	}
+
+	// Corpus checkpoints. Test cases share most of their subtrees, so
+	// every node gets saved only once (after its children) and is
+	// referred to by its position in the list of saved nodes.
+	uint32_t save(corpus_writer &out, std::unordered_map<const node *, uint32_t> &ids) const
+	{
+		auto it = ids.find(this);
+		if (it != ids.end())
+			return it->second;
+
+		std::vector<uint32_t> child_ids;
 		for (const auto &child: children)
-			n += child->size();
-		return n;
+			child_ids.push_back(child->save(out, ids));
+
+		out.put<uint8_t>(fixed);
+		out.put_string(text);
+		out.put<uint32_t>(child_ids.size());
+		for (uint32_t id: child_ids)
+			out.put<uint32_t>(id);
+
+		uint32_t id = ids.size();
+		ids[this] = id;
+		return id;
+	}
+
+	static node_ptr load(corpus_reader &in, const std::vector<node_ptr> &nodes)
+	{
+		bool fixed = in.get<uint8_t>();
+		auto ret = make_node<node>(in.get_string(), fixed);
+
+		uint32_t nr_children = in.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_children; ++i)
+			ret->children.push_back(in.get_ref(nodes));
+		ret->update();
+
+		return ret;
 	}
 };
 
-static node_ptr replace(node_ptr n, node_ptr a, node_ptr b)
+static node_ptr replace(node_ptr n, const node *a, node_ptr b)
 {
-	if (n == a)
+	if (n.get() == a)
 		return b;
 
 	const auto &children = n->children;
@@ -101,52 +209,206 @@ static node_ptr replace(node_ptr n, node_ptr a, node_ptr b)
 	return n;
 }
 
-static std::vector<node_ptr> find_leaves(node_ptr root)
+// Mutable leaves of a tree. These are only ever looked at while the
+// tree they belong to is alive, so raw pointers are fine.
+typedef std::vector<const node *> leaf_vec;
+typedef std::shared_ptr<const leaf_vec> leaf_vec_ptr;
+
+// Replace leaves[i] by replacement, keeping the list of leaves up to
+// date: the old leaf goes away and the non-fixed children of the
+// replacement (which are leaves themselves) come in.
+static node_ptr replace_leaf(node_ptr root, leaf_vec &leaves, unsigned int i, node_ptr replacement)
 {
-	std::vector<node_ptr> result;
-
-	// Bog standard agenda-based traversal
-	std::set<node_ptr> seen;
-	std::set<node_ptr> todo;
-	todo.insert(root);
-
-	while (todo.size()) {
-		auto it = todo.begin();
-		node_ptr n = *it;
-		assert(n);
-		todo.erase(it);
-		if (!seen.insert(n).second)
-			continue;
+	const node *leaf = leaves[i];
+	leaves[i] = leaves.back();
+	leaves.pop_back();
 
-		const auto &children = n->children;
-		if (!children.size() && !n->fixed)
-			result.push_back(n);
+	if (replacement->children.empty())
+		leaves.push_back(replacement.get());
 
-		for (const auto &child: children)
-			todo.insert(child);
+	for (const auto &child: replacement->children) {
+		assert(child->children.empty());
+		if (!child->fixed)
+			leaves.push_back(child.get());
 	}
 
-	return result;
+	return replace(root, leaf, replacement);
 }
 
+// The leaves are exactly the nodes that aren't fixed and don't have any
+// children; this is what we use for trees that were loaded from disk.
+static void find_leaves(const node *n, leaf_vec &leaves)
+{
+	if (n->children.empty() && !n->fixed)
+		leaves.push_back(n);
+
+	for (const auto &child: n->children)
+		find_leaves(child.get(), leaves);
+}
+
+// Grammar rules. Each one is a sequence of parts: fixed text, or a hole
+// (a mutable leaf) that starts out with the given text. The built-in
+// grammar is generated from rules/cxx.txt by rules2code.py; --grammar
+// loads a different one (in the same format) at startup instead.
+struct rule_part {
+	const char *text;
+	bool fixed;
+};
+
+struct rule {
+	const rule_part *parts;
+	unsigned int nr_parts;
+};
+
 #include "rules/cxx.hh"
 
-static std::random_device r;
-static std::default_random_engine re;
+// A rule ready to be instantiated. Fixed nodes are never leaves, so
+// nothing ever replaces them and the same node can be shared by every
+// tree (and every rule) that has that text; only holes get allocated.
+struct grammar_part {
+	node_ptr fixed;
+	std::string text;
+};
+
+typedef std::vector<grammar_part> grammar_rule;
+
+static std::vector<grammar_rule> grammar;
+static std::unordered_map<std::string, node_ptr> fixed_nodes;
+
+static void add_rule_part(grammar_rule &rule, const std::string &text, bool fixed)
+{
+	grammar_part part;
+	if (fixed) {
+		auto &n = fixed_nodes[text];
+		if (!n)
+			n = make_node<node>(text, true);
+		part.fixed = n;
+	} else {
+		part.text = text;
+	}
+
+	rule.push_back(part);
+}
+
+static void load_builtin_grammar()
+{
+	for (unsigned int i = 0; i < nr_builtin_rules; ++i) {
+		grammar_rule rule;
+		for (unsigned int j = 0; j < builtin_rules[i].nr_parts; ++j)
+			add_rule_part(rule, builtin_rules[i].parts[j].text, builtin_rules[i].parts[j].fixed);
+		grammar.push_back(rule);
+	}
+}
+
+// Same format and escaping as rules2code.py: one quoted rule per line,
+// holes in [brackets], and a backslash escapes the next character
+// (\[ and \] for literal brackets, \" for quotes). Lines starting
+// with # are comments.
+static void load_grammar(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		error(EXIT_FAILURE, errno, "%s: fopen()", filename);
+
+	char *line = nullptr;
+	size_t line_size = 0;
+	unsigned int lineno = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_size, f)) != -1) {
+		++lineno;
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		if (len < 2 || line[0] != '"' || line[len - 1] != '"')
+			error(EXIT_FAILURE, 0, "%s:%u: expected a quoted rule", filename, lineno);
+
+		grammar_rule rule;
+		std::string text;
+		bool in_hole = false;
+		for (ssize_t i = 1; i < len - 1; ++i) {
+			char c = line[i];
+			if (c == '\\' && i + 1 < len - 1) {
+				text += line[++i];
+			} else if (c == '[' && !in_hole) {
+				add_rule_part(rule, text, true);
+				text.clear();
+				in_hole = true;
+			} else if (c == ']' && in_hole) {
+				add_rule_part(rule, text, false);
+				text.clear();
+				in_hole = false;
+			} else {
+				text += c;
+			}
+		}
+
+		if (in_hole)
+			error(EXIT_FAILURE, 0, "%s:%u: missing ]", filename, lineno);
+		add_rule_part(rule, text, true);
+
+		grammar.push_back(rule);
+	}
+
+	if (ferror(f))
+		error(EXIT_FAILURE, errno, "%s: getline()", filename);
+	free(line);
+	fclose(f);
+
+	if (grammar.empty())
+		error(EXIT_FAILURE, 0, "%s: no rules", filename);
+}
+
+static node_ptr mutate(node_ptr root, leaf_vec &leaves, unsigned int leaf, unsigned int mutation)
+{
+	const auto &rule = grammar[mutation];
+
+	auto replacement = make_node<node>();
+	replacement->children.reserve(rule.size());
+	for (const auto &part: rule)
+		replacement->children.push_back(part.fixed ? part.fixed : make_node<node>(part.text));
+	replacement->update();
+
+	return replace_leaf(root, leaves, leaf, replacement);
+}
+
+// Every worker has its own stream, derived from the campaign's seed
+// (--seed); see setup_worker()
+static uint64_t campaign_seed;
+static thread_local rng re;
+
+// How each test case was made (see replay.hh)
+static replay_log replay_out;
 
 struct testcase {
+	// its entry in the replay log
+	uint64_t id;
+
 	node_ptr root;
+	leaf_vec_ptr leaves;
 	unsigned int generation;
 	std::set<unsigned int> mutations;
 	unsigned int mutation_counter;
 	unsigned int new_bits;
+	float rarity;
+	uint64_t exec_us;
 	float score;
 
-	explicit testcase(node_ptr root, unsigned int generation, std::set<unsigned int> mutations, unsigned int mutation_counter, unsigned int new_bits):
+	// see node::memory()
+	size_t bytes;
+
+	explicit testcase(uint64_t id, node_ptr root, leaf_vec_ptr leaves, unsigned int generation, std::set<unsigned int> mutations, unsigned int mutation_counter, unsigned int new_bits, float rarity, uint64_t exec_us, uint64_t median_exec_us):
+		id(id),
 		root(root),
+		leaves(leaves),
 		generation(generation),
+		mutations(mutations),
 		mutation_counter(mutation_counter),
-		new_bits(new_bits)
+		new_bits(new_bits),
+		rarity(rarity),
+		exec_us(exec_us),
+		bytes(sizeof(*this) + root->memory() + leaves->capacity() * sizeof(const node *))
 	{
 		// the lower score, the more important the testcase is
 		score = 0;
@@ -172,147 +434,625 @@ struct testcase {
 		// trace bits from AFL are very important
 		score += -10 * (int) new_bits;
 
+		// and so are parts of the compiler that few test cases get to
+		score += -10 * rarity;
+
+		// slow test cases slow everything down, like in AFL (exec_us)
+		if (exec_us && median_exec_us)
+			score += 10 * std::log2((double) exec_us / median_exec_us);
+
 		// add a small random offset
 		score += std::normal_distribution<>(0, 100)(re);
 	}
+
+	void save(corpus_writer &out, uint32_t root_id) const
+	{
+		out.put<uint32_t>(generation);
+		out.put<uint32_t>(mutations.size());
+		for (unsigned int mutation: mutations)
+			out.put<uint32_t>(mutation);
+		out.put<uint32_t>(mutation_counter);
+		out.put<uint32_t>(new_bits);
+		out.put<float>(rarity);
+		out.put<uint64_t>(exec_us);
+		out.put<float>(score);
+		out.put<uint32_t>(root_id);
+	}
+
+	static testcase load(corpus_reader &in, const std::vector<node_ptr> &nodes)
+	{
+		unsigned int generation = in.get<uint32_t>();
+
+		std::set<unsigned int> mutations;
+		uint32_t nr_mutations = in.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_mutations; ++i)
+			mutations.insert(in.get<uint32_t>());
+
+		unsigned int mutation_counter = in.get<uint32_t>();
+		unsigned int new_bits = in.get<uint32_t>();
+		float rarity = in.get<float>();
+		uint64_t exec_us = in.get<uint64_t>();
+		float score = in.get<float>();
+
+		auto root = in.get_ref(nodes);
+		auto leaves = std::make_shared<leaf_vec>();
+		leaves->reserve(root->nr_leaves);
+		find_leaves(root.get(), *leaves);
+
+		// Keep the score it had rather than drawing a new random offset.
+		// We can't make it again from a replay log, so it gets an id
+		// that's not in there.
+		testcase result(replay_out.skip(), root, leaves, generation, mutations, mutation_counter, new_bits, rarity, exec_us, 0);
+		result.score = score;
+		return result;
+	}
 };
 
 bool operator<(const testcase &a, const testcase &b)
 {
-	if (a.score < b.score)
-		return true;
-
-	return a.root < b.root;
+	return a.score < b.score;
 }
 
-// Fixed-size priority queue that discards deprioritized items when full
+// Fixed-size priority queue that discards deprioritized items when full,
+// or when the items together hold more than max_bytes of memory (each
+// item says how much it holds in T::bytes).
+//
+// This is a min-max heap, so both the most important item (the one we
+// work on) and the least important one (the one we throw out when the
+// queue is full) are always at the top. Items that compare equal come
+// out in the order they were pushed.
 template<typename T>
 struct fixed_priority_queue
 {
-	std::set<T> set;
+	struct entry {
+		T value;
+		uint64_t seq;
+
+		bool operator<(const entry &other) const
+		{
+			if (value < other.value)
+				return true;
+			if (other.value < value)
+				return false;
+
+			return seq < other.seq;
+		}
+	};
+
+	std::vector<entry> heap;
 	unsigned int fixed_size;
+	uint64_t next_seq;
+
+	size_t bytes;
+	size_t max_bytes;
+
+	fixed_priority_queue(unsigned int size, size_t max_bytes):
+		fixed_size(size),
+		next_seq(0),
+		bytes(0),
+		max_bytes(max_bytes)
+	{
+	}
+
+	// Even levels (starting with the root) are min levels, odd levels
+	// are max levels
+	static bool is_min_level(unsigned int i)
+	{
+		return (31 - __builtin_clz(i + 1)) % 2 == 0;
+	}
+
+	// Does a belong above b on a min (max) level?
+	template<bool min>
+	bool above(unsigned int a, unsigned int b) const
+	{
+		return min ? heap[a] < heap[b] : heap[b] < heap[a];
+	}
 
-	fixed_priority_queue(unsigned int size):
-		fixed_size(size)
+	template<bool min>
+	void bubble_up(unsigned int i)
 	{
+		while (i > 2) {
+			unsigned int grandparent = ((i - 1) / 2 - 1) / 2;
+			if (!above<min>(i, grandparent))
+				break;
+
+			std::swap(heap[i], heap[grandparent]);
+			i = grandparent;
+		}
+	}
+
+	void bubble_up(unsigned int i)
+	{
+		if (i == 0)
+			return;
+
+		unsigned int parent = (i - 1) / 2;
+		if (is_min_level(i)) {
+			if (heap[parent] < heap[i]) {
+				std::swap(heap[i], heap[parent]);
+				bubble_up<false>(parent);
+			} else {
+				bubble_up<true>(i);
+			}
+		} else {
+			if (heap[i] < heap[parent]) {
+				std::swap(heap[i], heap[parent]);
+				bubble_up<true>(parent);
+			} else {
+				bubble_up<false>(i);
+			}
+		}
+	}
+
+	template<bool min>
+	void trickle_down(unsigned int i)
+	{
+		unsigned int n = heap.size();
+
+		while (2 * i + 1 < n) {
+			// Find the smallest (largest) child or grandchild
+			unsigned int m = 2 * i + 1;
+			if (2 * i + 2 < n && above<min>(2 * i + 2, m))
+				m = 2 * i + 2;
+			for (unsigned int j = 4 * i + 3; j < 4 * i + 7 && j < n; ++j) {
+				if (above<min>(j, m))
+					m = j;
+			}
+
+			if (!above<min>(m, i))
+				break;
+
+			std::swap(heap[m], heap[i]);
+			if (m <= 2 * i + 2)
+				break;
+
+			// It was a grandchild; the item we moved down might
+			// now be on the wrong side of its new parent
+			unsigned int parent = (m - 1) / 2;
+			if (above<min>(parent, m))
+				std::swap(heap[m], heap[parent]);
+
+			i = m;
+		}
+	}
+
+	void trickle_down(unsigned int i)
+	{
+		if (is_min_level(i))
+			trickle_down<true>(i);
+		else
+			trickle_down<false>(i);
+	}
+
+	void remove(unsigned int i)
+	{
+		bytes -= heap[i].value.bytes;
+		heap[i] = std::move(heap.back());
+		heap.pop_back();
+
+		if (i < heap.size())
+			trickle_down(i);
+	}
+
+	// Index of the least important item
+	unsigned int bottom() const
+	{
+		if (heap.size() < 3)
+			return heap.size() - 1;
+
+		return heap[1] < heap[2] ? 2 : 1;
 	}
 
 	void push(const T& x)
 	{
-		set.insert(x);
+		entry e = { x, next_seq++ };
+
+		if (heap.size() >= fixed_size) {
+			// Less important than everything we already have?
+			if (heap.empty() || !(e < heap[bottom()]))
+				return;
+
+			remove(bottom());
+		}
+
+		heap.push_back(e);
+		bubble_up(heap.size() - 1);
+		bytes += x.bytes;
 
-		unsigned int n = set.size();
-		for (unsigned int i = fixed_size; i < n; ++i)
-			set.erase(--set.end());
+		// Always keep the most important one
+		while (bytes > max_bytes && heap.size() > 1)
+			remove(bottom());
 	}
 
 	const T top()
 	{
-		return *set.begin();
+		return heap[0].value;
 	}
 
 	const T pop()
 	{
-		auto it = set.begin();
-		T result = *it;
-		set.erase(it);
+		T result = heap[0].value;
+		remove(0);
 		return result;
 	}
 
 	unsigned int size()
 	{
-		return set.size();
+		return heap.size();
 	}
 
 	bool empty()
 	{
-		return set.empty();
+		return heap.empty();
 	}
 };
 
-// From AFL
-int shm_id;
-uint8_t *trace_bits;
+// TODO: clean up, take from command line
+//
+// The compiler to run. You need to substitute the path to your own compiler here.
 
-// From AFL
-static void remove_shm(void)
+//if (execlp("/usr/bin/g++-5", "g++", "-x", "c++", "-std=c++14", "-Os", "-c", "-", NULL) == -1)
+//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/xgcc", "xgcc", "-x", "c++", "-std=c++14", "-O3", "-c", "-", NULL) == -1)
+//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/xgcc", "xgcc", "-x", "c++", "-std=c++14", "-O3", "-Wall", "-fpermissive", "-g", "-pg", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", "-fsanitize=undefined", "-fsanitize=address", "-fsanitize=leak", "-c", "-", NULL) == -1)
+//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/xgcc", "xgcc", "-x", "c++", "-std=c++14", "-O3", "-Wall", "-fpermissive", "-g", "-pg", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", "-fsanitize=undefined", "-fsanitize=address", "-fsanitize=leak", "-S", "-", NULL) == -1)
+// invoke cc1plus directly (skips fork+exec)
+static const char *compiler_path = "/home/vegard/personal/programming/gcc/build/gcc/cc1plus";
+static const char *compiler_argv[] = { "cc1plus", "-quiet", "-imultiarch", "x86_64-linux-gnu", "-iprefix", "/home/vegard/personal/programming/gcc/build/gcc/../lib/gcc/x86_64-pc-linux-gnu/8.0.1/", "-D_GNU_SOURCE", "-", "-quiet", "-dumpbase", "-", "-mtune=generic", "-march=x86-64", "-auxbase", "-", "-g", "-O3", "-Wall", "-std=c++14", "-p", "-fpermissive", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", /*"-fsanitize=undefined",*/ "-fsanitize=address", "-fsanitize=leak", "-faggressive-loop-optimizations", "-fauto-inc-dec", "-fbranch-probabilities", "-fbranch-target-load-optimize2", "-fcheck-data-deps", "-fcompare-elim", "-fdce", "-fdse", "-fexpensive-optimizations", "-fhoist-adjacent-loads", "-fgcse-lm", "-fgcse-sm", "-fipa-profile", "-fno-toplevel-reorder", "-fsched-group-heuristic", "-fschedule-fusion", "-fschedule-insns", "-fschedule-insns2", "-ftracer", "-funroll-loops", "-fvect-cost-model", "-o", "-.s", NULL };
+
+// Everything a worker needs to run the compiler on its own
+struct worker {
+	unsigned int id;
+	uint64_t seed;
+
+	// scratch directory the compiler runs in
+	char dir[PATH_MAX];
+
+	trace_map trace;
+	forkserver fsrv;
+
+	int input_fd;
+	stderr_capture capture;
+
+	// compiler started by start_fork_exec() (without the fork server)
+	pid_t child;
+
+	worker_stats stats;
+
+	std::thread thread;
+
+	worker():
+		input_fd(-1),
+		child(-1)
+	{
+	}
+};
+
+// A mutated test case, ready to be compiled. Each worker prepares the
+// next one while the compiler is busy with the previous one.
+struct candidate {
+	// its entry in the replay log
+	uint64_t id;
+
+	node_ptr root;
+	leaf_vec_ptr leaves;
+
+	// what we know about the test case it was derived from
+	unsigned int generation;
+	std::set<unsigned int> mutations;
+	unsigned int mutation_counter;
+	unsigned int new_bits;
+
+	unsigned int mutation;
+	time_t time;
+
+	// from another instance (see sync.hh), so no mutation
+	bool imported;
+
+	// Source of the program; rendered once and reused for the
+	// compiler's input, the log and any reproducer
+	std::string source;
+};
+
+// State shared between all workers
+static bool use_forkserver;
+static seen_filter seen;
+static bool quiet;
+static unsigned int fixed_timeout_ms;
+static int devnull;
+
+// Kill the compiler once it has printed this much without an ICE
+// (--max-stderr); 0 for no limit
+static size_t max_stderr;
+
+static std::mutex pq_mutex;
+static const unsigned int pq_size = 1200;
+
+// How much memory the queue may use (--memory)
+static size_t max_corpus_bytes = (size_t) 1024 << 20;
+static fixed_priority_queue<testcase> pq(pq_size, max_corpus_bytes);
+
+// One per grammar rule; allocated once the grammar has been loaded
+static std::vector<std::atomic<unsigned int>> mutation_counters;
+static scheduler mutation_scheduler;
+
+static std::atomic<unsigned int> nr_execs;
+static std::atomic<unsigned int> nr_execs_without_new_bits;
+static std::atomic<unsigned int> nr_restarts;
+
+// Number of test cases that survive a restart
+static const unsigned int nr_restart_seeds = 16;
+
+// Where we load the corpus from and save checkpoints to
+static const char *corpus_filename;
+static const uint32_t corpus_magic = 0x51534650; // "PFSQ"
+
+// Never set; we keep going after finding something
+static std::atomic<bool> stop;
+
+static void start_fork_exec(worker &w, const std::string &source)
 {
-	if (shmctl(shm_id, IPC_RMID, NULL) == -1)
-		error(EXIT_FAILURE, errno, "shmctl(IPC_RMID)");
-	if (shmdt(trace_bits) == -1)
-		error(EXIT_FAILURE, errno, "shmdt()");
+	int pipefd[2];
+	if (pipe2(pipefd, O_CLOEXEC) == -1)
+		error(EXIT_FAILURE, errno, "pipe2()");
+
+	pid_t child = fork();
+	if (child == -1)
+		error(EXIT_FAILURE, errno, "fork()");
+
+	if (child == 0) {
+		dup2(pipefd[0], STDIN_FILENO);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(w.capture.write_fd, STDERR_FILENO);
+
+		exec_target(compiler_path, (char *const *) compiler_argv, w.trace, w.dir);
+	}
+
+	close(pipefd[0]);
+	write_all(pipefd[1], source);
+	close(pipefd[1]);
+
+	w.child = child;
 }
 
-// From AFL
-static void setup_shm(void)
+static void start_forkserver(worker &w, const std::string &source)
 {
-	shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
-	if (shm_id < 0)
-		error(EXIT_FAILURE, errno, "shmget()");
+	// The fork server keeps the same stdin file description across
+	// runs, so rewrite it in place.
+	if (ftruncate(w.input_fd, 0) == -1)
+		error(EXIT_FAILURE, errno, "ftruncate()");
+	if (lseek(w.input_fd, 0, SEEK_SET) == -1)
+		error(EXIT_FAILURE, errno, "lseek()");
 
-	atexit(remove_shm);
+	write_all(w.input_fd, source);
 
-	char *shm_str;
-	asprintf(&shm_str, "%d", shm_id);
-	setenv(SHM_ENV_VAR, shm_str, 1);
-	free(shm_str);
+	if (lseek(w.input_fd, 0, SEEK_SET) == -1)
+		error(EXIT_FAILURE, errno, "lseek()");
 
-	trace_bits = (uint8_t *) shmat(shm_id, NULL, 0);
-	if (!trace_bits)
-		error(EXIT_FAILURE, errno, "shmat()");
+	w.fsrv.start_run();
 }
 
-int main(int argc, char *argv[])
+static void start_compiler(worker &w, const std::string &source)
 {
-	re = std::default_random_engine(r());
+	w.trace.clear();
+	w.capture.reset();
 
-	int devnull = open("/dev/null", O_RDWR);
-	if (devnull == -1)
-		error(EXIT_FAILURE, errno, "/dev/null: open()");
+	if (use_forkserver)
+		start_forkserver(w, source);
+	else
+		start_fork_exec(w, source);
+}
 
-	FILE *devnullf = fdopen(devnull, "r+");
-	if (!devnullf)
-		error(EXIT_FAILURE, errno, "/dev/null: fdopen()");
+// Wait for the compiler started by start_compiler() and return its
+// waitpid() status; it gets killed if it's taking too long or printing
+// more than --max-stderr
+static int wait_compiler(worker &w, bool &timed_out)
+{
+	unsigned int timeout_ms = w.stats.timeout_ms(PHASE_COMPILE, fixed_timeout_ms);
 
-	struct timeval tv_start;
-	if (gettimeofday(&tv_start, 0) == -1)
+	int status;
+	if (use_forkserver)
+		status = w.fsrv.wait(timeout_ms, timed_out, &w.capture);
+	else
+		status = wait_child(w.child, timeout_ms, timed_out, &w.capture);
+
+	if (timed_out && !w.capture.too_much)
+		++w.stats.nr_timeouts;
+
+	return status;
+}
+
+// Check the compiler's output (in w.capture) for an ICE and return its
+// bucket, unless it's one we already know about
+static ice_bucket check_for_ice(worker &w, int status)
+{
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != ice_exit_code || !w.capture.ice)
+		return ice_bucket();
+
+	ice_bucket ice = parse_ice(w.capture.buffer);
+	if (is_known_ice(ice))
+		return ice_bucket();
+
+	return ice;
+}
+
+static void setup_worker(worker &w, unsigned int id, const char *work_dir)
+{
+	w.id = id;
+	w.seed = stream_seed(campaign_seed, id);
+
+	if (snprintf(w.dir, sizeof(w.dir), "%s/%u", work_dir, id) >= (int) sizeof(w.dir))
+		error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+	if (mkdir(w.dir, 0755) == -1 && errno != EEXIST)
+		error(EXIT_FAILURE, errno, "%s: mkdir()", w.dir);
+
+	w.trace.setup();
+	w.capture.setup(max_stderr);
+
+	if (use_forkserver) {
+		char input_filename[PATH_MAX];
+		if (snprintf(input_filename, sizeof(input_filename), "%s/input.cc", w.dir) >= (int) sizeof(input_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", w.dir);
+
+		w.input_fd = open(input_filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (w.input_fd == -1)
+			error(EXIT_FAILURE, errno, "%s: open()", input_filename);
+
+		w.fsrv.start(compiler_path, (char *const *) compiler_argv, w.trace, w.dir, w.input_fd, devnull, w.capture.write_fd);
+	}
+}
+
+// When it was made and what it looks like
+static void finish_candidate(worker &w, candidate &c, uint64_t t)
+{
+	struct timeval tv;
+	if (gettimeofday(&tv, 0) == -1)
 		error(EXIT_FAILURE, errno, "gettimeofday()");
+	c.time = tv.tv_sec;
+
+	t = w.stats.time(PHASE_MUTATE, t);
+
+	c.source.clear();
+	c.root->print(c.source);
+	w.stats.time(PHASE_SERIALIZE, t);
+}
 
-	static char stderr_filename[PATH_MAX];
-	snprintf(stderr_filename, sizeof(stderr_filename), "stderr-%lu.txt", tv_start.tv_sec);
+// What test cases get made from again with --replay
+struct replay_tree {
+	node_ptr root;
+	leaf_vec_ptr leaves;
+};
+
+static bool replaying;
+static replay_reader<replay_tree> replay_in;
 
-	unsigned int mutation_counters[nr_mutations] = {};
-	unsigned int trace_bits_counters[MAP_SIZE] = {};
+// Make the next test case in the replay log (instead of choosing one);
+// returns false at the end of the log.
+static bool replay_candidate(worker &w, candidate &c)
+{
+	std::lock_guard<std::mutex> replay_lock(replay_in.mutex);
 
-	fixed_priority_queue<testcase> pq(1200);
+	uint64_t t = now_us();
 
-	unsigned int nr_execs = 0;
-	unsigned int nr_execs_without_new_bits = 0;
+	replay_entry e;
+	while (replay_in.next(e)) {
+		if (e.parent == no_parent) {
+			if (!e.args.empty())
+				replay_in.invalid(e);
+
+			auto root = make_node<node>();
+			replay_in.add(e.id, replay_tree { root, std::make_shared<leaf_vec>(1, root.get()) });
+			continue;
+		}
+
+		auto parent = replay_in.get_parent(e);
+		if (e.args.size() != 2 || e.args[0] >= parent.leaves->size() || e.args[1] >= grammar.size())
+			replay_in.invalid(e);
+
+		auto leaves = std::make_shared<leaf_vec>(*parent.leaves);
+		c.id = e.id;
+		c.root = mutate(parent.root, *leaves, e.args[0], e.args[1]);
+		c.leaves = leaves;
+		replay_in.add(e.id, replay_tree { c.root, c.leaves });
+
+		// These only go into the scores in the queue, which we
+		// don't pick from
+		c.generation = 0;
+		c.mutations.clear();
+		c.mutation_counter = 1;
+		c.new_bits = 0;
+		c.mutation = e.args[1];
+		c.imported = false;
+
+		finish_candidate(w, c, t);
+		return true;
+	}
+
+	return false;
+}
+
+// Test cases from other instances, waiting to be compiled
+static std::mutex imports_mutex;
+static std::deque<node_ptr> imports;
+
+static bool next_import(worker &w, candidate &c)
+{
+	std::unique_lock<std::mutex> imports_lock(imports_mutex);
+	if (imports.empty())
+		return false;
+
+	c.root = imports.front();
+	imports.pop_front();
+	imports_lock.unlock();
+
+	uint64_t t = now_us();
+
+	auto leaves = std::make_shared<leaf_vec>();
+	leaves->reserve(c.root->nr_leaves);
+	find_leaves(c.root.get(), *leaves);
+	c.leaves = leaves;
+
+	// We can't make it again from a replay log
+	c.id = replay_out.skip();
+
+	c.generation = 0;
+	c.mutations.clear();
+	c.mutation_counter = 1;
+	c.new_bits = 0;
+	c.imported = true;
+
+	finish_candidate(w, c, t);
+	return true;
+}
+
+// Pick a test case from the queue and mutate it; returns false if
+// it's time to stop.
+static bool next_candidate(worker &w, candidate &c)
+{
+	if (replaying)
+		return replay_candidate(w, c);
+
+	if (next_import(w, c))
+		return true;
+
+	unsigned int nr_duplicates = 0;
+
+	while (!stop) {
+		std::unique_lock<std::mutex> pq_lock(pq_mutex);
 
-	while (true) {
 #if 0
 		printf("queue: ");
-		for (const auto &t: pq.set)
-			printf("%.2f ", t.score);
+		for (const auto &e: pq.heap)
+			printf("%.2f ", e.value.score);
 		printf("\n");
 #endif
 
 #if 1 // periodically resetting (restarting) everything seems beneficial for now; interesting future angle WRT SAT solver restarts
-		if (nr_execs_without_new_bits == 50) {
-			pq = fixed_priority_queue<testcase>(1200);
-			for (unsigned int i = 0; i < nr_mutations; ++i)
-				mutation_counters[i] = 0;
-			for (unsigned int i = 0; i < MAP_SIZE; ++i)
-				trace_bits_counters[i] = 0;
+		if (nr_execs_without_new_bits >= 50) {
+			// Start over from the best few test cases rather than
+			// from nothing at all
+			std::vector<testcase> seeds;
+			while (seeds.size() < nr_restart_seeds && !pq.empty())
+				seeds.push_back(pq.pop());
+
+			pq = fixed_priority_queue<testcase>(pq_size, max_corpus_bytes);
+			for (const auto &t: seeds)
+				pq.push(t);
+
+			for (auto &counter: mutation_counters)
+				counter = 0;
+			reset_virgin_bits();
+			reset_edge_hits();
 
 			nr_execs = 0;
 			nr_execs_without_new_bits = 0;
+			++nr_restarts;
 		}
 #endif
 
 		if (pq.empty() || std::uniform_real_distribution<>(0, 1)(re) < 0) {
 			// (re)seed/(re)initialise
-			pq.push(testcase(std::make_shared<node>(), 0, std::set<unsigned int>(), 1, 0));
+			auto root = make_node<node>();
+			pq.push(testcase(replay_out.write(no_parent, {}), root, std::make_shared<leaf_vec>(1, root.get()), 0, std::set<unsigned int>(), 1, 0, 0, 0, 0));
 		}
 
 		// I tried occasionally pop()ing the testcase but it tends to
@@ -321,91 +1061,177 @@ int main(int argc, char *argv[])
 		//auto current = (std::uniform_real_distribution<>(0, 1)(re) < .999999) ? pq.top() : pq.pop();
 		auto current = pq.top();
 
-		auto leaves = find_leaves(current.root);
-		if (leaves.size() == 0) {
+		if (current.leaves->empty()) {
 			pq.pop();
 			continue;
 		}
 
+		pq_lock.unlock();
+
+		uint64_t t = now_us();
+
 		// TODO: apply more than 1 mutation at a time
-		auto leaf = leaves[std::uniform_int_distribution<int>(0, leaves.size() - 1)(re)];
-		unsigned int mutation = std::uniform_int_distribution<int>(0, nr_mutations - 1)(re);
-		auto root = mutate(current.root, leaf, mutation);
-
-		struct timeval tv;
-		if (gettimeofday(&tv, 0) == -1)
-			error(EXIT_FAILURE, errno, "gettimeofday()");
-
-		int pipefd[2];
-		if (pipe2(pipefd, 0) == -1)
-			error(EXIT_FAILURE, errno, "pipe2()");
-
-		setup_shm();
-
-		pid_t child = fork();
-		if (child == -1)
-			error(EXIT_FAILURE, errno, "fork()");
-
-		if (child == 0) {
-			close(pipefd[1]);
-			dup2(pipefd[0], STDIN_FILENO);
-			close(pipefd[0]);
-			dup2(devnull, STDOUT_FILENO);
-
-			int stderr_fd = open(stderr_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-			if (stderr_fd == -1)
-				error(EXIT_FAILURE, errno, "open()");
-
-			dup2(stderr_fd, STDERR_FILENO);
-
-			// TODO: clean up, take from command line
-			//
-			// exec() the compiler. You need to substitute the path to your own compiler here.
-
-			//if (execlp("/usr/bin/g++-5", "g++", "-x", "c++", "-std=c++14", "-Os", "-c", "-", NULL) == -1)
-			//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/xgcc", "xgcc", "-x", "c++", "-std=c++14", "-O3", "-c", "-", NULL) == -1)
-			//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/xgcc", "xgcc", "-x", "c++", "-std=c++14", "-O3", "-Wall", "-fpermissive", "-g", "-pg", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", "-fsanitize=undefined", "-fsanitize=address", "-fsanitize=leak", "-c", "-", NULL) == -1)
-			//if (execlp("/home/vegard/personal/programming/gcc/build/gcc/xgcc", "xgcc", "-x", "c++", "-std=c++14", "-O3", "-Wall", "-fpermissive", "-g", "-pg", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", "-fsanitize=undefined", "-fsanitize=address", "-fsanitize=leak", "-S", "-", NULL) == -1)
-			// invoke cc1plus directly (skips fork+exec)
-			if (execlp("/home/vegard/personal/programming/gcc/build/gcc/cc1plus", "cc1plus", "-quiet", "-imultiarch", "x86_64-linux-gnu", "-iprefix", "/home/vegard/personal/programming/gcc/build/gcc/../lib/gcc/x86_64-pc-linux-gnu/8.0.1/", "-D_GNU_SOURCE", "-", "-quiet", "-dumpbase", "-", "-mtune=generic", "-march=x86-64", "-auxbase", "-", "-g", "-O3", "-Wall", "-std=c++14", "-p", "-fpermissive", "-fwhole-program", "-ftree-pre", "-fstack-protector-all", /*"-fsanitize=undefined",*/ "-fsanitize=address", "-fsanitize=leak", "-faggressive-loop-optimizations", "-fauto-inc-dec", "-fbranch-probabilities", "-fbranch-target-load-optimize2", "-fcheck-data-deps", "-fcompare-elim", "-fdce", "-fdse", "-fexpensive-optimizations", "-fhoist-adjacent-loads", "-fgcse-lm", "-fgcse-sm", "-fipa-profile", "-fno-toplevel-reorder", "-fsched-group-heuristic", "-fschedule-fusion", "-fschedule-insns", "-fschedule-insns2", "-ftracer", "-funroll-loops", "-fvect-cost-model", "-o", "-.s", NULL) == -1)
-				error(EXIT_FAILURE, errno, "execvp()");
+		auto leaves = std::make_shared<leaf_vec>(*current.leaves);
+		unsigned int leaf = std::uniform_int_distribution<int>(0, leaves->size() - 1)(re);
+		unsigned int mutation = mutation_scheduler.pick(re);
+		c.root = mutate(current.root, *leaves, leaf, mutation);
+
+		if (seen.insert(c.root->hash)) {
+			++w.stats.nr_duplicates;
+
+			// There may not be much left to make from it that we
+			// haven't compiled already
+			if (++nr_duplicates == max_duplicates_in_row) {
+				nr_duplicates = 0;
+
+				pq_lock.lock();
+				if (!pq.empty() && pq.top().root == current.root)
+					pq.pop();
+			}
+
+			continue;
 		}
 
-		close(pipefd[0]);
-		FILE *f = fdopen(pipefd[1], "w");
-		if (!f)
-			error(EXIT_FAILURE, errno, "fdopen()");
-		root->print(f);
-		fclose(f);
-
-		int status;
-		while (true) {
-			pid_t kid = waitpid(child, &status, 0);
-			if (kid == -1) {
-				if (errno == EINTR || errno == EAGAIN)
-					continue;
-				error(EXIT_FAILURE, errno, "waitpid()");
+		c.id = replay_out.write(current.id, { leaf, mutation });
+		c.leaves = leaves;
+
+		c.generation = current.generation;
+		c.mutations = current.mutations;
+		c.mutation_counter = current.mutation_counter;
+		c.new_bits = current.new_bits;
+		c.mutation = mutation;
+		c.imported = false;
+
+		finish_candidate(w, c, t);
+		return true;
+	}
+
+	return false;
+}
+
+// Non-fixed nodes are the ones we can take out again, outermost first
+static void find_reducible(const node *n, std::vector<const node *> &nodes)
+{
+	if (!n->fixed && (!n->children.empty() || !n->text.empty()))
+		nodes.push_back(n);
+
+	for (const auto &child: n->children)
+		find_reducible(child.get(), nodes);
+}
+
+// Shrink a tree that makes the compiler crash for as long as it keeps
+// crashing the same way (i.e. with an ICE in the same bucket). Every
+// node that isn't fixed was either put there by a mutation or is a hole,
+// so we can collapse it into an empty leaf or into one of its own
+// non-fixed children and the result is something the grammar could have
+// given us as well. Each pass goes over all of them and keeps every
+// change that makes the program smaller; we stop when a whole pass
+// doesn't find anything.
+static node_ptr reduce(worker &w, node_ptr root, const std::string &signature, unsigned int &nr_tests)
+{
+	time_t deadline = time(NULL) + max_reduce_seconds;
+	unsigned int size = root->size();
+
+	bool progress = true;
+	while (progress) {
+		progress = false;
+
+		// Keeps the nodes of this pass alive (and their addresses unique)
+		// even after they've been collapsed
+		node_ptr pass_root = root;
+		std::vector<const node *> nodes;
+		find_reducible(pass_root.get(), nodes);
+
+		for (const node *n: nodes) {
+			std::vector<node_ptr> replacements(1, make_node<node>());
+			for (const auto &child: n->children) {
+				if (!child->fixed)
+					replacements.push_back(child);
 			}
 
-			if (kid != child)
-				error(EXIT_FAILURE, 0, "kid != child");
+			for (const auto &replacement: replacements) {
+				if (time(NULL) >= deadline)
+					return root;
 
-			if (WIFEXITED(status) || WIFSIGNALED(status))
-				break;
+				// Also skips nodes that went away with an earlier change
+				auto new_root = replace(root, n, replacement);
+				unsigned int new_size = new_root->size();
+				if (new_size >= size)
+					continue;
+
+				std::string source;
+				new_root->print(source);
+
+				start_compiler(w, source);
+				bool timed_out;
+				int status = wait_compiler(w, timed_out);
+				++w.stats.nr_execs;
+				++nr_tests;
+
+				if (!timed_out && check_for_ice(w, status).key() == signature) {
+					root = new_root;
+					size = new_size;
+					progress = true;
+					break;
+				}
+			}
 		}
+	}
+
+	return root;
+}
+
+static void run_worker(worker &w)
+{
+	use_own_free_lists();
+
+	re = rng(w.seed);
+
+	uint8_t *trace_bits = w.trace.trace_bits;
+
+	// The one being compiled and the one we prepare in the meantime
+	candidate current;
+	candidate next;
+
+	if (!next_candidate(w, current))
+		return;
+
+	while (true) {
+		start_compiler(w, current.source);
+
+		// Keep the CPU busy while the compiler runs
+		bool have_next = next_candidate(w, next);
+
+		// That's timed as mutate/serialize; the compiler only costs us
+		// however long we still have to wait for it (which is also what
+		// the timeout is for)
+		uint64_t t = now_us();
+		bool timed_out;
+		int status = wait_compiler(w, timed_out);
+		uint64_t exec_us = now_us() - t;
+		t = w.stats.time(PHASE_COMPILE, t);
 
 		++nr_execs;
+		++w.stats.nr_execs;
+
+		if (timed_out && !quiet) {
+			flockfile(stdout);
+			printf("\e[31m%s: \e[0m", w.capture.too_much ? "too much output" : "timed out");
+			fwrite(current.source.data(), 1, current.source.size(), stdout);
+			printf("\n");
+			funlockfile(stdout);
+		}
 
 		if (WIFSIGNALED(status)) {
 #if 0 // Ignore segfaults for now, have to wait for a fix for https://gcc.gnu.org/bugzilla/show_bug.cgi?id=84576
 			printf("signal %d:\n", WTERMSIG(status));
-			root->print(stdout);
+			fwrite(current.source.data(), 1, current.source.size(), stdout);
 			printf("\n");
 
 			FILE *fp = fopen("/tmp/random.cc", "w");
 			if (!fp)
 				error(EXIT_FAILURE, errno, "fopen()");
-			root->print(fp);
+			fwrite(current.source.data(), 1, current.source.size(), fp);
 			fclose(fp);
 			break;
 #else
@@ -413,71 +1239,495 @@ int main(int argc, char *argv[])
 #endif
 		}
 
-		{
-			FILE *f = fopen(stderr_filename, "r");
-			if (!f)
-				error(EXIT_FAILURE, errno, "fopen()");
+		ice_bucket ice = check_for_ice(w, status);
+		bool new_ice = !ice.empty() && first_report(ice.key());
+		if (new_ice) {
+			unsigned int bug = next_bug_id();
 
-			static char buffer[10 * 4096];
-			size_t len = fread(buffer, 1, sizeof(buffer), f);
-			fclose(f);
+			flockfile(stdout);
+			printf("ICE in new bucket: %s\n", ice.key().c_str());
+			fwrite(current.source.data(), 1, current.source.size(), stdout);
+			printf("\n");
 
-			if (len > 0) {
-				buffer[len - 1] = '\0';
+			char filename[PATH_MAX];
+			snprintf(filename, sizeof(filename), "output/%lu-%u.cc", (unsigned long) current.time, bug);
+			printf("Writing reproducer to %s\n", filename);
+			write_reproducer(filename, current.source);
 
-				// Check for ICEs, but ignore a set of specific ones which we've
-				// already reported and which keep showing up.
-				if (strstr(buffer, "internal compiler error") && !strstr(buffer, "types may not be defined in parameter types") && !strstr(buffer, "internal compiler error: in synthesize_implicit_template_parm") && !strstr(buffer, "internal compiler error: in search_anon_aggr") && !strstr(buffer, "non_type_check") && !strstr(buffer, "internal compiler error: in xref_basetypes, at") && !strstr(buffer, "internal compiler error: in build_capture_proxy") && !strstr(buffer, "internal compiler error: tree check: expected record_type or union_type or qual_union_type, have array_type in reduced_constant_expression_p") && !strstr(buffer, "internal compiler error: in cp_lexer_new_from_tokens") && !strstr(buffer, "internal compiler error: in extract_constrain_insn") && !strstr(buffer, "in lra_eliminate_reg_if_possible") && !strstr(buffer, "Max. number of generated reload insns per insn is achieved") && !strstr(buffer, "standard_conversion") && !strstr(buffer, "in pop_local_binding") && !strstr(buffer, "of kind implicit_conv_expr") && !strstr(buffer, "in cp_build_addr_expr_1") && !strstr(buffer, "in poplevel_class, at") && !strstr(buffer, "force_constant_size")) {
-					printf("ICE:\n");
-					root->print(stdout);
-					printf("\n");
+			fputs(w.capture.buffer, stdout);
+			funlockfile(stdout);
 
-					char filename[PATH_MAX];
-					snprintf(filename, sizeof(filename), "output/%lu.cc", tv.tv_sec);
-					printf("Writing reproducer to %s\n", filename);
+			unsigned int nr_tests = 0;
+			std::string reduced_source;
+			reduce(w, current.root, ice.key(), nr_tests)->print(reduced_source);
 
-					FILE *fp = fopen(filename, "w");
-					if (!fp)
-						error(EXIT_FAILURE, errno, "fopen()");
-					root->print(fp);
-					fclose(fp);
+			snprintf(filename, sizeof(filename), "output/%lu-%u-reduced.cc", (unsigned long) current.time, bug);
+			write_reproducer(filename, reduced_source);
 
-					fwrite(buffer, 1, len, stdout);
-					remove_shm();
-					break;
-				}
-			}
+			flockfile(stdout);
+			printf("Reduced %s from %zu to %zu bytes in %u tests:\n", ice.message.c_str(), current.source.size(), reduced_source.size(), nr_tests);
+			fwrite(reduced_source.data(), 1, reduced_source.size(), stdout);
+			printf("\nWriting reduced reproducer to %s\n", filename);
+			funlockfile(stdout);
 		}
 
 		int success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+		// Found new bits in AFL instrumentation?
+		unsigned int new_bits = 0;
+		double rarity = 0;
+		if (success) {
+			classify_counts(trace_bits);
+			new_bits = has_new_bits(trace_bits);
+			rarity = record_edge_hits(trace_bits);
+			w.stats.time(PHASE_COVERAGE, t);
+		}
+
+		if (!current.imported)
+			mutation_scheduler.update(current.mutation, new_bits || new_ice, exec_us);
+
 		if (success) {
-			// Found new bits in AFL instrumentation?
-			unsigned int new_bits = 0;
-			for (unsigned int i = 0; i < MAP_SIZE; ++i) {
-				if (trace_bits[i]) {
-					if (++trace_bits_counters[i] == 1)
-						++new_bits;
-				}
-			}
 
 			if (new_bits)
 				nr_execs_without_new_bits = 0;
 			else
 				++nr_execs_without_new_bits;
 
+			uint64_t nr_samples;
+			uint64_t median_exec_us = w.stats.latency[PHASE_COMPILE].median(nr_samples);
+
 			auto mutations = current.mutations;
-			mutations.insert(mutation);
-			testcase new_testcase(root, current.generation + 1, mutations, current.mutation_counter + ++mutation_counters[mutation], current.new_bits + new_bits);
+			unsigned int mutation_counter = current.mutation_counter;
+			if (!current.imported) {
+				mutations.insert(current.mutation);
+				mutation_counter += ++mutation_counters[current.mutation];
+			}
 
-			printf("\e[31mcompiled (%u/%u | score %.2f | %u | %u): \e[0m", nr_execs, nr_execs_without_new_bits, new_testcase.score, pq.size(), new_bits);
-			root->print(stdout);
-			printf("\n");
+			testcase new_testcase(current.id, current.root, current.leaves, current.generation + 1, mutations, mutation_counter, current.new_bits + new_bits, rarity, exec_us, median_exec_us);
+
+			std::lock_guard<std::mutex> pq_lock(pq_mutex);
+
+			if (!quiet) {
+				flockfile(stdout);
+				printf("\e[31mcompiled (%u/%u | score %.2f | %u | %u): \e[0m", (unsigned int) nr_execs, (unsigned int) nr_execs_without_new_bits, new_testcase.score, pq.size(), new_bits);
+				fwrite(current.source.data(), 1, current.source.size(), stdout);
+				printf("\n");
+				funlockfile(stdout);
+			}
 
 			pq.push(new_testcase);
 		}
 
-		remove_shm();
+		if (!have_next)
+			break;
+
+		std::swap(current, next);
+	}
+}
+
+// The nodes of a number of trees, each one once (see node::save());
+// returns the ids of the roots
+static std::vector<uint32_t> save_trees(corpus_writer &out, const std::vector<node_ptr> &roots)
+{
+	std::unordered_map<const node *, uint32_t> ids;
+	std::vector<uint32_t> root_ids;
+
+	size_t nr_nodes_offset = out.reserve<uint32_t>();
+	for (const auto &root: roots)
+		root_ids.push_back(root->save(out, ids));
+	out.put_at<uint32_t>(nr_nodes_offset, ids.size());
+
+	return root_ids;
+}
+
+// Everything save_trees() saved, by id. Only one thread may load trees
+// at a time, since fixed nodes go into fixed_nodes.
+static std::vector<node_ptr> load_trees(corpus_reader &in)
+{
+	std::vector<node_ptr> nodes;
+	uint32_t nr_nodes = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_nodes; ++i) {
+		node_ptr n = node::load(in, nodes);
+
+		// Share fixed nodes with the grammar again, like we did
+		// before the checkpoint
+		if (n->fixed && n->children.empty()) {
+			auto &f = fixed_nodes[n->text];
+			if (!f)
+				f = n;
+			n = f;
+		}
+
+		nodes.push_back(n);
+	}
+
+	return nodes;
+}
+
+static void save_corpus()
+{
+	// At least as far along as the checkpoint
+	replay_out.flush();
+
+	std::vector<testcase> testcases;
+	uint8_t virgin[MAP_SIZE];
+	std::vector<uint32_t> hits(MAP_SIZE);
+
+	{
+		std::lock_guard<std::mutex> pq_lock(pq_mutex);
+
+		for (const auto &e: pq.heap)
+			testcases.push_back(e.value);
+		copy_virgin_bits(virgin);
+		copy_edge_hits(hits.data());
+	}
+
+	// Trees never change once they're in the queue, so it's fine
+	// to serialise them without holding the lock
+	corpus_writer out(corpus_magic);
+	out.put(virgin, MAP_SIZE);
+	out.put(hits.data(), MAP_SIZE * sizeof(hits[0]));
+
+	out.put<uint32_t>(mutation_counters.size());
+	for (const auto &counter: mutation_counters)
+		out.put<uint32_t>(counter);
+	mutation_scheduler.save(out);
+	out.put<uint32_t>(nr_restarts);
+
+	std::vector<node_ptr> roots;
+	for (const auto &t: testcases)
+		roots.push_back(t.root);
+	auto root_ids = save_trees(out, roots);
+
+	out.put<uint32_t>(testcases.size());
+	for (unsigned int i = 0; i < testcases.size(); ++i)
+		testcases[i].save(out, root_ids[i]);
+
+	out.save(corpus_filename);
+}
+
+static void load_corpus()
+{
+	corpus_reader in;
+	if (!in.open(corpus_filename, corpus_magic))
+		return;
+
+	in.get(virgin_bits, MAP_SIZE);
+	in.get(edge_hits, sizeof(edge_hits));
+
+	// The grammar may have changed since
+	uint32_t nr_saved_mutations = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_saved_mutations; ++i) {
+		unsigned int counter = in.get<uint32_t>();
+		if (nr_saved_mutations == mutation_counters.size())
+			mutation_counters[i] = counter;
+	}
+	mutation_scheduler.load(in);
+	nr_restarts = in.get<uint32_t>();
+
+	auto nodes = load_trees(in);
+
+	uint32_t nr_testcases = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_testcases; ++i)
+		pq.push(testcase::load(in, nodes));
+
+	printf("Loaded %u test cases from %s\n", nr_testcases, corpus_filename);
+}
+
+// What we give other instances: our coverage and our best test cases
+static const uint32_t sync_magic = 0x51594650; // "PFYQ"
+
+static void export_testcases(corpus_writer &out)
+{
+	std::vector<testcase> testcases;
+	uint8_t virgin[MAP_SIZE];
+
+	{
+		std::lock_guard<std::mutex> pq_lock(pq_mutex);
+
+		for (const auto &e: pq.heap)
+			testcases.push_back(e.value);
+		copy_virgin_bits(virgin);
+	}
+
+	std::sort(testcases.begin(), testcases.end());
+	if (testcases.size() > sync_nr_testcases)
+		testcases.erase(testcases.begin() + sync_nr_testcases, testcases.end());
+
+	out.put(virgin, MAP_SIZE);
+
+	std::vector<node_ptr> roots;
+	for (const auto &t: testcases)
+		roots.push_back(t.root);
+	auto root_ids = save_trees(out, roots);
+
+	out.put<uint32_t>(root_ids.size());
+	for (uint32_t id: root_ids)
+		out.put<uint32_t>(id);
+}
+
+static void import_testcases(corpus_reader &in, const char *peer)
+{
+	uint8_t virgin[MAP_SIZE];
+	in.get(virgin, MAP_SIZE);
+	if (!has_unseen_coverage(virgin))
+		return;
+
+	auto nodes = load_trees(in);
+
+	std::vector<node_ptr> roots;
+	uint32_t nr_roots = in.get<uint32_t>();
+	for (uint32_t i = 0; i < nr_roots; ++i) {
+		auto root = in.get_ref(nodes);
+		if (!seen.insert(root->hash))
+			roots.push_back(root);
+	}
+
+	std::lock_guard<std::mutex> imports_lock(imports_mutex);
+
+	unsigned int nr_imported = 0;
+	for (const auto &root: roots) {
+		if (imports.size() >= max_pending_imports)
+			break;
+
+		imports.push_back(root);
+		++nr_imported;
+	}
+
+	printf("Imported %u of %u test cases from %s\n", nr_imported, nr_roots, peer);
+}
+
+static campaign_stats get_campaign_stats()
+{
+	std::lock_guard<std::mutex> pq_lock(pq_mutex);
+
+	campaign_stats c;
+	c.queue_depth = pq.size();
+	c.total_bits = count_seen_entries();
+	c.restarts = nr_restarts;
+	return c;
+}
+
+// The benchmarks (bench.cc, bench-valid.cc) include everything but this
+#ifndef PROG_FUZZ_BENCH
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "forkserver", no_argument, 0, 'F' },
+		{ "jobs", required_argument, 0, 'j' },
+		{ "quiet", no_argument, 0, 'q' },
+		{ "plot", no_argument, 0, 'P' },
+		{ "timeout", required_argument, 0, 't' },
+		{ "corpus", required_argument, 0, 'c' },
+		{ "known-ices", required_argument, 0, 'k' },
+		{ "grammar", required_argument, 0, 'g' },
+		{ "memory", required_argument, 0, 'm' },
+		{ "seed", required_argument, 0, 's' },
+		{ "replay", required_argument, 0, 'r' },
+		{ "sync-dir", required_argument, 0, 'S' },
+		{ "sync-id", required_argument, 0, 'I' },
+		{ "max-stderr", required_argument, 0, 'e' },
+		{ 0, 0, 0, 0 },
+	};
+
+	// Number of workers running a compiler each
+	unsigned int nr_workers = 1;
+
+	// Append to plot_data as well as writing fuzzer_stats
+	bool plot = false;
+
+	// Fuzz with this grammar instead of the built-in one
+	const char *grammar_filename = nullptr;
+
+	// ICEs we don't report (known-ices.txt if there is one)
+	const char *known_ices_filename = nullptr;
+
+	// Random unless given (or taken from the replay log)
+	bool have_seed = false;
+
+	// Make the test cases in this log instead of choosing
+	const char *replay_filename = nullptr;
+
+	// Share test cases with other instances through this directory
+	const char *sync_dir_name = nullptr;
+	const char *sync_id = nullptr;
+
+	while (true) {
+		int c = getopt_long(argc, argv, "Fj:qPt:c:g:k:m:s:r:S:I:e:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'F':
+			use_forkserver = true;
+			break;
+		case 'j':
+			nr_workers = atoi(optarg);
+			if (nr_workers < 1)
+				error(EXIT_FAILURE, 0, "invalid number of jobs: %s", optarg);
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'P':
+			plot = true;
+			break;
+		case 't':
+			fixed_timeout_ms = atoi(optarg);
+			if (fixed_timeout_ms < 1)
+				error(EXIT_FAILURE, 0, "invalid timeout: %s", optarg);
+			break;
+		case 'c':
+			corpus_filename = optarg;
+			break;
+		case 'k':
+			known_ices_filename = optarg;
+			break;
+		case 'g':
+			grammar_filename = optarg;
+			break;
+		case 'm':
+			if (atoi(optarg) < 1)
+				error(EXIT_FAILURE, 0, "invalid memory limit: %s", optarg);
+			max_corpus_bytes = (size_t) atoi(optarg) << 20;
+			break;
+		case 'e':
+			if (atoi(optarg) < 1)
+				error(EXIT_FAILURE, 0, "invalid stderr limit: %s", optarg);
+			max_stderr = (size_t) atoi(optarg) << 10;
+			break;
+		case 's': {
+			char *end;
+			campaign_seed = strtoull(optarg, &end, 0);
+			if (!*optarg || *end)
+				error(EXIT_FAILURE, 0, "invalid seed: %s", optarg);
+			have_seed = true;
+			break;
+		}
+		case 'r':
+			replay_filename = optarg;
+			break;
+		case 'S':
+			sync_dir_name = optarg;
+			break;
+		case 'I':
+			sync_id = optarg;
+			break;
+		default:
+			error(EXIT_FAILURE, 0, "usage: %s [--forkserver] [--jobs N] [--quiet] [--plot] [--timeout MS] [--corpus FILE] [--grammar FILE] [--known-ices FILE] [--memory MB] [--seed N] [--replay FILE] [--sync-dir DIR] [--sync-id NAME] [--max-stderr KB]", argv[0]);
+		}
+	}
+
+	// Imports would make the replay something else
+	if (replay_filename && sync_dir_name)
+		error(EXIT_FAILURE, 0, "--replay and --sync-dir don't go together");
+
+	if (replay_filename) {
+		replay_in.load(replay_filename);
+		replaying = true;
+
+		if (!have_seed && replay_in.have_seed) {
+			campaign_seed = replay_in.seed;
+			have_seed = true;
+		}
+	}
+
+	if (!have_seed) {
+		std::random_device r;
+		campaign_seed = (uint64_t) r() << 32 | r();
 	}
 
+	printf("Seed: %" PRIu64 "\n", campaign_seed);
+	re = rng(campaign_seed);
+
+	pq.max_bytes = max_corpus_bytes;
+
+	if (grammar_filename)
+		load_grammar(grammar_filename);
+	else
+		load_builtin_grammar();
+	mutation_counters = std::vector<std::atomic<unsigned int>>(grammar.size());
+	mutation_scheduler = scheduler(grammar.size());
+
+	if (known_ices_filename) {
+		if (!load_known_ices(known_ices_filename))
+			error(EXIT_FAILURE, ENOENT, "%s: fopen()", known_ices_filename);
+	} else {
+		load_known_ices("known-ices.txt");
+	}
+
+	devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (devnull == -1)
+		error(EXIT_FAILURE, errno, "/dev/null: open()");
+
+	struct timeval tv_start;
+	if (gettimeofday(&tv_start, 0) == -1)
+		error(EXIT_FAILURE, errno, "gettimeofday()");
+
+	static char work_dir[PATH_MAX];
+	snprintf(work_dir, sizeof(work_dir), "work-%lu", tv_start.tv_sec);
+	if (mkdir(work_dir, 0755) == -1 && errno != EEXIST)
+		error(EXIT_FAILURE, errno, "%s: mkdir()", work_dir);
+
+	reset_virgin_bits();
+
+	// Nothing new to log while replaying
+	if (!replaying) {
+		char log_filename[PATH_MAX];
+		if (snprintf(log_filename, sizeof(log_filename), "%s/replay", work_dir) >= (int) sizeof(log_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+		replay_out.open(log_filename, campaign_seed);
+	} else {
+		printf("Replaying %s (%zu entries)\n", replay_in.filename, replay_in.entries.size());
+	}
+
+	static char default_corpus_filename[PATH_MAX];
+	if (!corpus_filename) {
+		if (snprintf(default_corpus_filename, sizeof(default_corpus_filename), "%s/corpus", work_dir) >= (int) sizeof(default_corpus_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+		corpus_filename = default_corpus_filename;
+	}
+
+	load_corpus();
+
+	static sync_dir sync;
+	if (sync_dir_name)
+		sync.setup(sync_dir_name, sync_id);
+
+	std::vector<worker> workers(nr_workers);
+	for (unsigned int i = 0; i < nr_workers; ++i)
+		setup_worker(workers[i], i, work_dir);
+
+	static stats_writer stats;
+	stats.setup(work_dir, plot);
+
+	std::vector<const worker_stats *> all_worker_stats;
+	for (auto &w: workers)
+		all_worker_stats.push_back(&w.stats);
+
+	uint64_t start_us = now_us();
+	for (auto &w: workers)
+		w.thread = std::thread(run_worker, std::ref(w));
+
+	std::thread stats_thread(run_stats, std::ref(stats), std::cref(all_worker_stats), std::cref(stop), get_campaign_stats);
+	std::thread checkpoint_thread(run_checkpoints, std::cref(stop), save_corpus);
+
+	std::thread sync_thread;
+	if (sync_dir_name)
+		sync_thread = std::thread(run_sync, std::ref(sync), std::cref(stop), sync_magic, export_testcases, import_testcases);
+
+	for (auto &w: workers)
+		w.thread.join();
+
+	// Only replays ever get here
+	printf("Replayed %u test cases in %.2f s; %u bits\n", (unsigned int) nr_execs, (now_us() - start_us) / 1e6, count_seen_entries());
+	stop = true;
+
+	stats_thread.join();
+	checkpoint_thread.join();
+	if (sync_thread.joinable())
+		sync_thread.join();
+
 	return 0;
 }
+#endif
@@ -0,0 +1,11 @@
+#! /bin/bash
+
+set -e
+set -x
+
+# TODO: make configurable
+AFL_PATH="$PWD/afl-2.52b"
+
+python rules2code.py < rules/cxx.txt > rules/cxx.hh
+g++ -std=c++11 -pthread -I"${AFL_PATH}" -Wall -Wno-unused-function -O2 -g -o bench bench.cc
+g++ -std=c++14 -pthread -I"${AFL_PATH}" -Wall -Wno-unused-function -O2 -g -o bench-valid bench-valid.cc
@@ -6,6 +6,6 @@ set -x
 # TODO: make configurable
 AFL_PATH="$PWD/afl-2.52b"
 
-g++ -std=c++14 -Wall -Wno-unused-function -I"${AFL_PATH}" -O2 -g -o main-valid main-valid.cc
+g++ -std=c++14 -pthread -Wall -Wno-unused-function -I"${AFL_PATH}" -O2 -g -o main-valid main-valid.cc
 
 mkdir -p output
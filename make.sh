@@ -7,6 +7,6 @@ set -x
 AFL_PATH="$PWD/afl-2.52b"
 
 python rules2code.py < rules/cxx.txt > rules/cxx.hh
-g++ -std=c++11 -I"${AFL_PATH}" -Wall -g -o main main.cc
+g++ -std=c++11 -pthread -I"${AFL_PATH}" -Wall -O2 -g -o main main.cc
 
 mkdir -p output
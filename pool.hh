@@ -0,0 +1,177 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_POOL_HH
+#define PROG_FUZZ_POOL_HH
+
+#include <errno.h>
+#include <error.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// Slab allocator for AST nodes.
+//
+// Nodes are small, all of a handful of sizes, and allocated and freed
+// at a very high rate (every mutation creates a few and every discarded
+// test case frees a few). Instead of going to malloc() for each one we
+// carve them out of big slabs and keep per-size free lists.
+//
+// The workers' free lists are per-thread, so there is no locking. A node
+// that was allocated by one worker and freed by another (test cases move
+// between workers through the shared queue) simply ends up on the other
+// worker's free list; slabs are never given back, so that's always safe.
+// Other threads (checkpoints, sync) make few nodes or none, but sometimes
+// drop the last reference to a worker's; a free list of their own would
+// never get used again, so they give blocks back to a list shared by
+// everybody, which the workers take over when they run out.
+//
+// Subtrees are shared between test cases, so we can't free a whole
+// generation at once; lifetimes are still managed by std::shared_ptr,
+// but the object and its control block live in the same pool block.
+
+// Set by use_own_free_lists()
+static thread_local bool has_own_free_lists;
+
+// For workers (and the benchmarks): call before making any nodes
+static void use_own_free_lists()
+{
+	has_own_free_lists = true;
+}
+
+template<size_t block_size>
+struct slab_pool {
+	static const size_t slab_size = 64 * 1024;
+
+	struct free_block {
+		free_block *next;
+	};
+
+	static thread_local free_block *free_list;
+
+	static std::mutex shared_mutex;
+	static free_block *shared_list;
+
+	static void refill()
+	{
+		char *slab = (char *) malloc(slab_size);
+		if (!slab)
+			error(EXIT_FAILURE, errno, "malloc()");
+
+		for (size_t i = 0; i + block_size <= slab_size; i += block_size) {
+			auto b = (free_block *) (slab + i);
+			b->next = free_list;
+			free_list = b;
+		}
+	}
+
+	static void *allocate()
+	{
+		if (!free_list) {
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			free_list = shared_list;
+			shared_list = nullptr;
+		}
+
+		if (!free_list)
+			refill();
+
+		free_block *b = free_list;
+		free_list = b->next;
+		return b;
+	}
+
+	static void deallocate(void *p)
+	{
+		auto b = (free_block *) p;
+
+		if (!has_own_free_lists) {
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			b->next = shared_list;
+			shared_list = b;
+			return;
+		}
+
+		b->next = free_list;
+		free_list = b;
+	}
+};
+
+template<size_t block_size>
+thread_local typename slab_pool<block_size>::free_block *slab_pool<block_size>::free_list;
+
+template<size_t block_size>
+std::mutex slab_pool<block_size>::shared_mutex;
+
+template<size_t block_size>
+typename slab_pool<block_size>::free_block *slab_pool<block_size>::shared_list;
+
+#ifdef PROG_FUZZ_BENCH
+// Node allocations so far, for the benchmarks (see bench.hh)
+static thread_local uint64_t nr_node_allocs;
+static thread_local uint64_t node_alloc_bytes;
+#endif
+
+template<typename T>
+struct pool_allocator {
+	typedef T value_type;
+
+	// Round up so that blocks of the same size class share a pool
+	static const size_t block_size = (sizeof(T) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+	pool_allocator()
+	{
+	}
+
+	template<typename U>
+	pool_allocator(const pool_allocator<U> &)
+	{
+	}
+
+	T *allocate(size_t n)
+	{
+		if (n != 1)
+			return (T *) ::operator new(n * sizeof(T));
+
+#ifdef PROG_FUZZ_BENCH
+		++nr_node_allocs;
+		node_alloc_bytes += block_size;
+#endif
+		return (T *) slab_pool<block_size>::allocate();
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if (n != 1) {
+			::operator delete(p);
+			return;
+		}
+
+		slab_pool<block_size>::deallocate(p);
+	}
+};
+
+template<typename T, typename U>
+static bool operator==(const pool_allocator<T> &, const pool_allocator<U> &)
+{
+	return true;
+}
+
+template<typename T, typename U>
+static bool operator!=(const pool_allocator<T> &, const pool_allocator<U> &)
+{
+	return false;
+}
+
+// Drop-in replacement for std::make_shared<T>() for AST nodes
+template<typename T, typename... Args>
+static std::shared_ptr<T> make_node(Args&&... args)
+{
+	return std::allocate_shared<T>(pool_allocator<T>(), std::forward<Args>(args)...);
+}
+
+#endif
@@ -0,0 +1,229 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_REPLAY_HH
+#define PROG_FUZZ_REPLAY_HH
+
+#include <errno.h>
+#include <error.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Replay logs.
+//
+// Every test case a worker makes gets a line in work-<time>/replay:
+//
+//   <id> <id of the one it was made from, or - if made from scratch> <args>
+//
+// where args is whatever else it takes to make the same test case again
+// (main: the leaf and the mutation; main-valid: the seed for the
+// transformations and which ones). With --replay we make exactly the
+// test cases in the log, in the same order, instead of choosing: the
+// same programs get compiled however the timing, the number of workers
+// or the scheduler differ, so two builds can be compared on the same
+// workload.
+
+static const uint64_t no_parent = UINT64_MAX;
+
+struct replay_log {
+	std::mutex mutex;
+	FILE *f;
+	uint64_t next_id;
+
+	replay_log():
+		f(nullptr),
+		next_id(0)
+	{
+	}
+
+	void open(const char *filename, uint64_t seed)
+	{
+		f = fopen(filename, "w");
+		if (!f)
+			error(EXIT_FAILURE, errno, "%s: fopen()", filename);
+
+		fprintf(f, "# seed %" PRIu64 "\n", seed);
+	}
+
+	// Returns the new test case's id (also if we're not logging)
+	uint64_t write(uint64_t parent, const std::vector<uint64_t> &args)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		uint64_t id = next_id++;
+		if (!f)
+			return id;
+
+		fprintf(f, "%" PRIu64, id);
+		if (parent == no_parent)
+			fputs(" -", f);
+		else
+			fprintf(f, " %" PRIu64, parent);
+		for (uint64_t arg: args)
+			fprintf(f, " %" PRIu64, arg);
+		fputc('\n', f);
+		return id;
+	}
+
+	// An id for a test case we can't make again (e.g. one loaded
+	// from a corpus); anything made from it can't be replayed either
+	uint64_t skip()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return next_id++;
+	}
+
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (f)
+			fflush(f);
+	}
+};
+
+struct replay_entry {
+	uint64_t id;
+	uint64_t parent;
+	std::vector<uint64_t> args;
+};
+
+// T is what a test case has to be made from again (a tree, a program)
+template<typename T>
+struct replay_reader {
+	const char *filename;
+
+	// the seed the log was recorded with
+	uint64_t seed;
+	bool have_seed;
+
+	std::vector<replay_entry> entries;
+	size_t pos;
+
+	// Test cases something later in the log is made from, with the
+	// number of entries still to come that are made from each
+	std::unordered_map<uint64_t, unsigned int> nr_children;
+	std::unordered_map<uint64_t, T> parents;
+
+	// Taking an entry and making its test case is one step
+	std::mutex mutex;
+
+	replay_reader():
+		filename(nullptr),
+		seed(0),
+		have_seed(false),
+		pos(0)
+	{
+	}
+
+	void load(const char *filename)
+	{
+		this->filename = filename;
+
+		FILE *f = fopen(filename, "r");
+		if (!f)
+			error(EXIT_FAILURE, errno, "%s: fopen()", filename);
+
+		char *line = nullptr;
+		size_t size = 0;
+		ssize_t len;
+		unsigned int line_nr = 0;
+		while ((len = getline(&line, &size, f)) != -1) {
+			++line_nr;
+
+			// A log that got cut off in the middle of a line
+			if (line[len - 1] != '\n')
+				break;
+
+			if (line[0] == '#') {
+				if (sscanf(line, "# seed %" SCNu64, &seed) == 1)
+					have_seed = true;
+				continue;
+			}
+
+			replay_entry e;
+			char *p = line;
+			char *end;
+			e.id = strtoull(p, &end, 10);
+			if (end == p)
+				error(EXIT_FAILURE, 0, "%s:%u: expected an id", filename, line_nr);
+			p = end;
+
+			while (*p == ' ')
+				++p;
+			if (*p == '-') {
+				e.parent = no_parent;
+				++p;
+			} else {
+				e.parent = strtoull(p, &end, 10);
+				if (end == p)
+					error(EXIT_FAILURE, 0, "%s:%u: expected a parent id", filename, line_nr);
+				p = end;
+				++nr_children[e.parent];
+			}
+
+			while (true) {
+				uint64_t arg = strtoull(p, &end, 10);
+				if (end == p)
+					break;
+				e.args.push_back(arg);
+				p = end;
+			}
+
+			if (*p != '\n')
+				error(EXIT_FAILURE, 0, "%s:%u: garbage at end of line", filename, line_nr);
+
+			entries.push_back(e);
+		}
+
+		free(line);
+		fclose(f);
+	}
+
+	// Call with mutex held; returns false at the end of the log
+	bool next(replay_entry &e)
+	{
+		if (pos == entries.size())
+			return false;
+
+		e = entries[pos++];
+		return true;
+	}
+
+	// Call with mutex held. Forgets about it once the last test case
+	// made from it has been made.
+	T get_parent(const replay_entry &e)
+	{
+		auto it = parents.find(e.parent);
+		if (it == parents.end())
+			error(EXIT_FAILURE, 0, "%s: %" PRIu64 " is made from %" PRIu64 ", which isn't in the log (was it recorded on top of --corpus?)", filename, e.id, e.parent);
+
+		T result = it->second;
+		if (--nr_children[e.parent] == 0) {
+			nr_children.erase(e.parent);
+			parents.erase(it);
+		}
+
+		return result;
+	}
+
+	// Call with mutex held; only kept if something is made from it
+	void add(uint64_t id, const T &x)
+	{
+		if (nr_children.count(id))
+			parents[id] = x;
+	}
+
+	// Bad arguments (e.g. the log is from a different grammar)
+	void invalid(const replay_entry &e)
+	{
+		error(EXIT_FAILURE, 0, "%s: can't make %" PRIu64 " again (recorded with a different grammar or version?)", filename, e.id);
+	}
+};
+
+#endif
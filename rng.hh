@@ -0,0 +1,74 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_RNG_HH
+#define PROG_FUZZ_RNG_HH
+
+#include <stdint.h>
+
+// xoshiro256** by David Blackman and Sebastiano Vigna (public domain,
+// http://xoshiro.di.unimi.it/). Much faster than std::mt19937 and
+// better than std::minstd_rand (which is what default_random_engine
+// is with libstdc++), and the state is small enough to give every
+// worker its own. Usable with the <random> distributions.
+
+// For expanding a 64-bit seed into a full state, as the authors
+// recommend; also good for deriving one seed from another
+static uint64_t splitmix64(uint64_t &x)
+{
+	uint64_t z = (x += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+struct rng {
+	typedef uint64_t result_type;
+
+	uint64_t s[4];
+
+	explicit rng(uint64_t seed = 0)
+	{
+		for (unsigned int i = 0; i < 4; ++i)
+			s[i] = splitmix64(seed);
+	}
+
+	static constexpr result_type min()
+	{
+		return 0;
+	}
+
+	static constexpr result_type max()
+	{
+		return UINT64_MAX;
+	}
+
+	static uint64_t rotl(uint64_t x, int k)
+	{
+		return (x << k) | (x >> (64 - k));
+	}
+
+	result_type operator()()
+	{
+		uint64_t result = rotl(s[1] * 5, 7) * 9;
+		uint64_t t = s[1] << 17;
+
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+
+		return result;
+	}
+};
+
+// The seed for stream number i of the campaign with the given seed
+// (there is one stream per worker)
+static uint64_t stream_seed(uint64_t seed, uint64_t i)
+{
+	uint64_t x = seed ^ splitmix64(i);
+	return splitmix64(x);
+}
+
+#endif
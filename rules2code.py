@@ -2,30 +2,29 @@ import os
 import re
 import sys
 
-# TODO: cleanup... lots of cleanup
+# Turns a grammar (see rules/cxx.txt) into a table of rules that gets
+# compiled into main.cc; each rule is a list of (text, fixed) parts, where
+# the parts that aren't fixed are the holes that later mutations fill in.
+# main.cc can also parse the same format itself at runtime (--grammar).
 lines = sys.stdin.read().splitlines()
 lines = [line for line in lines if not line.startswith('#') and line != '']
 
-print "const unsigned int nr_mutations = %u;" % (len(lines), )
-
-print "static node_ptr mutate(node_ptr root, node_ptr leaf, unsigned int mutation)"
-print "{"
-print "\tauto replacement = std::make_shared<node>();"
-print "\tswitch (mutation) {"
-
 for i, line in enumerate(lines):
-    print "\tcase %u:" % (i, )
-
+    parts = []
     for word in re.split(r'((?<!\\)\[.*?(?<!\\)\])', line[1:-1]):
         if word.startswith('['):
             word = re.sub(r'\\([\[\]])', r'\1', word[1:-1])
-            print "\t\treplacement->children.push_back(std::make_shared<node>(\"%s\"));" % (word, )
+            parts.append("{ \"%s\", false }" % (word, ))
         else:
             word = re.sub(r'\\([\[\]])', r'\1', word)
-            print "\t\treplacement->children.push_back(std::make_shared<node>(\"%s\", true));" % (word, )
+            parts.append("{ \"%s\", true }" % (word, ))
 
-    print "\t\tbreak;"
+    print "static constexpr rule_part rule_%u_parts[] = { %s };" % (i, ", ".join(parts))
 
-print "\t}"
-print "\treturn replace(root, leaf, replacement);"
-print "}"
+print
+print "static constexpr rule builtin_rules[] = {"
+for i, line in enumerate(lines):
+    print "\t{ rule_%u_parts, sizeof(rule_%u_parts) / sizeof(rule_%u_parts[0]) }," % (i, i, i)
+print "};"
+print
+print "static const unsigned int nr_builtin_rules = %u;" % (len(lines), )
@@ -0,0 +1,131 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_SCHEDULER_HH
+#define PROG_FUZZ_SCHEDULER_HH
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <vector>
+
+#include "corpus.hh"
+#include "rng.hh"
+
+// Choosing what to do to a test case next.
+//
+// Every mutation (main) or transformation (main-valid) is an arm of a
+// bandit. We count how often each one has been tried, how often that
+// paid off (new coverage or a bug) and how much compiler time it cost,
+// and pick the next one by Thompson sampling: draw a plausible payoff
+// rate for each arm from its Beta posterior, divide by the arm's average
+// cost and take the best. Arms that rarely find anything, or that make
+// programs which are slow to compile, get picked less, but never stop
+// being picked altogether.
+//
+// The counters are shared between all workers and updated without a
+// lock; a sample that's slightly out of date doesn't matter. They
+// survive restarts of the queue, since which rules tend to pay off
+// doesn't change much when we start over.
+
+// Beyond this many tries an arm's posterior stops getting narrower, so
+// it can catch up when what it's good at changes during a campaign
+static const uint64_t max_effective_tries = 1000;
+
+struct arm_stats {
+	std::atomic<uint64_t> nr_tries;
+	std::atomic<uint64_t> nr_hits;
+	std::atomic<uint64_t> cost_us;
+
+	arm_stats():
+		nr_tries(0),
+		nr_hits(0),
+		cost_us(0)
+	{
+	}
+};
+
+struct scheduler {
+	std::vector<arm_stats> arms;
+
+	explicit scheduler(unsigned int nr_arms = 0):
+		arms(nr_arms)
+	{
+	}
+
+	unsigned int pick(rng &re) const
+	{
+		// What an arm we know nothing about is assumed to cost
+		uint64_t total_tries = 0;
+		uint64_t total_cost_us = 0;
+		for (const auto &arm: arms) {
+			total_tries += arm.nr_tries.load(std::memory_order_relaxed);
+			total_cost_us += arm.cost_us.load(std::memory_order_relaxed);
+		}
+		double default_cost_us = total_tries ? (double) total_cost_us / total_tries : 1;
+
+		unsigned int best = 0;
+		double best_score = -1;
+		for (unsigned int i = 0; i < arms.size(); ++i) {
+			uint64_t tries = arms[i].nr_tries.load(std::memory_order_relaxed);
+			uint64_t hits = std::min(tries, arms[i].nr_hits.load(std::memory_order_relaxed));
+			double cost_us = tries ? (double) arms[i].cost_us.load(std::memory_order_relaxed) / tries : default_cost_us;
+
+			double a = hits;
+			double b = tries - hits;
+			if (tries > max_effective_tries) {
+				a *= (double) max_effective_tries / tries;
+				b *= (double) max_effective_tries / tries;
+			}
+
+			// Beta(a + 1, b + 1) from two gamma variates
+			double x = std::gamma_distribution<double>(a + 1)(re);
+			double y = std::gamma_distribution<double>(b + 1)(re);
+			double score = x / (x + y) / std::max(cost_us, 1.);
+			if (score > best_score) {
+				best = i;
+				best_score = score;
+			}
+		}
+
+		return best;
+	}
+
+	void update(unsigned int arm, bool hit, uint64_t cost_us)
+	{
+		arms[arm].nr_tries.fetch_add(1, std::memory_order_relaxed);
+		if (hit)
+			arms[arm].nr_hits.fetch_add(1, std::memory_order_relaxed);
+		arms[arm].cost_us.fetch_add(cost_us, std::memory_order_relaxed);
+	}
+
+	void save(corpus_writer &out) const
+	{
+		out.put<uint32_t>(arms.size());
+		for (const auto &arm: arms) {
+			out.put<uint64_t>(arm.nr_tries);
+			out.put<uint64_t>(arm.nr_hits);
+			out.put<uint64_t>(arm.cost_us);
+		}
+	}
+
+	// What we know is thrown away if the set of arms has changed
+	void load(corpus_reader &in)
+	{
+		uint32_t nr_saved_arms = in.get<uint32_t>();
+		for (uint32_t i = 0; i < nr_saved_arms; ++i) {
+			uint64_t tries = in.get<uint64_t>();
+			uint64_t hits = in.get<uint64_t>();
+			uint64_t cost_us = in.get<uint64_t>();
+
+			if (nr_saved_arms == arms.size()) {
+				arms[i].nr_tries = tries;
+				arms[i].nr_hits = hits;
+				arms[i].cost_us = cost_us;
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,62 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_SEEN_HH
+#define PROG_FUZZ_SEEN_HH
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "rng.hh"
+
+// Programs we've already compiled, so we don't compile them again.
+//
+// Different mutations often end up with the same program text, and a
+// transformation that doesn't find anything to transform gives back the
+// program it got. This is a Bloom filter over 64-bit hashes of the
+// programs, shared between all workers and updated without a lock. It
+// sometimes says we've seen a program when we haven't (about 1 in 200
+// after 10 million programs), but never the other way around, and it
+// stays the same size (16 MB) however long the campaign runs. It isn't
+// saved with the corpus.
+
+static const unsigned int seen_filter_log2_bits = 27;
+static const unsigned int seen_filter_nr_hashes = 4;
+
+// How many duplicates in a row before we give up on what we're making
+// them from
+static const unsigned int max_duplicates_in_row = 100;
+
+struct seen_filter {
+	std::vector<std::atomic<uint64_t>> words;
+
+	seen_filter():
+		words((size_t) 1 << (seen_filter_log2_bits - 6))
+	{
+	}
+
+	// Returns true if it was (probably) there already
+	bool insert(uint64_t hash)
+	{
+		// Double hashing; the second one is odd so that every hash
+		// we derive from them is different
+		uint64_t x = hash;
+		uint64_t h1 = splitmix64(x);
+		uint64_t h2 = splitmix64(x) | 1;
+
+		const uint64_t mask = ((uint64_t) 1 << seen_filter_log2_bits) - 1;
+
+		bool seen = true;
+		for (unsigned int i = 0; i < seen_filter_nr_hashes; ++i) {
+			uint64_t bit = (h1 + i * h2) & mask;
+			uint64_t m = (uint64_t) 1 << (bit & 63);
+			if (!(words[bit >> 6].fetch_or(m, std::memory_order_relaxed) & m))
+				seen = false;
+		}
+
+		return seen;
+	}
+};
+
+#endif
@@ -0,0 +1,328 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_STATS_HH
+#define PROG_FUZZ_STATS_HH
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// From AFL
+#include "config.h"
+
+// Campaign statistics, written out periodically to an AFL-style
+// fuzzer_stats file (and optionally appended to a plot_data CSV) in
+// the work directory.
+
+enum phase {
+	PHASE_MUTATE,
+	PHASE_SERIALIZE,
+	PHASE_COMPILE,
+	PHASE_LINK,
+	PHASE_RUN,
+	PHASE_COVERAGE,
+	NR_PHASES,
+};
+
+static const char *phase_names[NR_PHASES] = {
+	"mutate",
+	"serialize",
+	"compile",
+	"link",
+	"run",
+	"coverage",
+};
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		error(EXIT_FAILURE, errno, "clock_gettime()");
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Log-linear latency histogram (in microseconds): 4 buckets for
+// every power of two, which gives percentiles within ~20%.
+struct latency_histogram {
+	static const unsigned int sub_buckets = 4;
+	static const unsigned int nr_buckets = 64 * sub_buckets;
+
+	// Only the owning worker updates these; the stats writer reads
+	std::atomic<uint64_t> buckets[nr_buckets];
+
+	latency_histogram()
+	{
+		for (auto &b: buckets)
+			b.store(0, std::memory_order_relaxed);
+	}
+
+	static unsigned int bucket(uint64_t us)
+	{
+		if (us < sub_buckets)
+			return us;
+
+		unsigned int log = 63 - __builtin_clzll(us);
+		unsigned int sub = (us >> (log - 2)) & (sub_buckets - 1);
+		return (log - 1) * sub_buckets + sub;
+	}
+
+	// Smallest value that falls into the given bucket
+	static uint64_t bucket_start(unsigned int i)
+	{
+		if (i < sub_buckets)
+			return i;
+
+		unsigned int log = i / sub_buckets + 1;
+		return (uint64_t) (sub_buckets + i % sub_buckets) << (log - 2);
+	}
+
+	void add(uint64_t us)
+	{
+		auto &b = buckets[bucket(us)];
+		b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	// Median so far; total gets the number of samples
+	uint64_t median(uint64_t &total) const
+	{
+		total = 0;
+		for (const auto &b: buckets)
+			total += b.load(std::memory_order_relaxed);
+
+		uint64_t n = 0;
+		for (unsigned int i = 0; i < nr_buckets; ++i) {
+			n += buckets[i].load(std::memory_order_relaxed);
+			if (n > total / 2)
+				return bucket_start(i);
+		}
+
+		return 0;
+	}
+};
+
+// Execution timeouts. Unless a fixed one was given on the command line,
+// each worker calibrates its own as a multiple of the median time that
+// phase has taken so far, rounded up and never below AFL's default.
+static const unsigned int timeout_multiplier = 5;
+static const unsigned int calibration_runs = 20;
+static const unsigned int initial_timeout_ms = 10 * EXEC_TIMEOUT;
+
+// Per-worker counters
+struct worker_stats {
+	std::atomic<uint64_t> nr_execs;
+	std::atomic<uint64_t> nr_timeouts;
+	std::atomic<unsigned int> last_timeout_ms;
+	latency_histogram latency[NR_PHASES];
+
+	// candidates we didn't run because we'd seen them before (seen.hh)
+	std::atomic<uint64_t> nr_duplicates;
+
+	worker_stats():
+		nr_execs(0),
+		nr_timeouts(0),
+		last_timeout_ms(0),
+		nr_duplicates(0)
+	{
+	}
+
+	// Deadline for one run of the given phase (fixed_ms if non-zero)
+	unsigned int timeout_ms(phase ph, unsigned int fixed_ms)
+	{
+		unsigned int ms = fixed_ms;
+		if (!ms) {
+			uint64_t total;
+			uint64_t median_us = latency[ph].median(total);
+
+			if (total < calibration_runs) {
+				ms = initial_timeout_ms;
+			} else {
+				ms = timeout_multiplier * median_us / 1000;
+				ms = (ms + EXEC_TM_ROUND) / EXEC_TM_ROUND * EXEC_TM_ROUND;
+				ms = std::max<unsigned int>(ms, EXEC_TIMEOUT);
+			}
+		}
+
+		last_timeout_ms.store(ms, std::memory_order_relaxed);
+		return ms;
+	}
+
+	// Time one phase of a run; usage: t = s.time(PHASE_X, t);
+	uint64_t time(phase ph, uint64_t start)
+	{
+		uint64_t end = now_us();
+		latency[ph].add(end - start);
+		return end;
+	}
+};
+
+// Whatever the fuzzer knows that the workers don't
+struct campaign_stats {
+	unsigned int queue_depth;
+	unsigned int total_bits;
+	unsigned int restarts;
+};
+
+struct stats_writer {
+	char stats_filename[PATH_MAX];
+	char tmp_filename[PATH_MAX];
+	char plot_filename[PATH_MAX];
+	bool plot;
+
+	time_t start_time;
+	uint64_t start_us;
+
+	uint64_t last_execs;
+	uint64_t last_us;
+
+	void setup(const char *work_dir, bool plot)
+	{
+		if (snprintf(stats_filename, sizeof(stats_filename), "%s/fuzzer_stats", work_dir) >= (int) sizeof(stats_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+		if (snprintf(tmp_filename, sizeof(tmp_filename), "%s/.fuzzer_stats.tmp", work_dir) >= (int) sizeof(tmp_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+		if (snprintf(plot_filename, sizeof(plot_filename), "%s/plot_data", work_dir) >= (int) sizeof(plot_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", work_dir);
+
+		this->plot = plot;
+		start_time = time(NULL);
+		start_us = now_us();
+		last_execs = 0;
+		last_us = start_us;
+
+		if (plot) {
+			FILE *f = fopen(plot_filename, "w");
+			if (!f)
+				error(EXIT_FAILURE, errno, "%s: fopen()", plot_filename);
+
+			fprintf(f, "# unix_time, execs_done, execs_per_sec, queue_depth, total_bits, restarts, duplicates");
+			for (unsigned int i = 0; i < NR_PHASES; ++i)
+				fprintf(f, ", %s_p50_us, %s_p99_us", phase_names[i], phase_names[i]);
+			fprintf(f, "\n");
+			fclose(f);
+		}
+	}
+
+	static uint64_t percentile(const std::vector<uint64_t> &buckets, uint64_t total, double p)
+	{
+		if (!total)
+			return 0;
+
+		uint64_t target = p * total;
+		uint64_t n = 0;
+		for (unsigned int i = 0; i < buckets.size(); ++i) {
+			n += buckets[i];
+			if (n > target)
+				return latency_histogram::bucket_start(i);
+		}
+
+		return latency_histogram::bucket_start(buckets.size() - 1);
+	}
+
+	void write(const std::vector<const worker_stats *> &workers, const campaign_stats &c)
+	{
+		uint64_t now = now_us();
+
+		uint64_t execs = 0;
+		uint64_t timeouts = 0;
+		uint64_t duplicates = 0;
+		unsigned int exec_timeout = 0;
+		for (auto w: workers) {
+			execs += w->nr_execs.load(std::memory_order_relaxed);
+			timeouts += w->nr_timeouts.load(std::memory_order_relaxed);
+			duplicates += w->nr_duplicates.load(std::memory_order_relaxed);
+			exec_timeout = std::max(exec_timeout, w->last_timeout_ms.load(std::memory_order_relaxed));
+		}
+
+		// Overall and recent execution speed
+		double execs_per_sec = now > start_us ? 1e6 * execs / (now - start_us) : 0;
+		double recent_execs_per_sec = now > last_us ? 1e6 * (execs - last_execs) / (now - last_us) : 0;
+		last_execs = execs;
+		last_us = now;
+
+		uint64_t p50[NR_PHASES];
+		uint64_t p99[NR_PHASES];
+		for (unsigned int i = 0; i < NR_PHASES; ++i) {
+			std::vector<uint64_t> buckets(latency_histogram::nr_buckets);
+			uint64_t total = 0;
+			for (auto w: workers) {
+				for (unsigned int j = 0; j < buckets.size(); ++j) {
+					uint64_t n = w->latency[i].buckets[j].load(std::memory_order_relaxed);
+					buckets[j] += n;
+					total += n;
+				}
+			}
+
+			p50[i] = percentile(buckets, total, .50);
+			p99[i] = percentile(buckets, total, .99);
+		}
+
+		// Write a new file and rename it so readers never see a partial one
+		FILE *f = fopen(tmp_filename, "w");
+		if (!f)
+			error(EXIT_FAILURE, errno, "%s: fopen()", tmp_filename);
+
+		fprintf(f, "start_time        : %lu\n", (unsigned long) start_time);
+		fprintf(f, "last_update       : %lu\n", (unsigned long) time(NULL));
+		fprintf(f, "fuzzer_pid        : %u\n", (unsigned int) getpid());
+		fprintf(f, "workers           : %zu\n", workers.size());
+		fprintf(f, "execs_done        : %lu\n", (unsigned long) execs);
+		fprintf(f, "execs_per_sec     : %.2f\n", execs_per_sec);
+		fprintf(f, "recent_execs_sec  : %.2f\n", recent_execs_per_sec);
+		fprintf(f, "queue_depth       : %u\n", c.queue_depth);
+		fprintf(f, "total_bits        : %u\n", c.total_bits);
+		fprintf(f, "restarts          : %u\n", c.restarts);
+		fprintf(f, "exec_timeout      : %u\n", exec_timeout);
+		fprintf(f, "timeouts          : %lu\n", (unsigned long) timeouts);
+		fprintf(f, "duplicates        : %lu\n", (unsigned long) duplicates);
+		fprintf(f, "duplicate_rate    : %.2f%%\n", execs + duplicates ? 100. * duplicates / (execs + duplicates) : 0.);
+		for (unsigned int i = 0; i < NR_PHASES; ++i) {
+			fprintf(f, "%-10s p50_us : %lu\n", phase_names[i], (unsigned long) p50[i]);
+			fprintf(f, "%-10s p99_us : %lu\n", phase_names[i], (unsigned long) p99[i]);
+		}
+		fclose(f);
+
+		if (rename(tmp_filename, stats_filename) == -1)
+			error(EXIT_FAILURE, errno, "%s: rename()", stats_filename);
+
+		if (plot) {
+			FILE *f = fopen(plot_filename, "a");
+			if (!f)
+				error(EXIT_FAILURE, errno, "%s: fopen()", plot_filename);
+
+			fprintf(f, "%lu, %lu, %.2f, %u, %u, %u, %lu", (unsigned long) time(NULL), (unsigned long) execs, recent_execs_per_sec, c.queue_depth, c.total_bits, c.restarts, (unsigned long) duplicates);
+			for (unsigned int i = 0; i < NR_PHASES; ++i)
+				fprintf(f, ", %lu, %lu", (unsigned long) p50[i], (unsigned long) p99[i]);
+			fprintf(f, "\n");
+			fclose(f);
+		}
+	}
+};
+
+// How often the stats get written (in seconds)
+static const unsigned int stats_interval = 5;
+
+// Body of the stats thread: write the stats every stats_interval
+// seconds until stop gets set, and once more at the end.
+static void run_stats(stats_writer &s, const std::vector<const worker_stats *> &workers, const std::atomic<bool> &stop, campaign_stats (*get_campaign_stats)())
+{
+	unsigned int seconds = 0;
+	while (!stop) {
+		sleep(1);
+		if (++seconds % stats_interval == 0)
+			s.write(workers, get_campaign_stats());
+	}
+
+	s.write(workers, get_campaign_stats());
+}
+
+#endif
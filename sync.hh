@@ -0,0 +1,179 @@
+// Copyright (C) 2018  Vegard Nossum <vegard.nossum@oracle.com>
+
+#ifndef PROG_FUZZ_SYNC_HH
+#define PROG_FUZZ_SYNC_HH
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+#include "afl.hh"
+#include "corpus.hh"
+
+// Sync directories, like AFL's.
+//
+// With --sync-dir DIR, every instance (called --sync-id, or host-pid)
+// writes its coverage map and its best test cases to DIR/<id>/export
+// every sync_interval seconds, and reads the exports of all the others
+// that changed since it last looked. An export that doesn't have any
+// coverage we haven't seen ourselves gets skipped without looking at
+// its test cases; otherwise the test cases we haven't already compiled
+// (see seen.hh) go to the workers, which compile them before anything
+// of their own. They only end up in the queue or pool if they find
+// something new here as well.
+//
+// DIR can be on a file system shared between hosts; exports get written
+// to a new file and renamed (see corpus_writer::save()), so nobody ever
+// reads half of one. The format is that of the corpus checkpoints.
+
+// How often we export and import (in seconds)
+static const unsigned int sync_interval = 30;
+
+// How many test cases we export
+static const unsigned int sync_nr_testcases = 100;
+
+// How many imported ones may be waiting for the workers at a time
+static const unsigned int max_pending_imports = 1000;
+
+struct sync_dir {
+	char dir[PATH_MAX];
+	char id[NAME_MAX];
+	char export_filename[PATH_MAX];
+
+	// Modification time of every export we've imported
+	std::unordered_map<std::string, struct timespec> imported;
+
+	void setup(const char *dir, const char *id)
+	{
+		if (snprintf(this->dir, sizeof(this->dir), "%s", dir) >= (int) sizeof(this->dir))
+			error(EXIT_FAILURE, 0, "%s: path too long", dir);
+
+		if (id) {
+			if (!*id || strchr(id, '/') || !strcmp(id, ".") || !strcmp(id, ".."))
+				error(EXIT_FAILURE, 0, "invalid sync id: %s", id);
+			if (snprintf(this->id, sizeof(this->id), "%s", id) >= (int) sizeof(this->id))
+				error(EXIT_FAILURE, 0, "%s: sync id too long", id);
+		} else {
+			char hostname[HOST_NAME_MAX + 1];
+			if (gethostname(hostname, sizeof(hostname)) == -1)
+				error(EXIT_FAILURE, errno, "gethostname()");
+			hostname[HOST_NAME_MAX] = '\0';
+			snprintf(this->id, sizeof(this->id), "%s-%u", hostname, (unsigned int) getpid());
+		}
+
+		if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+			error(EXIT_FAILURE, errno, "%s: mkdir()", dir);
+
+		char own_dir[PATH_MAX];
+		if (snprintf(own_dir, sizeof(own_dir), "%s/%s", dir, this->id) >= (int) sizeof(own_dir))
+			error(EXIT_FAILURE, 0, "%s: path too long", dir);
+		if (mkdir(own_dir, 0755) == -1 && errno != EEXIST)
+			error(EXIT_FAILURE, errno, "%s: mkdir()", own_dir);
+
+		if (snprintf(export_filename, sizeof(export_filename), "%s/export", own_dir) >= (int) sizeof(export_filename))
+			error(EXIT_FAILURE, 0, "%s: path too long", own_dir);
+
+		printf("Syncing with %s as %s\n", dir, this->id);
+	}
+
+	static bool is_export(const char *filename, uint32_t magic)
+	{
+		int fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return false;
+
+		uint32_t header[2];
+		bool ok = read(fd, header, sizeof(header)) == sizeof(header) && header[0] == magic && header[1] == corpus_version;
+		close(fd);
+		return ok;
+	}
+
+	// Calls import() for every other instance's export that's new or
+	// changed since last time
+	void import_all(uint32_t magic, void (*import)(corpus_reader &in, const char *peer))
+	{
+		DIR *d = opendir(dir);
+		if (!d)
+			error(EXIT_FAILURE, errno, "%s: opendir()", dir);
+
+		while (struct dirent *e = readdir(d)) {
+			if (e->d_name[0] == '.' || !strcmp(e->d_name, id))
+				continue;
+
+			char filename[PATH_MAX];
+			if (snprintf(filename, sizeof(filename), "%s/%s/export", dir, e->d_name) >= (int) sizeof(filename))
+				continue;
+
+			// Somebody that hasn't exported anything yet
+			struct stat st;
+			if (stat(filename, &st) == -1)
+				continue;
+
+			auto it = imported.find(e->d_name);
+			bool first = it == imported.end();
+			if (!first && it->second.tv_sec == st.st_mtim.tv_sec && it->second.tv_nsec == st.st_mtim.tv_nsec)
+				continue;
+			imported[e->d_name] = st.st_mtim;
+
+			// The other fuzzer, or another version of this one
+			if (!is_export(filename, magic)) {
+				if (first)
+					printf("Not syncing with %s: not the same fuzzer\n", e->d_name);
+				continue;
+			}
+
+			corpus_reader in;
+			if (in.open(filename, magic))
+				import(in, e->d_name);
+		}
+
+		closedir(d);
+	}
+};
+
+// Whether a coverage map (virgin bits) from somewhere else has anything
+// we haven't seen ourselves
+static bool has_unseen_coverage(const uint8_t *their_virgin_bits)
+{
+	for (unsigned int i = 0; i < MAP_SIZE; ++i) {
+		uint8_t ours = __atomic_load_n(&virgin_bits[i], __ATOMIC_RELAXED);
+		if (~their_virgin_bits[i] & ours)
+			return true;
+	}
+
+	return false;
+}
+
+// Body of the sync thread: export (with export_testcases()) and import
+// every sync_interval seconds until stop gets set.
+static void run_sync(sync_dir &s, const std::atomic<bool> &stop, uint32_t magic, void (*export_testcases)(corpus_writer &out), void (*import)(corpus_reader &in, const char *peer))
+{
+	unsigned int seconds = 0;
+	while (!stop) {
+		sleep(1);
+		if (++seconds % sync_interval)
+			continue;
+
+		corpus_writer out(magic);
+		export_testcases(out);
+		out.save(s.export_filename);
+
+		s.import_all(magic, import);
+	}
+}
+
+#endif